@@ -30,6 +30,7 @@
 
 	/* Function, variable, etc., attributes.  */
 
+#define	__aligned(x)		__attribute__ ((__aligned__ (x)))
 #define	__noreturn		__attribute__ ((__noreturn__))
 #define	__packed		__attribute__ ((__packed__))
 #define	__printf(f, va)		__attribute__ ((__format__ (__printf__, f, va)))
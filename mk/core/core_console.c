@@ -223,7 +223,7 @@ console_startup(void *arg)
 	int error;
 
 	error = ipc_service("console", IPC_PORT_CONSOLE, IPC_PORT_FLAG_PUBLIC | IPC_PORT_FLAG_NEW,
-			    console_handler, NULL);
+			    1, console_handler, NULL);
 	if (error != 0)
 		panic("%s: ipc_service failed: %m", __func__, error);
 }
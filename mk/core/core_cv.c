@@ -35,6 +35,16 @@ cv_create(struct mutex *mtx)
 	return (cv);
 }
 
+void
+cv_destroy(struct cv *cv)
+{
+	CV_LOCK(cv);
+	ASSERT(sleepq_empty(&cv->cv_sleepq),
+	       "Cannot destroy a condition variable with waiters.");
+	CV_UNLOCK(cv);
+	pool_free(cv);
+}
+
 void
 cv_signal(struct cv *cv)
 {
@@ -11,17 +11,28 @@
 #include <vm/vm.h>
 #include <vm/vm_alloc.h>
 #include <vm/vm_index.h>
+#include <vm/vm_map.h>
+#include <vm/vm_object.h>
 #include <vm/vm_page.h>
 
-static int exec_elf64_load(struct vm *, vaddr_t *, fs_file_read_op_t *, fs_context_t, fs_file_context_t);
-static int exec_read(fs_file_read_op_t *, fs_context_t, fs_file_context_t, void *, off_t, size_t);
+static int exec_elf64_load(struct vm *, vaddr_t *, struct vm_object *);
 
 int
-exec_load(struct vm *vm, vaddr_t *entryp, const char *name, fs_file_read_op_t *readf, fs_context_t fsc, fs_file_context_t fsfc)
+exec_load(struct vm *vm, vaddr_t *entryp, struct fs *fs, const char *name)
 {
+	struct vm_object *vmo;
 	int error;
 
-	error = exec_elf64_load(vm, entryp, readf, fsc, fsfc);
+	/*
+	 * The program is paged in from its own VM object as it runs, so we
+	 * don't read anything here beyond the headers.
+	 */
+	error = vm_object_file(fs, name, &vmo);
+	if (error != 0)
+		return (error);
+
+	error = exec_elf64_load(vm, entryp, vmo);
+	vm_object_release(vmo);
 	if (error != 0) {
 		printf("%s: exec_elf64_load for %s failed: %m\n", __func__, name, error);
 		return (error);
@@ -31,7 +42,7 @@ exec_load(struct vm *vm, vaddr_t *entryp, const char *name, fs_file_read_op_t *r
 }
 
 int
-exec_task(ipc_port_t parent, ipc_port_t *childp, const char *name, fs_file_read_op_t *readf, fs_context_t fsc, fs_file_context_t fsfc)
+exec_task(ipc_port_t parent, ipc_port_t *childp, struct fs *fs, const char *name)
 {
 	struct thread *td;
 	struct task *task;
@@ -51,7 +62,7 @@ exec_task(ipc_port_t parent, ipc_port_t *childp, const char *name, fs_file_read_
 		return (error);
 	}
 
-	error = exec_load(task->t_vm, &entry, name, readf, fsc, fsfc);
+	error = exec_load(task->t_vm, &entry, fs, name);
 	if (error != 0)
 		return (error);
 
@@ -66,21 +77,20 @@ exec_task(ipc_port_t parent, ipc_port_t *childp, const char *name, fs_file_read_
 }
 
 static int
-exec_elf64_load(struct vm *vm, vaddr_t *entryp, fs_file_read_op_t *readf, fs_context_t fsc, fs_file_context_t fsfc)
+exec_elf64_load(struct vm *vm, vaddr_t *entryp, struct vm_object *vmo)
 {
 	struct elf64_program_header ph;
 	struct elf64_header eh;
-	vaddr_t begin, end;
-	vaddr_t low, high;
+	vaddr_t begin, end, prev;
 	vaddr_t kvaddr;
-	size_t len, o;
+	size_t len, o, resid;
+	off_t off;
 	unsigned i;
-	int error;
+	int error, error2;
 
-	error = exec_read(readf, fsc, fsfc, &eh, 0, sizeof eh);
+	error = vm_object_read(vmo, &eh, 0, sizeof eh);
 	if (error != 0)
 		return (error);
-
 	/*
 	 * Check ELF header magic and version.
 	 */
@@ -141,106 +151,84 @@ exec_elf64_load(struct vm *vm, vaddr_t *entryp, fs_file_read_op_t *readf, fs_con
 	}
 
 	/*
-	 * Figure out the span of addresses the program occupies.
+	 * Map each loadable segment, backed by the executable for as much of
+	 * it as is in the file and zero-filled for the rest.  Nothing is read
+	 * until the program touches it.
 	 *
-	 * XXX Could be better.
+	 * Loadable segments are sorted by address.  If one starts on the page
+	 * that the previous one ended on, that page is already mapped, so we
+	 * copy in the start of this segment by hand and map the rest.
 	 */
-	low = 0;
-	high = 0;
+	prev = 0;
 	for (i = 0; i < eh.eh_phnum; i++) {
-		error = exec_read(readf, fsc, fsfc, &ph,
-				  eh.eh_phoff + i * sizeof ph, sizeof ph);
+		error = vm_object_read(vmo, &ph, eh.eh_phoff + i * sizeof ph,
+				       sizeof ph);
 		if (error != 0)
-			panic("%s: exec_read of program header failed: %m", __func__, error);
+			return (error);
 
 		if (ph.ph_type != ELF_PROGRAM_HEADER_TYPE_LOAD)
 			continue;
 
-		begin = PAGE_FLOOR(ROUNDDOWN(ph.ph_vaddr, ph.ph_align));
-		end = PAGE_ROUNDUP(ROUNDUP(ph.ph_vaddr + ph.ph_memorysize, ph.ph_align));
-
-		if (high == 0) {
-			low = begin;
-			high = end;
+		if (ph.ph_memorysize == 0)
 			continue;
-		}
-		if (low > begin)
-			low = begin;
-		if (high < end)
-			high = end;
-	}
 
-	if (high == 0 || low == high) {
-		printf("%s: executable has no loadable program data.\n", __func__);
-		return (ERROR_INVALID);
-	}
+		if (PAGE_OFFSET(ph.ph_vaddr) != PAGE_OFFSET(ph.ph_off)) {
+			printf("%s: segment not aligned with file.\n", __func__);
+			return (ERROR_INVALID);
+		}
 
-	/*
-	 * Wire program data address range into the kernel for program load.
-	 */
-	error = vm_alloc_range_wire(vm, low, high, &kvaddr, &o);
-	if (error != 0) {
-		printf("%s: could not allocate requested program address range: %m\n", __func__, error);
-		return (error);
-	}
-	ASSERT(o == 0, ("cannot have offset into what should be an aligned page."));
+		begin = PAGE_FLOOR(ph.ph_vaddr);
+		end = PAGE_ROUNDUP(ph.ph_vaddr + ph.ph_memorysize);
+		off = PAGE_FLOOR(ph.ph_off);
+		len = PAGE_OFFSET(ph.ph_vaddr) +
+			MIN(ph.ph_memorysize, ph.ph_filesize);
+
+		if (begin < prev) {
+			if (begin + PAGE_SIZE != prev) {
+				printf("%s: overlapping segments.\n", __func__);
+				return (ERROR_INVALID);
+			}
+
+			resid = MIN(len, PAGE_SIZE) - PAGE_OFFSET(ph.ph_vaddr);
+			if (resid != 0) {
+				error = vm_wire(vm, ph.ph_vaddr, resid, &kvaddr, &o, true);
+				if (error != 0)
+					return (error);
+				error = vm_object_read(vmo, (void *)(kvaddr + o),
+						       ph.ph_off, resid);
+				error2 = vm_unwire(vm, ph.ph_vaddr, resid, kvaddr);
+				if (error2 != 0)
+					panic("%s: could not unwire progam data: %m", __func__, error2);
+				if (error != 0)
+					return (error);
+			}
+
+			begin += PAGE_SIZE;
+			off += PAGE_SIZE;
+			len = len > PAGE_SIZE ? len - PAGE_SIZE : 0;
+			if (begin == end)
+				continue;
+		}
 
-	/*
-	 * Zero everything.
-	 */
-	memset((void *)kvaddr, 0, high - low);
+		error = vm_alloc_range(vm, begin, end);
+		if (error != 0) {
+			printf("%s: could not allocate requested program address range: %m\n", __func__, error);
+			return (error);
+		}
 
-	/*
-	 * Load program headers.
-	 */
-	for (i = 0; i < eh.eh_phnum; i++) {
-		error = exec_read(readf, fsc, fsfc, &ph,
-				  eh.eh_phoff + i * sizeof ph, sizeof ph);
+		error = vm_map_object(vm, begin, end, vmo, off, len);
 		if (error != 0)
-			panic("%s: exec_read of program header failed: %m", __func__, error);
-
-		if (ph.ph_type != ELF_PROGRAM_HEADER_TYPE_LOAD)
-			continue;
+			return (error);
 
-		/* XXX Where memorysize is > filesize do we need to zero?  */
-		len = MIN(ph.ph_memorysize, ph.ph_filesize);
-		begin = kvaddr + (ph.ph_vaddr - low);
-		error = exec_read(readf, fsc, fsfc, (void *)begin, ph.ph_off, len);
-		if (error != 0)
-			panic("%s: exec_read of program data failed: %m", __func__, error);
+		prev = end;
 	}
 
-	/*
-	 * Unwire program data.
-	 */
-	error = vm_unwire(vm, low, high - low, kvaddr);
-	if (error != 0)
-		panic("%s: could not unwire progam data: %m", __func__, error);
+	if (prev == 0) {
+		printf("%s: executable has no loadable program data.\n", __func__);
+		return (ERROR_INVALID);
+	}
 
 	*entryp = (vaddr_t)eh.eh_entry;
 
 	return (0);
 }
-
-static int
-exec_read(fs_file_read_op_t *readf, fs_context_t fsc, fs_file_context_t fsfc, void *buf, off_t off, size_t len)
-{
-	int error;
-	size_t resid;
-
-	resid = len;
-
-	for (;;) {
-		error = readf(fsc, fsfc, buf, off, &len);
-		if (error != 0)
-			return (error);
-		ASSERT(len <= resid, ("cannot have read too much data"));
-		if (len == resid)
-			return (0);
-		buf = (void *)((uintptr_t)buf + len);
-		off += len;
-		resid -= len;
-		len = resid;
-	}
-	return (0);
-}
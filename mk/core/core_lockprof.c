@@ -0,0 +1,169 @@
+#include <core/types.h>
+#ifdef DB
+#include <db/db_command.h>
+#endif
+#include <core/console.h>
+#include <core/lockprof.h>
+#include <core/string.h>
+
+#ifdef DB
+DB_COMMAND_TREE(lock, root, lock);
+#endif
+
+#define	LOCKPROF_MAX	(256)
+
+static const char *lockprof_type_names[] = {
+	[LOCKPROF_SPINLOCK] = "spin",
+	[LOCKPROF_MUTEX] = "mutex",
+	[LOCKPROF_RWLOCK] = "rwlock",
+};
+
+/*
+ * Records are never freed, and locks are created before anything can be
+ * allocated, so they come from a fixed table.  Names beyond that are lumped
+ * together per type.  The table is only locked to add records, with a bare
+ * flag since spinlocks are themselves profiled.
+ */
+static struct lockprof lockprof_table[LOCKPROF_MAX];
+static struct lockprof lockprof_other[] = {
+	[LOCKPROF_SPINLOCK] = { "(other)", LOCKPROF_SPINLOCK, 0, 0, 0, 0, 0 },
+	[LOCKPROF_MUTEX] = { "(other)", LOCKPROF_MUTEX, 0, 0, 0, 0, 0 },
+	[LOCKPROF_RWLOCK] = { "(other)", LOCKPROF_RWLOCK, 0, 0, 0, 0, 0 },
+};
+static unsigned lockprof_count;
+static uint64_t lockprof_busy;
+
+struct lockprof *
+lockprof_lookup(const char *name, enum lockprof_type type)
+{
+	struct lockprof *lp;
+	unsigned i;
+
+	while (!atomic_cmpset64(&lockprof_busy, 0, 1))
+		continue;
+	for (i = 0; i < lockprof_count; i++) {
+		lp = &lockprof_table[i];
+		if (lp->lp_type == type && strcmp(lp->lp_name, name) == 0)
+			goto out;
+	}
+	if (lockprof_count == LOCKPROF_MAX) {
+		lp = &lockprof_other[type];
+		goto out;
+	}
+	lp = &lockprof_table[lockprof_count++];
+	lp->lp_name = name;
+	lp->lp_type = type;
+out:
+	atomic_store64(&lockprof_busy, 0);
+	return (lp);
+}
+
+void
+lockprof_acquire(struct lockprof *lp, bool contended, unsigned spins)
+{
+	uint64_t total;
+
+	atomic_increment64(&lp->lp_acquires);
+	if (!contended)
+		return;
+	atomic_increment64(&lp->lp_contended);
+	if (spins != 0) {
+		do {
+			total = atomic_load64(&lp->lp_spins);
+		} while (!atomic_cmpset64(&lp->lp_spins, total, total + spins));
+	}
+}
+
+void
+lockprof_release(struct lockprof *lp, uint64_t start)
+{
+	uint64_t held, max, now;
+
+	now = lockprof_timestamp();
+	if ((now >> 32) != (start >> 32))
+		return;
+	held = (unsigned)((unsigned)now - (unsigned)start);
+	do {
+		max = atomic_load64(&lp->lp_hold_max);
+		if (held <= max)
+			return;
+	} while (!atomic_cmpset64(&lp->lp_hold_max, max, held));
+}
+
+void
+lockprof_sleep(struct lockprof *lp)
+{
+	atomic_increment64(&lp->lp_sleeps);
+}
+
+#ifdef DB
+static bool
+db_lockprof_before(const struct lockprof *a, const struct lockprof *b)
+{
+	if (a->lp_contended != b->lp_contended)
+		return (a->lp_contended > b->lp_contended);
+	if (a->lp_spins != b->lp_spins)
+		return (a->lp_spins > b->lp_spins);
+	return (a->lp_acquires > b->lp_acquires);
+}
+
+static void
+db_lockprof_dump(const struct lockprof *lp)
+{
+	if (lp->lp_acquires == 0)
+		return;
+	printf("%-6s %-24s %12lu %10lu %12lu %8lu %10lu\n",
+	       lockprof_type_names[lp->lp_type], lp->lp_name,
+	       lp->lp_acquires, lp->lp_contended, lp->lp_spins,
+	       lp->lp_sleeps, lp->lp_hold_max);
+}
+
+/*
+ * Rank by contended acquisitions, then by time spent spinning.
+ */
+static void
+db_lockprof_stats(void)
+{
+	static const struct lockprof *sorted[LOCKPROF_MAX];
+	const struct lockprof *lp;
+	unsigned i, j, n;
+
+	n = lockprof_count;
+	for (i = 0; i < n; i++) {
+		lp = &lockprof_table[i];
+		for (j = i; j > 0 && db_lockprof_before(lp, sorted[j - 1]); j--)
+			sorted[j] = sorted[j - 1];
+		sorted[j] = lp;
+	}
+
+	printf("%-6s %-24s %12s %10s %12s %8s %10s\n", "type", "name",
+	       "acquires", "contended", "spins", "sleeps", "hold max");
+	for (i = 0; i < n; i++)
+		db_lockprof_dump(sorted[i]);
+	for (i = 0; i < sizeof lockprof_other / sizeof lockprof_other[0]; i++)
+		db_lockprof_dump(&lockprof_other[i]);
+}
+DB_COMMAND(stats, lock, db_lockprof_stats);
+
+static void
+db_lockprof_reset_one(struct lockprof *lp)
+{
+	lp->lp_acquires = 0;
+	lp->lp_contended = 0;
+	lp->lp_spins = 0;
+	lp->lp_sleeps = 0;
+	lp->lp_hold_max = 0;
+}
+
+static void
+db_lockprof_reset(void)
+{
+	unsigned i;
+
+	for (i = 0; i < lockprof_count; i++)
+		db_lockprof_reset_one(&lockprof_table[i]);
+	for (i = 0; i < sizeof lockprof_other / sizeof lockprof_other[0]; i++)
+		db_lockprof_reset_one(&lockprof_other[i]);
+}
+DB_COMMAND(reset, lock, db_lockprof_reset);
+#endif
@@ -1,7 +1,10 @@
 #include <core/types.h>
+#include <core/lockprof.h>
 #include <core/mutex.h>
+#include <core/scheduler.h>
 #include <core/sleepq.h>
 #include <core/thread.h>
+#include <core/witness.h>
 
 #define	MTX_SPINLOCK(mtx)	spinlock_lock(&(mtx)->mtx_lock)
 #define	MTX_SPINUNLOCK(mtx)	spinlock_unlock(&(mtx)->mtx_lock)
@@ -11,16 +14,21 @@ mutex_init(struct mutex *mtx, const char *name, unsigned flags)
 {
 	spinlock_init(&mtx->mtx_lock, name, SPINLOCK_FLAG_DEFAULT);
 	sleepq_init(&mtx->mtx_sleepq, &mtx->mtx_lock);
-	mtx->mtx_owner = NULL;
+	mtx->mtx_owner = 0;
 	mtx->mtx_waiters = 0;
 	mtx->mtx_flags = flags;
+	LOCKPROF_INIT(&mtx->mtx_prof, name, LOCKPROF_MUTEX);
+	WITNESS_INIT(&mtx->mtx_witness, name, WITNESS_SLEEP);
 }
 
 void
 mutex_lock(struct mutex *mtx)
 {
-	unsigned int tries;
 	struct thread *td;
+	uint64_t owner;
+#ifdef LOCKPROF
+	unsigned spins = 0;
+#endif
 
 	td = current_thread();
 	ASSERT(td != NULL, "Must have a thread.");
@@ -36,42 +44,97 @@ mutex_lock(struct mutex *mtx)
 	       "Cannot lock a mutex from within a critical section.");
 #endif
 
-	tries = 0;
+	WITNESS_CHECK(mtx->mtx_witness);
 
-	for (;;) {
-		MTX_SPINLOCK(mtx);
-		if (mtx->mtx_owner == td)
+	if (atomic_cmpset64(&mtx->mtx_owner, 0, (uintptr_t)td)) {
+		WITNESS_LOCK(mtx->mtx_witness, mtx);
+		LOCKPROF_ACQUIRE(mtx->mtx_prof, false, 0);
+		LOCKPROF_TIMESTAMP(&mtx->mtx_hold_start);
+		return;
+	}
+
+	for (;; LOCKPROF_SPIN(spins)) {
+		owner = atomic_load64(&mtx->mtx_owner);
+		if (owner == 0) {
+			if (atomic_cmpset64(&mtx->mtx_owner, 0,
+					    (uintptr_t)td)) {
+				WITNESS_LOCK(mtx->mtx_witness, mtx);
+				LOCKPROF_ACQUIRE(mtx->mtx_prof, true, spins);
+				LOCKPROF_TIMESTAMP(&mtx->mtx_hold_start);
+				return;
+			}
+			continue;
+		}
+		if (MUTEX_OWNER(owner) == td)
 			panic("%s: cannot recurse on mutex %s", __func__,
 			      mtx->mtx_lock.s_name);
-		if (mtx->mtx_owner == NULL) {
-			mtx->mtx_owner = td;
-			MTX_SPINUNLOCK(mtx);
-			return;
-		}
-		if (tries++ < 10) {
+
+		/*
+		 * While the owner is running on another CPU it is likely to
+		 * let go soon, so keep spinning.  Once there are sleepers the
+		 * lock will be handed to one of them, so join them instead.
+		 *
+		 * The owner may exit and be freed once it lets go, but threads
+		 * come from a pool, so the flags read is harmless if stale.
+		 */
+		if ((owner & MUTEX_CONTESTED) == 0 &&
+		    scheduler_thread_running(MUTEX_OWNER(owner)))
+			continue;
+
+		MTX_SPINLOCK(mtx);
+		if (!atomic_cmpset64(&mtx->mtx_owner, owner,
+				     owner | MUTEX_CONTESTED)) {
 			MTX_SPINUNLOCK(mtx);
-			/* Try spinning for a while.  */
 			continue;
 		}
 		mtx->mtx_waiters++;
+		LOCKPROF_SLEEP(mtx->mtx_prof);
 		sleepq_enter(&mtx->mtx_sleepq);
-		mtx->mtx_waiters--;
+
+		/*
+		 * We are only woken by mutex_unlock, which has made us the
+		 * owner already.
+		 */
+		ASSERT(MUTEX_HELD(mtx), "Mutex not handed off.");
+		WITNESS_LOCK(mtx->mtx_witness, mtx);
+		LOCKPROF_ACQUIRE(mtx->mtx_prof, true, spins);
+		LOCKPROF_TIMESTAMP(&mtx->mtx_hold_start);
+		return;
 	}
 }
 
 void
 mutex_unlock(struct mutex *mtx)
 {
-	struct thread *td;
+	struct thread *td, *next;
+	uint64_t owner;
 
 	td = current_thread();
 
 	ASSERT(td != NULL, "Must have a thread.");
 
+	owner = atomic_load64(&mtx->mtx_owner);
+	ASSERT(MUTEX_OWNER(owner) == td, "Not my lock to unlock.");
+	LOCKPROF_RELEASE(mtx->mtx_prof, mtx->mtx_hold_start);
+	WITNESS_UNLOCK(mtx->mtx_witness, mtx);
+	if ((owner & MUTEX_CONTESTED) == 0 &&
+	    atomic_cmpset64(&mtx->mtx_owner, owner, 0))
+		return;
+
+	/*
+	 * Sleepers set MUTEX_CONTESTED with the spinlock held and keep it until
+	 * they are asleep, so the queue cannot be empty here.  Hand the lock
+	 * straight to the first of them rather than waking everyone to fight
+	 * over it.
+	 */
 	MTX_SPINLOCK(mtx);
-	ASSERT(mtx->mtx_owner == td, "Not my lock to unlock.");
-	mtx->mtx_owner = NULL;
+	ASSERT(mtx->mtx_waiters != 0, "Contested mutex with no waiters.");
+	mtx->mtx_waiters--;
+	next = sleepq_signal_one(&mtx->mtx_sleepq);
+	ASSERT(next != NULL, "Contested mutex with empty sleep queue.");
+	owner = (uintptr_t)next;
 	if (mtx->mtx_waiters != 0)
-		sleepq_signal_one(&mtx->mtx_sleepq);
+		owner |= MUTEX_CONTESTED;
+	atomic_store64(&mtx->mtx_owner, owner);
 	MTX_SPINUNLOCK(mtx);
 }
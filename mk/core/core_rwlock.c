@@ -0,0 +1,234 @@
+#include <core/types.h>
+#include <core/critical.h>
+#include <core/lockprof.h>
+#include <core/rwlock.h>
+#include <core/sleepq.h>
+#include <core/startup.h>
+#include <core/thread.h>
+#include <core/witness.h>
+
+#define	RW_SPINLOCK(rw)		spinlock_lock(&(rw)->rw_lock)
+#define	RW_SPINUNLOCK(rw)	spinlock_unlock(&(rw)->rw_lock)
+
+/*
+ * State bits which keep a reader or writer, respectively, from getting in.
+ */
+#define	RW_READ_BUSY		(RWLOCK_WRITER | RWLOCK_WRITE_WANTED)
+#define	RW_WRITE_BUSY		(~(RWLOCK_WAITERS | RWLOCK_WRITE_WANTED))
+
+static void rwlock_sleep(struct rwlock *, struct sleepq *, uint64_t, uint64_t);
+static void rwlock_wakeup(struct rwlock *);
+
+void
+rwlock_init(struct rwlock *rw, const char *name)
+{
+	spinlock_init(&rw->rw_lock, name, SPINLOCK_FLAG_DEFAULT);
+	sleepq_init(&rw->rw_readq, &rw->rw_lock);
+	sleepq_init(&rw->rw_writeq, &rw->rw_lock);
+	rw->rw_owner = NULL;
+	rw->rw_state = 0;
+	LOCKPROF_INIT(&rw->rw_prof, name, LOCKPROF_RWLOCK);
+	WITNESS_INIT(&rw->rw_witness, name, WITNESS_SLEEP);
+}
+
+void
+rwlock_rlock(struct rwlock *rw)
+{
+	unsigned int tries;
+	struct thread *td;
+	uint64_t state;
+
+	if (startup_early)
+		return;
+
+	td = current_thread();
+	WITNESS_CHECK(rw->rw_witness);
+
+	for (tries = 0;; tries++) {
+		state = atomic_load64(&rw->rw_state);
+		if ((state & RW_READ_BUSY) == 0) {
+			if (atomic_cmpset64(&rw->rw_state, state,
+					    state + RWLOCK_READER)) {
+				WITNESS_LOCK(rw->rw_witness, rw);
+				LOCKPROF_ACQUIRE(rw->rw_prof, tries != 0,
+						 tries);
+				return;
+			}
+			continue;
+		}
+		if ((state & RWLOCK_WRITER) != 0 && td != NULL &&
+		    rw->rw_owner == td)
+			panic("%s: cannot recurse on rwlock %s", __func__,
+			      rw->rw_lock.s_name);
+		if (tries < 10) {
+			/* Try spinning for a while.  */
+			continue;
+		}
+		rwlock_sleep(rw, &rw->rw_readq, RW_READ_BUSY, RWLOCK_WAITERS);
+	}
+}
+
+void
+rwlock_runlock(struct rwlock *rw)
+{
+	uint64_t state;
+
+	if (startup_early)
+		return;
+
+	WITNESS_UNLOCK(rw->rw_witness, rw);
+
+	for (;;) {
+		state = atomic_load64(&rw->rw_state);
+		ASSERT(RWLOCK_READERS(state) != 0, "Not read-locked.");
+		if (RWLOCK_READERS(state) != 1 ||
+		    (state & RWLOCK_WAITERS) == 0) {
+			if (atomic_cmpset64(&rw->rw_state, state,
+					    state - RWLOCK_READER))
+				return;
+			continue;
+		}
+
+		/*
+		 * Last reader out, with sleepers to wake.  Waiters only set
+		 * their flags with the spinlock held, so taking it here means
+		 * that anyone we saw flagged is on a sleep queue by now.
+		 */
+		RW_SPINLOCK(rw);
+		if (!atomic_cmpset64(&rw->rw_state, state,
+				     state - RWLOCK_READER)) {
+			RW_SPINUNLOCK(rw);
+			continue;
+		}
+		rwlock_wakeup(rw);
+		RW_SPINUNLOCK(rw);
+		return;
+	}
+}
+
+void
+rwlock_wlock(struct rwlock *rw)
+{
+	unsigned int tries;
+	struct thread *td;
+	uint64_t state;
+
+	if (startup_early)
+		return;
+
+	td = current_thread();
+	WITNESS_CHECK(rw->rw_witness);
+
+	for (tries = 0;; tries++) {
+		state = atomic_load64(&rw->rw_state);
+		if ((state & RW_WRITE_BUSY) == 0) {
+			if (atomic_cmpset64(&rw->rw_state, state,
+					    state | RWLOCK_WRITER)) {
+				rw->rw_owner = td;
+				WITNESS_LOCK(rw->rw_witness, rw);
+				LOCKPROF_ACQUIRE(rw->rw_prof, tries != 0,
+						 tries);
+				LOCKPROF_TIMESTAMP(&rw->rw_hold_start);
+				return;
+			}
+			continue;
+		}
+		if ((state & RWLOCK_WRITER) != 0 && td != NULL &&
+		    rw->rw_owner == td)
+			panic("%s: cannot recurse on rwlock %s", __func__,
+			      rw->rw_lock.s_name);
+		if (tries < 10) {
+			/* Try spinning for a while.  */
+			continue;
+		}
+		rwlock_sleep(rw, &rw->rw_writeq, RW_WRITE_BUSY,
+			     RWLOCK_WAITERS | RWLOCK_WRITE_WANTED);
+	}
+}
+
+void
+rwlock_wunlock(struct rwlock *rw)
+{
+	uint64_t state;
+
+	if (startup_early)
+		return;
+
+	ASSERT(RWLOCK_XOWNED(rw), "Not my lock to unlock.");
+	LOCKPROF_RELEASE(rw->rw_prof, rw->rw_hold_start);
+	WITNESS_UNLOCK(rw->rw_witness, rw);
+	rw->rw_owner = NULL;
+
+	for (;;) {
+		state = atomic_load64(&rw->rw_state);
+		if ((state & RWLOCK_WAITERS) == 0) {
+			if (atomic_cmpset64(&rw->rw_state, state,
+					    state & ~RWLOCK_WRITER))
+				return;
+			continue;
+		}
+
+		RW_SPINLOCK(rw);
+		if (!atomic_cmpset64(&rw->rw_state, state,
+				     state & ~RWLOCK_WRITER)) {
+			RW_SPINUNLOCK(rw);
+			continue;
+		}
+		rwlock_wakeup(rw);
+		RW_SPINUNLOCK(rw);
+		return;
+	}
+}
+
+/*
+ * Wait for the lock to become free of the busy bits, setting flags so that
+ * whoever releases it knows to wake us.  Returns without sleeping if the lock
+ * was released in the meantime, or if this thread cannot sleep, in which case
+ * the caller just keeps spinning.
+ */
+static void
+rwlock_sleep(struct rwlock *rw, struct sleepq *sq, uint64_t busy,
+	     uint64_t flags)
+{
+	uint64_t state;
+
+	if (current_thread() == NULL || critical_section())
+		return;
+
+	RW_SPINLOCK(rw);
+	state = atomic_load64(&rw->rw_state);
+	if ((state & busy) == 0 ||
+	    !atomic_cmpset64(&rw->rw_state, state, state | flags)) {
+		RW_SPINUNLOCK(rw);
+		return;
+	}
+	LOCKPROF_SLEEP(rw->rw_prof);
+	sleepq_enter(sq);
+}
+
+/*
+ * Prefer writers: if any are queued, wake them all and leave the readers
+ * asleep.  Everyone woken retries from scratch, and those that lose go back to
+ * sleep and set their flags again.
+ */
+static void
+rwlock_wakeup(struct rwlock *rw)
+{
+	uint64_t clear, state;
+
+	SPINLOCK_ASSERT_HELD(&rw->rw_lock);
+
+	if (!sleepq_empty(&rw->rw_writeq)) {
+		sleepq_signal(&rw->rw_writeq);
+		clear = RWLOCK_WRITE_WANTED;
+		if (sleepq_empty(&rw->rw_readq))
+			clear |= RWLOCK_WAITERS;
+	} else {
+		sleepq_signal(&rw->rw_readq);
+		clear = RWLOCK_WAITERS | RWLOCK_WRITE_WANTED;
+	}
+
+	do {
+		state = atomic_load64(&rw->rw_state);
+	} while (!atomic_cmpset64(&rw->rw_state, state, state & ~clear));
+}
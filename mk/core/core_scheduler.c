@@ -30,7 +30,7 @@ static void scheduler_switch(struct scheduler_entry *, struct scheduler_entry *)
 void
 scheduler_init(void)
 {
-	spinlock_init(&scheduler_lock, "SCHEDULER", SPINLOCK_FLAG_DEFAULT);
+	spinlock_init(&scheduler_lock, "SCHEDULER", SPINLOCK_FLAG_QUEUED);
 	TAILQ_INIT(&scheduler_queue.sq_queue);
 	TAILQ_INIT(&scheduler_queue.sq_exiting);
 }
@@ -45,6 +45,28 @@ scheduler_activate(struct thread *td)
 	SCHEDULER_UNLOCK();
 }
 
+/*
+ * Like scheduler_cpu_pin, but to the given CPU rather than the current one.
+ */
+void
+scheduler_cpu_bind(struct thread *td, cpu_id_t cpu)
+{
+#ifndef UNIPROCESSOR
+	struct scheduler_entry *se = &td->td_sched;
+
+	SCHEDULER_LOCK();
+	if ((se->se_flags & (SCHEDULER_RUNNING | SCHEDULER_RUNNABLE)) != 0)
+		panic("%s: called for running and/or runnable thread.", __func__);
+	if ((se->se_flags & SCHEDULER_PINNED) != 0)
+		panic("%s: thread already pinned.", __func__);
+	se->se_flags |= SCHEDULER_PINNED;
+	se->se_oncpu = cpu;
+	SCHEDULER_UNLOCK();
+#else
+	(void)cpu;
+#endif
+}
+
 void
 scheduler_cpu_pin(struct thread *td)
 {
@@ -166,6 +188,18 @@ scheduler_thread_exiting(void)
 	SCHEDULER_UNLOCK();
 }
 
+/*
+ * Unlocked peek at whether a thread is on a CPU right now, for adaptive
+ * spinning.  The answer may be stale by the time it is used.
+ */
+bool
+scheduler_thread_running(struct thread *td)
+{
+	volatile struct scheduler_entry *se = &td->td_sched;
+
+	return ((se->se_flags & SCHEDULER_RUNNING) != 0);
+}
+
 void
 scheduler_thread_runnable(struct thread *td)
 {
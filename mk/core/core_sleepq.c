@@ -1,18 +1,16 @@
 #include <core/types.h>
-#include <core/pool.h>
 #include <core/queue.h>
 #include <core/scheduler.h>
 #include <core/sleepq.h>
-#include <core/startup.h>
+#include <core/spinlock.h>
 #include <core/thread.h>
+#include <core/witness.h>
 
 struct sleepq_entry {
 	struct thread *se_thread;
 	TAILQ_ENTRY(struct sleepq_entry) se_link;
 };
 
-static struct pool sleepq_entry_pool;
-
 static void sleepq_signal_entry(struct sleepq *, struct sleepq_entry *);
 
 void
@@ -22,27 +20,38 @@ sleepq_init(struct sleepq *sq, struct spinlock *lock)
 	TAILQ_INIT(&sq->sq_entries);
 }
 
+/*
+ * The entry lives on the sleeping thread's stack, which stays put until the
+ * thread has woken up and taken itself off the queue.  Not allocating here
+ * means locks used by the allocator can sleep too.
+ */
 void
 sleepq_enter(struct sleepq *sq)
 {
-	struct sleepq_entry *se;
+	struct sleepq_entry se;
 	struct thread *td;
 
 	td = current_thread();
 
 	SPINLOCK_ASSERT_HELD(sq->sq_lock);
+	WITNESS_SLEEP(sq->sq_lock);
 
-	se = pool_allocate(&sleepq_entry_pool);
-	se->se_thread = td;
+	se.se_thread = td;
 
-	TAILQ_INSERT_TAIL(&sq->sq_entries, se, se_link);
+	TAILQ_INSERT_TAIL(&sq->sq_entries, &se, se_link);
 
 	scheduler_thread_sleeping(td);
 	scheduler_schedule(NULL, sq->sq_lock);
 	spinlock_lock(sq->sq_lock);
-	TAILQ_REMOVE(&sq->sq_entries, se, se_link);
+	TAILQ_REMOVE(&sq->sq_entries, &se, se_link);
 	spinlock_unlock(sq->sq_lock);
-	pool_free(se);
+}
+
+bool
+sleepq_empty(struct sleepq *sq)
+{
+	SPINLOCK_ASSERT_HELD(sq->sq_lock);
+	return (TAILQ_EMPTY(&sq->sq_entries));
 }
 
 void
@@ -55,12 +64,20 @@ sleepq_signal(struct sleepq *sq)
 		sleepq_signal_entry(sq, se);
 }
 
-void
+/*
+ * Returns the thread woken, if any.
+ */
+struct thread *
 sleepq_signal_one(struct sleepq *sq)
 {
+	struct sleepq_entry *se;
+
 	SPINLOCK_ASSERT_HELD(sq->sq_lock);
-	if (!TAILQ_EMPTY(&sq->sq_entries))
-		sleepq_signal_entry(sq, TAILQ_FIRST(&sq->sq_entries));
+	if (TAILQ_EMPTY(&sq->sq_entries))
+		return (NULL);
+	se = TAILQ_FIRST(&sq->sq_entries);
+	sleepq_signal_entry(sq, se);
+	return (se->se_thread);
 }
 
 static void
@@ -71,15 +88,3 @@ sleepq_signal_entry(struct sleepq *sq, struct sleepq_entry *se)
 	td = se->se_thread;
 	scheduler_thread_runnable(td);
 }
-
-static void
-sleepq_startup(void *arg)
-{
-	int error;
-
-	error = pool_create(&sleepq_entry_pool, "SLEEPQ ENTRY",
-			    sizeof (struct sleepq_entry), POOL_VIRTUAL);
-	if (error != 0)
-		panic("%s: pool_create failed: %m", __func__, error);
-}
-STARTUP_ITEM(sleepq, STARTUP_POOL, STARTUP_FIRST, sleepq_startup, NULL);
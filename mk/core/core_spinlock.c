@@ -1,16 +1,56 @@
 #include <core/types.h>
+#include <core/lockprof.h>
 #include <core/spinlock.h>
 #include <core/startup.h>
 #include <core/string.h>
+#include <core/witness.h>
+
+#ifndef	UNIPROCESSOR
+/*
+ * Each CPU has a few MCS queue nodes, enough for the queued locks it can hold
+ * or wait on at once.  They are only touched in a critical section, so the
+ * per-CPU busy mask needs no locking.  Each CPU's nodes start on a cache line
+ * of their own, so that a waiter spinning on its node doesn't share the line
+ * with another CPU's.
+ */
+#define	SPINLOCK_QNODES		(4)
+
+struct spinlock_qnode {
+	uint64_t q_next;		/* Next waiter's node.  */
+	uint64_t q_wait;		/* Set until our turn comes.  */
+};
+
+struct spinlock_qnodes {
+	struct spinlock_qnode sq_nodes[SPINLOCK_QNODES];
+	unsigned sq_busy;
+} __aligned(CACHE_LINE_SIZE);
+
+static struct spinlock_qnodes spinlock_qnodes[MAXCPUS];
+
+static uint64_t spinlock_fetchadd(volatile uint64_t *, uint64_t);
+static uint64_t spinlock_swap(volatile uint64_t *, uint64_t);
+static void spinlock_queue_lock(struct spinlock *, cpu_id_t);
+static void spinlock_queue_unlock(struct spinlock *, cpu_id_t);
+static void spinlock_ticket_lock(struct spinlock *);
+#endif
 
 void
 spinlock_init(struct spinlock *lock, const char *name, unsigned flags)
 {
 	ASSERT((flags & SPINLOCK_FLAG_VALID) == 0, "Must not set valid flag.");
+	ASSERT((flags & (SPINLOCK_FLAG_QUEUED | SPINLOCK_FLAG_INTERRUPTS)) !=
+	       (SPINLOCK_FLAG_QUEUED | SPINLOCK_FLAG_INTERRUPTS),
+	       "Queued locks use per-CPU nodes and cannot wait interruptibly.");
 	lock->s_name = name;
 	lock->s_owner = CPU_ID_INVALID;
 	lock->s_nest = 0;
+	lock->s_next = 0;
+	lock->s_serving = 0;
+	lock->s_tail = 0;
+	lock->s_qnode = NULL;
 	lock->s_flags = flags | SPINLOCK_FLAG_VALID;
+	LOCKPROF_INIT(&lock->s_prof, name, LOCKPROF_SPINLOCK);
+	WITNESS_INIT(&lock->s_witness, name, WITNESS_SPIN);
 }
 
 void
@@ -24,24 +64,26 @@ spinlock_lock(struct spinlock *lock)
 #ifndef	UNIPROCESSOR
 	critical_enter();
 	cpu_id_t self = mp_whoami();
-	while (!atomic_cmpset64(&lock->s_owner, CPU_ID_INVALID, self)) {
-		if (atomic_load64(&lock->s_owner) == (uint64_t)self) {
-			if ((lock->s_flags & SPINLOCK_FLAG_RECURSE) != 0) {
-				atomic_increment64(&lock->s_nest);
-				critical_exit();
-				return;
-			}
-			panic("%s: cannot recurse on spinlock (%s)", __func__,
-			      lock->s_name);
+	if (atomic_load64(&lock->s_owner) == (uint64_t)self) {
+		if ((lock->s_flags & SPINLOCK_FLAG_RECURSE) != 0) {
+			atomic_increment64(&lock->s_nest);
+			critical_exit();
+			return;
 		}
-		critical_exit();
-		/*
-		 * If we are not already in a critical section, allow interrupts
-		 * to fire while we spin.
-		 */
-		critical_enter();
+		panic("%s: cannot recurse on spinlock (%s)", __func__,
+		      lock->s_name);
+	}
+	WITNESS_CHECK(lock->s_witness);
+	if ((lock->s_flags & SPINLOCK_FLAG_QUEUED) != 0) {
+		spinlock_queue_lock(lock, self);
+	} else {
+		spinlock_ticket_lock(lock);
+		/* We may have moved while interrupts were enabled.  */
 		self = mp_whoami();
 	}
+	atomic_store64(&lock->s_owner, self);
+	WITNESS_LOCK(lock->s_witness, lock);
+	LOCKPROF_TIMESTAMP(&lock->s_hold_start);
 #else
 	critical_enter();
 	if (lock->s_owner == mp_whoami()) {
@@ -49,6 +91,10 @@ spinlock_lock(struct spinlock *lock)
 		critical_exit();
 	} else {
 		lock->s_owner = mp_whoami();
+		WITNESS_CHECK(lock->s_witness);
+		WITNESS_LOCK(lock->s_witness, lock);
+		LOCKPROF_ACQUIRE(lock->s_prof, false, 0);
+		LOCKPROF_TIMESTAMP(&lock->s_hold_start);
 	}
 #endif
 }
@@ -67,13 +113,17 @@ spinlock_unlock(struct spinlock *lock)
 		if (atomic_load64(&lock->s_nest) != 0) {
 			atomic_decrement64(&lock->s_nest);
 			return;
-		} else {
-			if (atomic_cmpset64(&lock->s_owner, self,
-					    CPU_ID_INVALID)) {
-				critical_exit();
-				return;
-			}
 		}
+		LOCKPROF_RELEASE(lock->s_prof, lock->s_hold_start);
+		WITNESS_UNLOCK(lock->s_witness, lock);
+		atomic_store64(&lock->s_owner, CPU_ID_INVALID);
+		if ((lock->s_flags & SPINLOCK_FLAG_QUEUED) != 0)
+			spinlock_queue_unlock(lock, self);
+		else
+			atomic_store64(&lock->s_serving,
+				       atomic_load64(&lock->s_serving) + 1);
+		critical_exit();
+		return;
 	}
 	panic("%s: not my lock to unlock (%s)", __func__, lock->s_name);
 #else
@@ -82,9 +132,118 @@ spinlock_unlock(struct spinlock *lock)
 		      lock->s_name, lock->s_owner);
 
 	if (lock->s_nest == 0) {
+		LOCKPROF_RELEASE(lock->s_prof, lock->s_hold_start);
+		WITNESS_UNLOCK(lock->s_witness, lock);
 		critical_exit();
 		lock->s_owner = CPU_ID_INVALID;
 	} else
 		lock->s_nest--;
 #endif
 }
+
+#ifndef	UNIPROCESSOR
+static uint64_t
+spinlock_fetchadd(volatile uint64_t *p, uint64_t v)
+{
+	uint64_t o;
+
+	do {
+		o = atomic_load64(p);
+	} while (!atomic_cmpset64(p, o, o + v));
+	return (o);
+}
+
+static uint64_t
+spinlock_swap(volatile uint64_t *p, uint64_t v)
+{
+	uint64_t o;
+
+	do {
+		o = atomic_load64(p);
+	} while (!atomic_cmpset64(p, o, v));
+	return (o);
+}
+
+/*
+ * Enqueue a node for this CPU behind the current tail and wait for the
+ * previous holder to clear our wait flag.
+ */
+static void
+spinlock_queue_lock(struct spinlock *lock, cpu_id_t self)
+{
+	struct spinlock_qnodes *sq = &spinlock_qnodes[self];
+	struct spinlock_qnode *node, *pred;
+	unsigned i;
+#ifdef LOCKPROF
+	unsigned spins = 0;
+#endif
+
+	for (i = 0; i < SPINLOCK_QNODES; i++)
+		if ((sq->sq_busy & (1u << i)) == 0)
+			break;
+	if (i == SPINLOCK_QNODES)
+		panic("%s: out of queue nodes for spinlock (%s)", __func__,
+		      lock->s_name);
+	sq->sq_busy |= 1u << i;
+	node = &sq->sq_nodes[i];
+
+	atomic_store64(&node->q_next, 0);
+	atomic_store64(&node->q_wait, 1);
+	pred = (struct spinlock_qnode *)(uintptr_t)
+		spinlock_swap(&lock->s_tail, (uintptr_t)node);
+	if (pred != NULL) {
+		atomic_store64(&pred->q_next, (uintptr_t)node);
+		while (atomic_load64(&node->q_wait) != 0)
+			LOCKPROF_SPIN(spins);
+	}
+	lock->s_qnode = node;
+	LOCKPROF_ACQUIRE(lock->s_prof, pred != NULL, spins);
+}
+
+static void
+spinlock_queue_unlock(struct spinlock *lock, cpu_id_t self)
+{
+	struct spinlock_qnodes *sq = &spinlock_qnodes[self];
+	struct spinlock_qnode *node, *next;
+
+	node = lock->s_qnode;
+	lock->s_qnode = NULL;
+
+	next = (struct spinlock_qnode *)(uintptr_t)
+		atomic_load64(&node->q_next);
+	if (next == NULL) {
+		if (atomic_cmpset64(&lock->s_tail, (uintptr_t)node, 0))
+			goto done;
+		/* Someone is enqueueing; wait for them to link in.  */
+		while ((next = (struct spinlock_qnode *)(uintptr_t)
+			atomic_load64(&node->q_next)) == NULL)
+			continue;
+	}
+	atomic_store64(&next->q_wait, 0);
+done:
+	sq->sq_busy &= ~(1u << (node - sq->sq_nodes));
+}
+
+static void
+spinlock_ticket_lock(struct spinlock *lock)
+{
+	uint64_t ticket;
+#ifdef LOCKPROF
+	unsigned spins = 0;
+#endif
+
+	ticket = spinlock_fetchadd(&lock->s_next, 1);
+	while (atomic_load64(&lock->s_serving) != ticket) {
+		LOCKPROF_SPIN(spins);
+		if ((lock->s_flags & SPINLOCK_FLAG_INTERRUPTS) == 0)
+			continue;
+		critical_exit();
+		/*
+		 * If we are not already in a critical section, allow interrupts
+		 * to fire while we spin.
+		 */
+		critical_enter();
+	}
+	LOCKPROF_ACQUIRE(lock->s_prof, spins != 0, spins);
+}
+#endif
@@ -7,7 +7,9 @@
 #include <cpu/pcpu.h>
 #include <cpu/register.h>
 #include <ipc/ipc.h>
+#include <ipc/mailbox.h>
 #include <ipc/port.h>
+#include <ipc/thread.h>
 #include <vm/vm.h>
 #include <vm/vm_alloc.h>
 #include <vm/vm_index.h>
@@ -28,13 +30,22 @@ static syscall_handler_t syscall_ipc_port_allocate,
 			 syscall_ipc_port_send,
 			 syscall_ipc_port_wait,
 			 syscall_ipc_port_receive,
-			 syscall_ipc_task_port;
+			 syscall_ipc_task_port,
+			 syscall_ipc_port_send_copy,
+			 syscall_ipc_port_send_data,
+			 syscall_ipc_mailbox,
+			 syscall_ipc_port_send_vector,
+			 syscall_ipc_port_receive_buffer,
+			 syscall_ipc_port_right_drop,
+			 syscall_ipc_port_right_notify,
+			 syscall_ipc_thread_reply_port;
 
 static syscall_handler_t syscall_vm_page_get,
 			 syscall_vm_page_free,
 			 syscall_vm_alloc,
 			 syscall_vm_free,
-			 syscall_vm_alloc_range;
+			 syscall_vm_alloc_range,
+			 syscall_vm_recycle;
 
 static struct syscall_vector syscall_vector[SYSCALL_LAST + 1] = {
 	[SYSCALL_THREAD_EXIT] =		{ 0, 0, syscall_thread_exit },
@@ -45,12 +56,21 @@ static struct syscall_vector syscall_vector[SYSCALL_LAST + 1] = {
 	[SYSCALL_IPC_PORT_WAIT] =	{ 1, 0, syscall_ipc_port_wait },
 	[SYSCALL_IPC_PORT_RECEIVE] =	{ 2, 1, syscall_ipc_port_receive },
 	[SYSCALL_IPC_TASK_PORT] =	{ 0, 1, syscall_ipc_task_port },
+	[SYSCALL_IPC_PORT_SEND_COPY] =	{ 2, 0, syscall_ipc_port_send_copy },
+	[SYSCALL_IPC_PORT_SEND_DATA] =	{ 3, 0, syscall_ipc_port_send_data },
+	[SYSCALL_IPC_MAILBOX] =		{ 1, 0, syscall_ipc_mailbox },
+	[SYSCALL_IPC_PORT_SEND_VECTOR] = { 3, 0, syscall_ipc_port_send_vector },
+	[SYSCALL_IPC_PORT_RECEIVE_BUFFER] = { 4, 1, syscall_ipc_port_receive_buffer },
+	[SYSCALL_IPC_PORT_RIGHT_DROP] =	{ 2, 0, syscall_ipc_port_right_drop },
+	[SYSCALL_IPC_PORT_RIGHT_NOTIFY] = { 2, 0, syscall_ipc_port_right_notify },
+	[SYSCALL_IPC_THREAD_REPLY_PORT] = { 0, 2, syscall_ipc_thread_reply_port },
 
 	[SYSCALL_VM_PAGE_GET] =		{ 0, 1, syscall_vm_page_get },
 	[SYSCALL_VM_PAGE_FREE] =	{ 1, 0, syscall_vm_page_free },
 	[SYSCALL_VM_ALLOC] =		{ 1, 1, syscall_vm_alloc },
 	[SYSCALL_VM_FREE] =		{ 2, 0, syscall_vm_free },
 	[SYSCALL_VM_ALLOC_RANGE] =	{ 2, 0, syscall_vm_alloc_range },
+	[SYSCALL_VM_RECYCLE] =		{ 2, 0, syscall_vm_recycle },
 };
 
 int
@@ -220,6 +240,237 @@ syscall_ipc_task_port(register_t *params)
 	return (0);
 }
 
+static int
+syscall_ipc_port_send_copy(register_t *params)
+{
+	const struct ipc_header *ipch;
+	vaddr_t kvaddr, uvaddr;
+	size_t len, o;
+	void *page;
+	int error, error2;
+
+	uvaddr = params[0];
+	len = sizeof *ipch;
+	page = (void *)(uintptr_t)params[1];
+
+	error = vm_wire(current_task()->t_vm, uvaddr, len, &kvaddr, &o, false);
+	if (error != 0)
+		return (error);
+	ipch = (const struct ipc_header *)(uintptr_t)(kvaddr + o);
+
+	error = ipc_port_send_copy(ipch, page);
+
+	error2 = vm_unwire(current_task()->t_vm, uvaddr, len, kvaddr);
+	if (error2 != 0)
+		panic("%s: couldn't unwire string: %m", __func__, error2);
+
+	if (error != 0)
+		return (error);
+	return (0);
+}
+
+/*
+ * Only small messages may be sent this way; larger ones should be sent as a
+ * page.
+ */
+static int
+syscall_ipc_port_send_data(register_t *params)
+{
+	const struct ipc_header *ipch;
+	vaddr_t kvaddr, uvaddr, dkvaddr, duvaddr;
+	size_t len, o, dlen, doff;
+	const void *data;
+	int error, error2;
+
+	uvaddr = params[0];
+	len = sizeof *ipch;
+	duvaddr = params[1];
+	dlen = params[2];
+
+	if (dlen > IPC_DATA_INLINE_MAX || (duvaddr == 0) != (dlen == 0))
+		return (ERROR_INVALID);
+
+	error = vm_wire(current_task()->t_vm, uvaddr, len, &kvaddr, &o, false);
+	if (error != 0)
+		return (error);
+	ipch = (const struct ipc_header *)(uintptr_t)(kvaddr + o);
+
+	if (dlen != 0) {
+		error = vm_wire(current_task()->t_vm, duvaddr, dlen, &dkvaddr, &doff, false);
+		if (error == 0)
+			data = (const void *)(uintptr_t)(dkvaddr + doff);
+	} else {
+		error = 0;
+		data = NULL;
+	}
+
+	if (error == 0) {
+		error = ipc_port_send_data(ipch, data, dlen);
+
+		if (dlen != 0) {
+			error2 = vm_unwire(current_task()->t_vm, duvaddr, dlen, dkvaddr);
+			if (error2 != 0)
+				panic("%s: couldn't unwire data: %m", __func__, error2);
+		}
+	}
+
+	error2 = vm_unwire(current_task()->t_vm, uvaddr, len, kvaddr);
+	if (error2 != 0)
+		panic("%s: couldn't unwire string: %m", __func__, error2);
+
+	if (error != 0)
+		return (error);
+	return (0);
+}
+
+static int
+syscall_ipc_mailbox(register_t *params)
+{
+	struct ipc_mailbox *mb;
+	vaddr_t kvaddr, uvaddr;
+	size_t o;
+	int error, error2;
+
+	uvaddr = params[0];
+
+	if (PAGE_OFFSET(uvaddr) != 0)
+		return (ERROR_INVALID);
+
+	error = vm_wire(current_task()->t_vm, uvaddr, PAGE_SIZE, &kvaddr, &o, true);
+	if (error != 0)
+		return (error);
+	mb = (struct ipc_mailbox *)(uintptr_t)(kvaddr + o);
+
+	error = ipc_mailbox_process(mb);
+
+	error2 = vm_unwire(current_task()->t_vm, uvaddr, PAGE_SIZE, kvaddr);
+	if (error2 != 0)
+		panic("%s: couldn't unwire mailbox: %m", __func__, error2);
+
+	if (error != 0)
+		return (error);
+	return (0);
+}
+
+static int
+syscall_ipc_port_send_vector(register_t *params)
+{
+	struct ipc_page_vector ipcpv[IPC_DATA_PAGES_MAX];
+	const struct ipc_header *ipch;
+	vaddr_t kvaddr, uvaddr, vkvaddr, vuvaddr;
+	size_t len, o, vlen, voff;
+	unsigned npages;
+	int error, error2;
+
+	uvaddr = params[0];
+	len = sizeof *ipch;
+	vuvaddr = params[1];
+	npages = params[2];
+
+	if (npages == 0 || npages > IPC_DATA_PAGES_MAX)
+		return (ERROR_INVALID);
+	vlen = npages * sizeof ipcpv[0];
+
+	/*
+	 * Copy the vector in so it cannot change while the pages are taken.
+	 */
+	error = vm_wire(current_task()->t_vm, vuvaddr, vlen, &vkvaddr, &voff, false);
+	if (error != 0)
+		return (error);
+	memcpy(ipcpv, (const void *)(uintptr_t)(vkvaddr + voff), vlen);
+	error = vm_unwire(current_task()->t_vm, vuvaddr, vlen, vkvaddr);
+	if (error != 0)
+		panic("%s: couldn't unwire vector: %m", __func__, error);
+
+	error = vm_wire(current_task()->t_vm, uvaddr, len, &kvaddr, &o, false);
+	if (error != 0)
+		return (error);
+	ipch = (const struct ipc_header *)(uintptr_t)(kvaddr + o);
+
+	error = ipc_port_send_vector(ipch, ipcpv, npages);
+
+	error2 = vm_unwire(current_task()->t_vm, uvaddr, len, kvaddr);
+	if (error2 != 0)
+		panic("%s: couldn't unwire string: %m", __func__, error2);
+
+	if (error != 0)
+		return (error);
+	return (0);
+}
+
+static int
+syscall_ipc_port_receive_buffer(register_t *params)
+{
+	struct ipc_header *ipch;
+	vaddr_t kvaddr, uvaddr;
+	ipc_port_t port;
+	size_t len, o;
+	int error, error2;
+	void *page;
+
+	port = params[0];
+	uvaddr = params[1];
+	len = sizeof *ipch;
+
+	error = vm_wire(current_task()->t_vm, uvaddr, len, &kvaddr, &o, true);
+	if (error != 0)
+		return (error);
+	ipch = (struct ipc_header *)(uintptr_t)(kvaddr + o);
+
+	error = ipc_port_receive_buffer(port, ipch, (void *)(uintptr_t)params[2],
+					(size_t)params[3], &page);
+
+	error2 = vm_unwire(current_task()->t_vm, uvaddr, len, kvaddr);
+	if (error2 != 0)
+		panic("%s: couldn't unwire header: %m", __func__, error2);
+
+	if (error != 0)
+		return (error);
+
+	params[0] = (uintptr_t)page;
+
+	return (0);
+}
+
+static int
+syscall_ipc_port_right_drop(register_t *params)
+{
+	int error;
+
+	error = ipc_port_right_drop((ipc_port_t)params[0],
+				    (ipc_port_right_t)params[1]);
+	if (error != 0)
+		return (error);
+	return (0);
+}
+
+static int
+syscall_ipc_port_right_notify(register_t *params)
+{
+	int error;
+
+	error = ipc_port_right_notify((ipc_port_t)params[0],
+				      (ipc_port_t)params[1]);
+	if (error != 0)
+		return (error);
+	return (0);
+}
+
+static int
+syscall_ipc_thread_reply_port(register_t *params)
+{
+	ipc_cookie_t cookie;
+	ipc_port_t port;
+	int error;
+
+	error = ipc_thread_reply_port(&port, &cookie);
+	if (error != 0)
+		return (error);
+	params[0] = port;
+	params[1] = cookie;
+	return (0);
+}
+
 static int
 syscall_vm_page_get(register_t *params)
 {
@@ -319,3 +570,18 @@ syscall_vm_alloc_range(register_t *params)
 
 	return (0);
 }
+
+static int
+syscall_vm_recycle(register_t *params)
+{
+	struct thread *td;
+	int error;
+
+	td = current_thread();
+
+	error = vm_recycle(td->td_task->t_vm, (size_t)params[1], (vaddr_t)params[0]);
+	if (error != 0)
+		return (error);
+
+	return (0);
+}
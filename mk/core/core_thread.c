@@ -36,9 +36,12 @@ thread_create(struct thread **tdp, struct task *task, const char *name,
 	td->td_task = task;
 	STAILQ_INSERT_TAIL(&task->t_threads, td, td_link);
 	td->td_flags = flags;
+	WITNESS_THREAD_INIT(td);
 
 	scheduler_thread_setup(td);
 
+	ipc_thread_setup(td);
+
 	error = cpu_thread_setup(td);
 	if (error != 0) {
 		panic("%s: need to destroy thread, cpu_thread_setup failed: %m",
@@ -51,6 +54,7 @@ thread_create(struct thread **tdp, struct task *task, const char *name,
 void
 thread_exit(void)
 {
+	WITNESS_THREAD_EXIT(current_thread());
 	scheduler_thread_exiting();
 	scheduler_schedule(NULL, NULL);
 	NOTREACHED();
@@ -67,6 +71,8 @@ thread_free(struct thread *td)
 
 	cpu_thread_free(td);
 
+	ipc_thread_free(td);
+
 	pool_free(td);
 
 	if (STAILQ_EMPTY(&task->t_threads))
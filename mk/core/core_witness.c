@@ -0,0 +1,397 @@
+#include <core/types.h>
+#include <core/console.h>
+#include <core/critical.h>
+#include <core/mp.h>
+#include <core/spinlock.h>
+#include <core/startup.h>
+#include <core/string.h>
+#include <core/thread.h>
+#include <core/witness.h>
+
+#define	WITNESS_MAX		(128)
+#define	WITNESS_WORDS		(WITNESS_MAX / 64)
+#define	WITNESS_EDGES		(1024)
+
+#define	WITNESS_ISSET(set, i)	(((set)[(i) / 64] & (1ul << ((i) % 64))) != 0)
+#define	WITNESS_SET(set, i)	((set)[(i) / 64] |= 1ul << ((i) % 64))
+
+/*
+ * A lock class.  w_later holds every class which has been acquired while this
+ * one was held, directly or transitively, and w_direct only those acquired
+ * directly under it.
+ */
+struct witness {
+	const char *w_name;
+	enum witness_type w_type;
+	unsigned w_index;
+	bool w_sleep_reported;
+	uint64_t w_later[WITNESS_WORDS];
+	uint64_t w_direct[WITNESS_WORDS];
+	uint64_t w_reported[WITNESS_WORDS];
+};
+
+/*
+ * Where each direct ordering was first seen, for reports.
+ */
+struct witness_edge {
+	struct witness *we_first;
+	struct witness *we_second;
+	const void *we_first_pc;
+	const void *we_second_pc;
+};
+
+static const char *witness_type_names[] = {
+	[WITNESS_SPIN] = "spin",
+	[WITNESS_SLEEP] = "sleep",
+};
+
+/*
+ * Classes and edges come from fixed tables, since locks exist before anything
+ * can be allocated.  The graph is guarded by a bare flag, since spinlocks are
+ * themselves checked; a CPU already inside the witness code (say, printing a
+ * report) skips checking the locks that takes.
+ */
+static struct witness witness_table[WITNESS_MAX];
+static unsigned witness_count;
+static struct witness_edge witness_edges[WITNESS_EDGES];
+static unsigned witness_nedges;
+static uint64_t witness_busy;
+static bool witness_cpu_busy[MAXCPUS];
+static struct witness_stack witness_spin[MAXCPUS];
+
+static bool witness_enter(bool);
+static void witness_exit(bool);
+static void witness_check_stack(struct witness *, const void *, struct witness_stack *);
+static void witness_order(struct witness *, const void *, struct witness *, const void *);
+static void witness_report(struct witness *, const void *, struct witness *, const void *);
+static void witness_report_path(struct witness *, struct witness *);
+static void witness_report_held(void);
+static void witness_report_stack(const struct witness_stack *);
+static struct witness_stack *witness_stack(const struct witness *);
+
+struct witness *
+witness_lookup(const char *name, enum witness_type type)
+{
+	struct witness *w;
+	unsigned i;
+	bool crit;
+
+	crit = !startup_early;
+	if (!witness_enter(crit))
+		return (NULL);
+	for (i = 0; i < witness_count; i++) {
+		w = &witness_table[i];
+		if (w->w_type == type && strcmp(w->w_name, name) == 0)
+			goto out;
+	}
+	if (witness_count == WITNESS_MAX) {
+		/* Unchecked.  */
+		w = NULL;
+		goto out;
+	}
+	w = &witness_table[witness_count];
+	w->w_name = name;
+	w->w_type = type;
+	w->w_index = witness_count++;
+out:
+	witness_exit(crit);
+	return (w);
+}
+
+/*
+ * Called before waiting for a lock: learn its order against everything held,
+ * and report acquisitions which contradict what has been learned.
+ */
+void
+witness_check(struct witness *w, const void *pc)
+{
+	struct thread *td;
+
+	if (w == NULL || startup_early)
+		return;
+	if (!witness_enter(true))
+		return;
+	witness_check_stack(w, pc, &witness_spin[mp_whoami()]);
+	td = current_thread();
+	if (td != NULL)
+		witness_check_stack(w, pc, &td->td_witness);
+	witness_exit(true);
+}
+
+void
+witness_lock(struct witness *w, const void *lock, const void *pc)
+{
+	struct witness_stack *ws;
+	struct witness_held *wh;
+
+	if (w == NULL || startup_early)
+		return;
+	ws = witness_stack(w);
+	if (ws == NULL || ws->ws_count == WITNESS_STACK_DEPTH)
+		return;
+	wh = &ws->ws_held[ws->ws_count++];
+	wh->wh_witness = w;
+	wh->wh_lock = lock;
+	wh->wh_pc = pc;
+}
+
+void
+witness_unlock(struct witness *w, const void *lock)
+{
+	struct witness_stack *ws;
+	unsigned i;
+
+	if (w == NULL || startup_early)
+		return;
+	ws = witness_stack(w);
+	if (ws == NULL)
+		return;
+	/* Locks are not always released in order.  */
+	for (i = ws->ws_count; i > 0; i--) {
+		if (ws->ws_held[i - 1].wh_lock != lock)
+			continue;
+		for (; i < ws->ws_count; i++)
+			ws->ws_held[i - 1] = ws->ws_held[i];
+		ws->ws_count--;
+		return;
+	}
+}
+
+/*
+ * Called on the way to sleep, with the sleep queue's spinlock held; it is
+ * released as the thread switches out, but no other spinlock may be.
+ */
+void
+witness_sleep(const struct spinlock *sqlock)
+{
+	struct witness_stack *ws;
+	struct witness *w;
+	unsigned i;
+
+	if (startup_early)
+		return;
+	if (!witness_enter(true))
+		return;
+	ws = &witness_spin[mp_whoami()];
+	for (i = 0; i < ws->ws_count; i++) {
+		if (ws->ws_held[i].wh_lock == sqlock)
+			continue;
+		w = ws->ws_held[i].wh_witness;
+		if (w->w_sleep_reported)
+			continue;
+		w->w_sleep_reported = true;
+		printf("witness: sleeping with spinlock %s held (locked at %p)\n",
+		       w->w_name, ws->ws_held[i].wh_pc);
+		witness_report_held();
+	}
+	witness_exit(true);
+}
+
+void
+witness_thread_exit(struct thread *td)
+{
+	if (td->td_witness.ws_count == 0)
+		return;
+	if (!witness_enter(true))
+		return;
+	printf("witness: thread %s exiting with locks held\n", td->td_name);
+	witness_report_stack(&td->td_witness);
+	witness_exit(true);
+}
+
+static bool
+witness_enter(bool crit)
+{
+	cpu_id_t cpu;
+
+	if (crit)
+		critical_enter();
+	cpu = mp_whoami();
+	if (witness_cpu_busy[cpu]) {
+		if (crit)
+			critical_exit();
+		return (false);
+	}
+	witness_cpu_busy[cpu] = true;
+	while (!atomic_cmpset64(&witness_busy, 0, 1))
+		continue;
+	return (true);
+}
+
+static void
+witness_exit(bool crit)
+{
+	atomic_store64(&witness_busy, 0);
+	witness_cpu_busy[mp_whoami()] = false;
+	if (crit)
+		critical_exit();
+}
+
+static void
+witness_check_stack(struct witness *w, const void *pc, struct witness_stack *ws)
+{
+	struct witness_held *wh;
+	struct witness *held;
+	unsigned i;
+
+	for (i = 0; i < ws->ws_count; i++) {
+		wh = &ws->ws_held[i];
+		held = wh->wh_witness;
+
+		/*
+		 * Instances of one class (two ports, say) are ordered by the
+		 * code holding them, not by class.
+		 */
+		if (held == w)
+			continue;
+
+		if (WITNESS_ISSET(w->w_later, held->w_index)) {
+			if (WITNESS_ISSET(held->w_reported, w->w_index))
+				continue;
+			WITNESS_SET(held->w_reported, w->w_index);
+			witness_report(held, wh->wh_pc, w, pc);
+			continue;
+		}
+
+		if (!WITNESS_ISSET(held->w_direct, w->w_index))
+			witness_order(held, wh->wh_pc, w, pc);
+	}
+}
+
+/*
+ * Learn that first is taken before second, and so before everything taken
+ * after second; likewise for everything taken before first.
+ */
+static void
+witness_order(struct witness *first, const void *first_pc,
+	      struct witness *second, const void *second_pc)
+{
+	struct witness_edge *we;
+	struct witness *w;
+	unsigned i, j;
+
+	WITNESS_SET(first->w_direct, second->w_index);
+	if (witness_nedges != WITNESS_EDGES) {
+		we = &witness_edges[witness_nedges++];
+		we->we_first = first;
+		we->we_second = second;
+		we->we_first_pc = first_pc;
+		we->we_second_pc = second_pc;
+	}
+
+	for (i = 0; i < witness_count; i++) {
+		w = &witness_table[i];
+		if (w != first && !WITNESS_ISSET(w->w_later, first->w_index))
+			continue;
+		WITNESS_SET(w->w_later, second->w_index);
+		for (j = 0; j < WITNESS_WORDS; j++)
+			w->w_later[j] |= second->w_later[j];
+	}
+}
+
+static void
+witness_report(struct witness *held, const void *held_pc,
+	       struct witness *w, const void *pc)
+{
+	printf("witness: lock order reversal:\n");
+	printf(" 1st %s (%s) locked at %p\n", held->w_name,
+	       witness_type_names[held->w_type], held_pc);
+	printf(" 2nd %s (%s) locked at %p\n", w->w_name,
+	       witness_type_names[w->w_type], pc);
+	printf(" established order:\n");
+	witness_report_path(w, held);
+	printf(" held now:\n");
+	witness_report_held();
+}
+
+/*
+ * Show how from came to be ordered before to, edge by edge, with where each
+ * ordering was first seen.
+ */
+static void
+witness_report_path(struct witness *from, struct witness *to)
+{
+	static unsigned queue[WITNESS_MAX], prev[WITNESS_MAX];
+	static struct witness *path[WITNESS_MAX];
+	struct witness_edge *we;
+	struct witness *w;
+	unsigned head, i, n, tail;
+
+	for (i = 0; i < witness_count; i++)
+		prev[i] = WITNESS_MAX;
+
+	head = tail = 0;
+	queue[tail++] = from->w_index;
+	prev[from->w_index] = from->w_index;
+	while (head != tail && prev[to->w_index] == WITNESS_MAX) {
+		w = &witness_table[queue[head++]];
+		for (i = 0; i < witness_count; i++) {
+			if (prev[i] != WITNESS_MAX ||
+			    !WITNESS_ISSET(w->w_direct, i))
+				continue;
+			prev[i] = w->w_index;
+			queue[tail++] = i;
+		}
+	}
+	if (prev[to->w_index] == WITNESS_MAX)
+		return;
+
+	n = 0;
+	for (i = to->w_index; i != from->w_index; i = prev[i])
+		path[n++] = &witness_table[i];
+	path[n++] = from;
+
+	while (--n > 0) {
+		for (i = 0; i < witness_nedges; i++) {
+			we = &witness_edges[i];
+			if (we->we_first == path[n] &&
+			    we->we_second == path[n - 1])
+				break;
+		}
+		if (i == witness_nedges) {
+			printf("  %s -> %s\n", path[n]->w_name,
+			       path[n - 1]->w_name);
+			continue;
+		}
+		printf("  %s at %p -> %s at %p\n", path[n]->w_name,
+		       we->we_first_pc, path[n - 1]->w_name, we->we_second_pc);
+	}
+}
+
+static void
+witness_report_held(void)
+{
+	struct thread *td;
+
+	witness_report_stack(&witness_spin[mp_whoami()]);
+	td = current_thread();
+	if (td != NULL)
+		witness_report_stack(&td->td_witness);
+}
+
+static void
+witness_report_stack(const struct witness_stack *ws)
+{
+	const struct witness_held *wh;
+	unsigned i;
+
+	for (i = 0; i < ws->ws_count; i++) {
+		wh = &ws->ws_held[i];
+		printf("  %s (%s) %p locked at %p\n", wh->wh_witness->w_name,
+		       witness_type_names[wh->wh_witness->w_type], wh->wh_lock,
+		       wh->wh_pc);
+	}
+}
+
+static struct witness_stack *
+witness_stack(const struct witness *w)
+{
+	struct thread *td;
+
+	if (w->w_type == WITNESS_SPIN)
+		return (&witness_spin[mp_whoami()]);
+	td = current_thread();
+	if (td == NULL)
+		return (NULL);
+	return (&td->td_witness);
+}
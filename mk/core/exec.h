@@ -7,7 +7,7 @@
 
 struct vm;
 
-int exec_load(struct vm *, vaddr_t *, const char *, fs_file_read_op_t *, fs_context_t, fs_file_context_t) __non_null(1, 2, 3, 4) __check_result;
-int exec_task(ipc_port_t, ipc_port_t *, const char *, fs_file_read_op_t *, fs_context_t, fs_file_context_t) __non_null(3, 4) __check_result;
+int exec_load(struct vm *, vaddr_t *, struct fs *, const char *) __non_null(1, 2, 3, 4) __check_result;
+int exec_task(ipc_port_t, ipc_port_t *, struct fs *, const char *) __non_null(3, 4) __check_result;
 
 #endif /* !_CORE_EXEC_H_ */
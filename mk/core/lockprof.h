@@ -0,0 +1,62 @@
+#ifndef	_CORE_LOCKPROF_H_
+#define	_CORE_LOCKPROF_H_
+
+/*
+ * Lock contention profiling, enabled by the lockprof option.  Statistics are
+ * kept per lock name and type, so every instance of, say, the per-port mutex
+ * adds up into one record.  The LOCKPROF_* macros compile away otherwise.
+ */
+
+#ifdef LOCKPROF
+#include <core/mp.h>
+#include <cpu/timestamp.h>
+
+enum lockprof_type {
+	LOCKPROF_SPINLOCK,
+	LOCKPROF_MUTEX,
+	LOCKPROF_RWLOCK,
+};
+
+struct lockprof {
+	const char *lp_name;
+	enum lockprof_type lp_type;
+	uint64_t lp_acquires;		/* Total acquisitions.  */
+	uint64_t lp_contended;		/* Acquisitions which had to wait.  */
+	uint64_t lp_spins;		/* Spin iterations while waiting.  */
+	uint64_t lp_sleeps;		/* Times a waiter went to sleep.  */
+	uint64_t lp_hold_max;		/* Longest hold, in timestamp units.  */
+};
+
+struct lockprof *lockprof_lookup(const char *, enum lockprof_type) __non_null(1);
+void lockprof_acquire(struct lockprof *, bool, unsigned) __non_null(1);
+void lockprof_release(struct lockprof *, uint64_t) __non_null(1);
+void lockprof_sleep(struct lockprof *) __non_null(1);
+
+/*
+ * Hold times are measured with a per-CPU counter, so the start time carries
+ * the CPU it was taken on and holds which migrate are not measured.
+ */
+static inline uint64_t
+lockprof_timestamp(void)
+{
+	return (((uint64_t)mp_whoami() << 32) | cpu_timestamp());
+}
+
+#define	LOCKPROF_INIT(lpp, name, type)					\
+	(*(lpp) = lockprof_lookup((name), (type)))
+#define	LOCKPROF_ACQUIRE(lp, contended, spins)				\
+	lockprof_acquire((lp), (contended), (spins))
+#define	LOCKPROF_RELEASE(lp, start)	lockprof_release((lp), (start))
+#define	LOCKPROF_SLEEP(lp)		lockprof_sleep((lp))
+#define	LOCKPROF_SPIN(spins)		((spins)++)
+#define	LOCKPROF_TIMESTAMP(tsp)		(*(tsp) = lockprof_timestamp())
+#else
+#define	LOCKPROF_INIT(lpp, name, type)	do { } while (0)
+#define	LOCKPROF_ACQUIRE(lp, contended, spins) do { } while (0)
+#define	LOCKPROF_RELEASE(lp, start)	do { } while (0)
+#define	LOCKPROF_SLEEP(lp)		do { } while (0)
+#define	LOCKPROF_SPIN(spins)		((void)0)
+#define	LOCKPROF_TIMESTAMP(tsp)		do { } while (0)
+#endif
+
+#endif /* !_CORE_LOCKPROF_H_ */
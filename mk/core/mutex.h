@@ -4,20 +4,40 @@
 #include <core/sleepq.h>
 #include <core/spinlock.h>
 
+struct lockprof;
 struct thread;
+struct witness;
 
+/*
+ * The owner word holds the owning thread, with MUTEX_CONTESTED set while
+ * there are threads asleep waiting for it.  An uncontested lock or unlock is a
+ * single compare-and-set on it; the spinlock only serializes the sleep queue.
+ */
 struct mutex {
 	struct spinlock mtx_lock;
 	struct sleepq mtx_sleepq;
-	struct thread *mtx_owner;
+	uint64_t mtx_owner;
 	unsigned mtx_waiters;
 	unsigned mtx_flags;
+#ifdef LOCKPROF
+	struct lockprof *mtx_prof;
+	uint64_t mtx_hold_start;
+#endif
+#ifdef INVARIANTS
+	struct witness *mtx_witness;
+#endif
 };
 
 #define	MUTEX_FLAG_DEFAULT	(0x00000000)
 
+#define	MUTEX_CONTESTED		(0x0000000000000001ul)
+
+#define	MUTEX_OWNER(owner)						\
+	((struct thread *)(uintptr_t)((owner) & ~MUTEX_CONTESTED))
+
 #define	MUTEX_HELD(mtx)							\
-	((mtx)->mtx_owner != NULL && (mtx)->mtx_owner == current_thread())
+	(current_thread() != NULL &&					\
+	 MUTEX_OWNER(atomic_load64(&(mtx)->mtx_owner)) == current_thread())
 
 void mutex_init(struct mutex *, const char *, unsigned) __non_null(1, 2);
 void mutex_lock(struct mutex *) __non_null(1);
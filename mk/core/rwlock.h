@@ -0,0 +1,68 @@
+#ifndef	_CORE_RWLOCK_H_
+#define	_CORE_RWLOCK_H_
+
+#include <core/sleepq.h>
+#include <core/spinlock.h>
+#include <core/startup.h>
+
+struct lockprof;
+struct thread;
+struct witness;
+
+/*
+ * Sleepable reader/writer locks for read-mostly data.
+ *
+ * The state word holds a count of readers and a few flags.  Uncontended
+ * acquisition and release is a single compare-and-set; the spinlock and sleep
+ * queues are only touched when a thread has to wait, or when it releases the
+ * lock with waiters flagged.  Writers have priority: once a writer is waiting,
+ * new readers queue up behind it rather than starving it.
+ *
+ * Threads that cannot sleep (no current thread, or in a critical section, as
+ * for allocations made with a pool lock held) spin instead.  Neither recursion
+ * nor upgrading is supported.
+ */
+
+struct rwlock {
+	struct spinlock rw_lock;
+	struct sleepq rw_readq;
+	struct sleepq rw_writeq;
+	struct thread *rw_owner;
+	uint64_t rw_state;
+#ifdef LOCKPROF
+	struct lockprof *rw_prof;
+	uint64_t rw_hold_start;		/* Writers only.  */
+#endif
+#ifdef INVARIANTS
+	struct witness *rw_witness;
+#endif
+};
+
+#define	RWLOCK_WRITER		(0x0000000000000001ul)	/* Write-locked.  */
+#define	RWLOCK_WAITERS		(0x0000000000000002ul)	/* Threads asleep.  */
+#define	RWLOCK_WRITE_WANTED	(0x0000000000000004ul)	/* Writer waiting.  */
+#define	RWLOCK_READER		(0x0000000000000008ul)	/* One reader.  */
+
+#define	RWLOCK_READERS(state)	((state) / RWLOCK_READER)
+
+#define	RWLOCK_XOWNED(rw)						\
+	((atomic_load64(&(rw)->rw_state) & RWLOCK_WRITER) != 0 &&	\
+	 (rw)->rw_owner == current_thread())
+
+#define	RWLOCK_ASSERT_HELD(rw)						\
+	ASSERT(startup_early ||						\
+	       RWLOCK_READERS(atomic_load64(&(rw)->rw_state)) != 0 ||	\
+	       RWLOCK_XOWNED(rw),					\
+	       "Lock must be held.")
+
+#define	RWLOCK_ASSERT_XHELD(rw)						\
+	ASSERT(startup_early || RWLOCK_XOWNED(rw),			\
+	       "Lock must be held exclusively.")
+
+void rwlock_init(struct rwlock *, const char *) __non_null(1, 2);
+void rwlock_rlock(struct rwlock *) __non_null(1);
+void rwlock_runlock(struct rwlock *) __non_null(1);
+void rwlock_wlock(struct rwlock *) __non_null(1);
+void rwlock_wunlock(struct rwlock *) __non_null(1);
+
+#endif /* !_CORE_RWLOCK_H_ */
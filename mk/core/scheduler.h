@@ -27,10 +27,12 @@ struct scheduler_entry {
 void scheduler_init(void);
 
 void scheduler_activate(struct thread *) __non_null(1);
+void scheduler_cpu_bind(struct thread *, cpu_id_t) __non_null(1);
 void scheduler_cpu_pin(struct thread *) __non_null(1);
 bool scheduler_idle(void) __check_result;
 void scheduler_schedule(struct thread *, struct spinlock *);
 void scheduler_thread_exiting(void);
+bool scheduler_thread_running(struct thread *) __non_null(1) __check_result;
 void scheduler_thread_runnable(struct thread *) __non_null(1);
 void scheduler_thread_setup(struct thread *) __non_null(1);
 void scheduler_thread_sleeping(struct thread *) __non_null(1);
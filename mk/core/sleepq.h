@@ -5,6 +5,7 @@
 
 struct sleepq_entry;
 struct spinlock;
+struct thread;
 
 struct sleepq {
 	struct spinlock *sq_lock;
@@ -13,7 +14,8 @@ struct sleepq {
 
 void sleepq_init(struct sleepq *, struct spinlock *);
 void sleepq_enter(struct sleepq *);
+bool sleepq_empty(struct sleepq *);
 void sleepq_signal(struct sleepq *);
-void sleepq_signal_one(struct sleepq *);
+struct thread *sleepq_signal_one(struct sleepq *);
 
 #endif /* !_CORE_SLEEPQ_H_ */
@@ -5,16 +5,46 @@
 #include <core/mp.h>
 #include <cpu/atomic.h>
 
+struct lockprof;
+struct witness;
+
+struct spinlock_qnode;
+
+/*
+ * Spinlocks are handed out in FIFO order so that no CPU can be starved.  By
+ * default they are ticket locks; SPINLOCK_FLAG_QUEUED makes them MCS locks,
+ * where each waiter spins on its own per-CPU queue node rather than on the
+ * lock, for hot locks with many CPUs waiting.
+ *
+ * Waiters normally spin with interrupts disabled, since an interrupt handler
+ * taking the same lock would queue up behind its own CPU.
+ * SPINLOCK_FLAG_INTERRUPTS lets interrupts in while waiting, for locks which
+ * are never taken by interrupt handlers and whose holders wait for other CPUs
+ * to service an IPI.
+ */
 struct spinlock {
 	const char *s_name;
 	uint64_t s_owner;
 	uint64_t s_nest;
+	uint64_t s_next;		/* Next ticket to hand out.  */
+	uint64_t s_serving;		/* Ticket which holds the lock.  */
+	uint64_t s_tail;		/* Last queued MCS node.  */
+	struct spinlock_qnode *s_qnode;	/* MCS node of the holder.  */
 	unsigned s_flags;
+#ifdef LOCKPROF
+	struct lockprof *s_prof;
+	uint64_t s_hold_start;
+#endif
+#ifdef INVARIANTS
+	struct witness *s_witness;
+#endif
 };
 
 #define	SPINLOCK_FLAG_DEFAULT	(0x00000000)
 #define	SPINLOCK_FLAG_RECURSE	(0x00000001)
 #define	SPINLOCK_FLAG_VALID	(0x00000002)
+#define	SPINLOCK_FLAG_QUEUED	(0x00000004)
+#define	SPINLOCK_FLAG_INTERRUPTS (0x00000008)
 
 #define	SPINLOCK_ASSERT_HELD(lock)					\
 	ASSERT(atomic_load64(&(lock)->s_owner) == (uint64_t)mp_whoami(),\
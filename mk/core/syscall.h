@@ -13,6 +13,14 @@
 #define	SYSCALL_IPC_PORT_WAIT		(SYSCALL_IPC_BASE + 0x02)
 #define	SYSCALL_IPC_PORT_RECEIVE	(SYSCALL_IPC_BASE + 0x03)
 #define	SYSCALL_IPC_TASK_PORT		(SYSCALL_IPC_BASE + 0x04)
+#define	SYSCALL_IPC_PORT_SEND_COPY	(SYSCALL_IPC_BASE + 0x05)
+#define	SYSCALL_IPC_PORT_SEND_DATA	(SYSCALL_IPC_BASE + 0x06)
+#define	SYSCALL_IPC_MAILBOX		(SYSCALL_IPC_BASE + 0x07)
+#define	SYSCALL_IPC_PORT_SEND_VECTOR	(SYSCALL_IPC_BASE + 0x08)
+#define	SYSCALL_IPC_PORT_RECEIVE_BUFFER	(SYSCALL_IPC_BASE + 0x09)
+#define	SYSCALL_IPC_PORT_RIGHT_DROP	(SYSCALL_IPC_BASE + 0x0a)
+#define	SYSCALL_IPC_PORT_RIGHT_NOTIFY	(SYSCALL_IPC_BASE + 0x0b)
+#define	SYSCALL_IPC_THREAD_REPLY_PORT	(SYSCALL_IPC_BASE + 0x0c)
 
 #define	SYSCALL_VM_BASE			(0x30)
 #define	SYSCALL_VM_PAGE_GET		(SYSCALL_VM_BASE + 0x00)
@@ -20,8 +28,9 @@
 #define	SYSCALL_VM_ALLOC		(SYSCALL_VM_BASE + 0x02)
 #define	SYSCALL_VM_FREE			(SYSCALL_VM_BASE + 0x03)
 #define	SYSCALL_VM_ALLOC_RANGE		(SYSCALL_VM_BASE + 0x04)
+#define	SYSCALL_VM_RECYCLE		(SYSCALL_VM_BASE + 0x05)
 
-#define	SYSCALL_LAST			(SYSCALL_VM_ALLOC_RANGE)
+#define	SYSCALL_LAST			(SYSCALL_VM_RECYCLE)
 
 #ifdef MK
 #ifndef	ASSEMBLER
@@ -3,9 +3,12 @@
 
 #include <core/queue.h>
 #include <core/scheduler.h>
+#include <core/witness.h>
 #include <cpu/context.h>
 #include <cpu/pcpu.h>
 #include <cpu/thread.h>
+#include <ipc/ipc.h>
+#include <ipc/thread.h>
 
 #define	THREAD_NAME_SIZE	(128)
 
@@ -23,6 +26,10 @@ struct thread {
 	vaddr_t td_ustack_bottom;
 	vaddr_t td_ustack_top;
 	struct cpu_thread td_cputhread;
+	struct ipc_thread td_ipc;
+#ifdef INVARIANTS
+	struct witness_stack td_witness;	/* Sleepable locks held.  */
+#endif
 };
 
 void thread_init(void);
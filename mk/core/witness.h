@@ -0,0 +1,67 @@
+#ifndef	_CORE_WITNESS_H_
+#define	_CORE_WITNESS_H_
+
+/*
+ * Lock-order verification, for INVARIANTS kernels.
+ *
+ * Locks are grouped into classes by name, with spinlocks kept apart from
+ * sleepable locks.  Each time a lock is acquired with others held, the
+ * ordering of their classes is learned; acquiring them in an order that would
+ * close a cycle is reported along with where the established order was first
+ * seen.  Sleeping with spinlocks held is reported too.
+ *
+ * Spinlocks held are tracked per CPU and sleepable locks per thread.  The
+ * WITNESS_* macros compile away without INVARIANTS.
+ */
+
+#ifdef INVARIANTS
+struct spinlock;
+struct thread;
+struct witness;
+
+enum witness_type {
+	WITNESS_SPIN,
+	WITNESS_SLEEP,
+};
+
+#define	WITNESS_STACK_DEPTH	(16)
+
+struct witness_held {
+	struct witness *wh_witness;
+	const void *wh_lock;
+	const void *wh_pc;
+};
+
+struct witness_stack {
+	unsigned ws_count;
+	struct witness_held ws_held[WITNESS_STACK_DEPTH];
+};
+
+struct witness *witness_lookup(const char *, enum witness_type) __non_null(1);
+void witness_check(struct witness *, const void *);
+void witness_lock(struct witness *, const void *, const void *) __non_null(2);
+void witness_unlock(struct witness *, const void *) __non_null(2);
+void witness_sleep(const struct spinlock *);
+void witness_thread_exit(struct thread *) __non_null(1);
+
+#define	WITNESS_INIT(wp, name, type)					\
+	(*(wp) = witness_lookup((name), (type)))
+#define	WITNESS_CHECK(w)						\
+	witness_check((w), __builtin_return_address(0))
+#define	WITNESS_LOCK(w, lock)						\
+	witness_lock((w), (lock), __builtin_return_address(0))
+#define	WITNESS_UNLOCK(w, lock)		witness_unlock((w), (lock))
+#define	WITNESS_SLEEP(lock)		witness_sleep((lock))
+#define	WITNESS_THREAD_INIT(td)		((td)->td_witness.ws_count = 0)
+#define	WITNESS_THREAD_EXIT(td)		witness_thread_exit((td))
+#else
+#define	WITNESS_INIT(wp, name, type)	do { } while (0)
+#define	WITNESS_CHECK(w)		do { } while (0)
+#define	WITNESS_LOCK(w, lock)		do { } while (0)
+#define	WITNESS_UNLOCK(w, lock)		do { } while (0)
+#define	WITNESS_SLEEP(lock)		do { } while (0)
+#define	WITNESS_THREAD_INIT(td)		do { } while (0)
+#define	WITNESS_THREAD_EXIT(td)		do { } while (0)
+#endif
+
+#endif /* !_CORE_WITNESS_H_ */
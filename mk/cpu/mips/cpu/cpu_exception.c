@@ -1,4 +1,5 @@
 #include <core/types.h>
+#include <core/error.h>
 #include <core/mp.h>
 #include <core/string.h>
 #include <core/task.h>
@@ -167,15 +168,20 @@ exception(struct frame *frame)
 			break;
 		}
 		vaddr = frame->f_regs[FRAME_BADVADDR];
-		if (vaddr >= td->td_ustack_bottom && vaddr < td->td_ustack_top) {
+		if (vaddr >= td->td_ustack_bottom && vaddr < td->td_ustack_top)
 			error = vm_fault_stack(td, vaddr);
-			if (error != 0) {
-				printf("%s: vm_fault_stack failed: %m\n", __func__, error);
-				break;
-			}
+		else
+			error = vm_fault(td->td_task->t_vm, vaddr);
+		if (error == 0) {
 			handled = true;
 			break;
 		}
+		/*
+		 * Whether there was nothing there or it could not be read or
+		 * allocated, it is the task's problem and not the kernel's.
+		 */
+		if (error != ERROR_NOT_FOUND)
+			printf("%s: fault failed: %m\n", __func__, error);
 		printf("Userland page fault.  Thread exiting.\n");
 		cpu_exception_state_dump();
 		thread_exit();
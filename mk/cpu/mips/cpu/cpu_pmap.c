@@ -1,6 +1,8 @@
 #include <core/types.h>
 #include <core/error.h>
 #include <core/pool.h>
+#include <core/queue.h>
+#include <core/spinlock.h>
 #include <core/startup.h>
 #include <core/string.h>
 #include <core/task.h>
@@ -38,6 +40,18 @@ COMPILE_TIME_ASSERT(sizeof (struct pmap_lev0) == PAGE_SIZE);
  */
 COMPILE_TIME_ASSERT(sizeof (struct pmap) <= PAGE_SIZE);
 
+/*
+ * Every mapping of a managed page made through pmap_map is recorded on a list
+ * hanging off of the page, so that all of its mappings can be found again
+ * from the page alone, e.g. to revoke or write-protect it.  Direct-mapped
+ * addresses are not managed and have no entries.
+ */
+struct pmap_pv {
+	struct pmap *pv_pmap;
+	vaddr_t pv_vaddr;
+	SLIST_ENTRY(struct pmap_pv) pv_link;
+};
+
 /*
  * Page-table indexing inlines.
  */
@@ -62,14 +76,21 @@ pmap_index0(vaddr_t vaddr)
 static void pmap_alloc_asid(struct pmap *);
 static int pmap_alloc_pte(struct pmap *, vaddr_t, pt_entry_t **);
 static void pmap_collect(struct pmap *);
+static int pmap_enter(struct vm *, vaddr_t, struct vm_page *, pt_entry_t);
 static struct pmap_lev0 *pmap_find0(struct pmap *, vaddr_t);
 static struct pmap_lev1 *pmap_find1(struct pmap_lev0 *, vaddr_t);
 static pt_entry_t *pmap_find_pte(struct pmap_lev1 *, vaddr_t);
 static bool pmap_is_direct(vaddr_t);
 static void pmap_pinit(struct pmap *, vaddr_t, vaddr_t);
-static void pmap_update(struct pmap *, vaddr_t, struct vm_page *, pt_entry_t);
+static struct pmap_pv *pmap_pv_remove(struct pmap *, vaddr_t, paddr_t);
+static struct pmap_pv *pmap_update(struct pmap *, vaddr_t, struct vm_page *, pt_entry_t, struct pmap_pv *);
 
 static struct pool pmap_pool;
+static struct pool pmap_pv_pool;
+static struct spinlock pmap_pv_lock;
+
+#define	PMAP_PV_LOCK()		spinlock_lock(&pmap_pv_lock)
+#define	PMAP_PV_UNLOCK()	spinlock_unlock(&pmap_pv_lock)
 
 unsigned
 pmap_asid(struct pmap *pm)
@@ -129,6 +150,11 @@ pmap_bootstrap(void)
 			    POOL_DEFAULT);
 	if (error != 0)
 		panic("%s: pool_create failed: %m", __func__, error);
+	error = pool_create(&pmap_pv_pool, "PMAP PV", sizeof (struct pmap_pv),
+			    POOL_DEFAULT);
+	if (error != 0)
+		panic("%s: pool_create failed: %m", __func__, error);
+	spinlock_init(&pmap_pv_lock, "PMAP PV", SPINLOCK_FLAG_DEFAULT);
 	error = pmap_init(&kernel_vm, KERNEL_BASE, KERNEL_END);
 	if (error != 0)
 		panic("%s: pmap_init failed: %m", __func__, error);
@@ -204,34 +230,145 @@ pmap_init(struct vm *vm, vaddr_t base, vaddr_t end)
 	return (0);
 }
 
+bool
+pmap_is_cow(struct vm *vm, vaddr_t vaddr)
+{
+	pt_entry_t *pte;
+
+	if (pmap_is_direct(vaddr))
+		return (false);
+	pte = pmap_find(vm->vm_pmap, vaddr);
+	if (pte == NULL || !pte_test(pte, PG_V))
+		return (false);
+	return (pte_test(pte, PG_COW));
+}
+
 int
 pmap_map(struct vm *vm, vaddr_t vaddr, struct vm_page *page)
+{
+	return (pmap_enter(vm, vaddr, page, 0));
+}
+
+int
+pmap_map_cow(struct vm *vm, vaddr_t vaddr, struct vm_page *page)
+{
+	if (vm == &kernel_vm)
+		return (ERROR_NOT_PERMITTED);
+	return (pmap_enter(vm, vaddr, page, PG_RO | PG_COW));
+}
+
+unsigned
+pmap_page_mappings(struct vm_page *page)
+{
+	struct pmap_pv *pv;
+	unsigned mappings;
+
+	mappings = 0;
+	PMAP_PV_LOCK();
+	SLIST_FOREACH(pv, &page->pg_mappings, pv_link)
+		mappings++;
+	PMAP_PV_UNLOCK();
+
+	return (mappings);
+}
+
+/*
+ * Make every user mapping of the page copy-on-write.  Kernel mappings cannot
+ * be copy-on-write and are left alone, as are read-only mappings, which must
+ * not become writable when the share is broken.
+ */
+void
+pmap_page_protect_cow(struct vm_page *page)
+{
+	struct pmap_pv *pv;
+	pt_entry_t *pte;
+
+	PMAP_PV_LOCK();
+	SLIST_FOREACH(pv, &page->pg_mappings, pv_link) {
+		if (pv->pv_pmap == kernel_vm.vm_pmap)
+			continue;
+		pte = pmap_find(pv->pv_pmap, pv->pv_vaddr);
+		if (pte == NULL || !pte_test(pte, PG_V))
+			panic("%s: pv entry without a mapping.", __func__);
+		if (pte_test(pte, PG_RO))
+			continue;
+		pte_set(pte, PG_RO | PG_COW);
+		if (pte_test(pte, PG_D)) {
+			pte_clear(pte, PG_D);
+			tlb_invalidate(pv->pv_pmap, pv->pv_vaddr);
+		}
+	}
+	PMAP_PV_UNLOCK();
+}
+
+/*
+ * Remove every mapping of the page, returning how many there were so that
+ * the page layer can drop the references they held.
+ */
+unsigned
+pmap_page_remove(struct vm_page *page)
+{
+	struct pmap_pv *pv;
+	pt_entry_t *pte;
+	unsigned mappings;
+
+	mappings = 0;
+	for (;;) {
+		PMAP_PV_LOCK();
+		pv = SLIST_FIRST(&page->pg_mappings);
+		if (pv == NULL) {
+			PMAP_PV_UNLOCK();
+			break;
+		}
+		SLIST_REMOVE_HEAD(&page->pg_mappings, pv_link);
+
+		pte = pmap_find(pv->pv_pmap, pv->pv_vaddr);
+		if (pte == NULL || !pte_test(pte, PG_V))
+			panic("%s: pv entry without a mapping.", __func__);
+		tlb_invalidate(pv->pv_pmap, pv->pv_vaddr);
+		atomic_store64(pte, 0);
+		PMAP_PV_UNLOCK();
+
+		pool_free(pv);
+		mappings++;
+	}
+
+	return (mappings);
+}
+
+int
+pmap_protect_cow(struct vm *vm, vaddr_t vaddr)
 {
 	struct pmap *pm;
-	pt_entry_t *pte, flags;
-	int error;
+	pt_entry_t *pte;
 
 	pm = vm->vm_pmap;
 
-	if (vaddr >= pm->pm_end || vaddr < pm->pm_base)
+	if (vm == &kernel_vm)
 		return (ERROR_NOT_PERMITTED);
 
-	error = pmap_alloc_pte(pm, vaddr, &pte);
-	if (error != 0) {
-		pmap_collect(pm);
-		return (error);
+	pte = pmap_find(pm, vaddr);
+	if (pte == NULL || !pte_test(pte, PG_V))
+		return (ERROR_NOT_FOUND);
+	if (pte_test(pte, PG_COW))
+		return (0);
+	if (pte_test(pte, PG_RO))
+		return (ERROR_NOT_PERMITTED);
+	pte_set(pte, PG_RO | PG_COW);
+	if (pte_test(pte, PG_D)) {
+		/*
+		 * Drop any writable TLB entry so the next write traps.
+		 */
+		pte_clear(pte, PG_D);
+		tlb_invalidate(pm, vaddr);
 	}
-	flags = PG_V;
-	if (vm == &kernel_vm)
-		flags |= PG_G;
-	flags |= PG_C_CNC;
-	pmap_update(pm, vaddr, page, flags);
 	return (0);
 }
 
 int
 pmap_unmap(struct vm *vm, vaddr_t vaddr)
 {
+	struct pmap_pv *pv;
 	struct pmap *pm;
 	pt_entry_t *pte;
 
@@ -240,11 +377,39 @@ pmap_unmap(struct vm *vm, vaddr_t vaddr)
 	pte = pmap_find(pm, vaddr);
 	if (pte == NULL)
 		return (ERROR_NOT_FOUND);
-	if (!pte_test(pte, PG_V))
+	PMAP_PV_LOCK();
+	if (!pte_test(pte, PG_V)) {
+		PMAP_PV_UNLOCK();
 		return (0);
+	}
+	pv = pmap_pv_remove(pm, vaddr, TLBLO_PTE_TO_PA(*pte));
 	/* Invalidate by updating to not have PG_V set.  */
 	tlb_invalidate(pm, vaddr);
 	atomic_store64(pte, 0);
+	PMAP_PV_UNLOCK();
+
+	pool_free(pv);
+	return (0);
+}
+
+int
+pmap_unprotect_cow(struct vm *vm, vaddr_t vaddr)
+{
+	struct pmap *pm;
+	pt_entry_t *pte;
+
+	pm = vm->vm_pmap;
+
+	pte = pmap_find(pm, vaddr);
+	if (pte == NULL || !pte_test(pte, PG_V))
+		return (ERROR_NOT_FOUND);
+	if (!pte_test(pte, PG_COW))
+		return (ERROR_INVALID);
+	/*
+	 * The page is still clean; the next write will be let through by
+	 * tlb_modify like for any other page.
+	 */
+	pte_clear(pte, PG_RO | PG_COW);
 	return (0);
 }
 
@@ -354,6 +519,45 @@ pmap_collect(struct pmap *pm)
 	panic("%s: can't garbage collect yet.", __func__);
 }
 
+static int
+pmap_enter(struct vm *vm, vaddr_t vaddr, struct vm_page *page, pt_entry_t swflags)
+{
+	struct pmap_pv *pv;
+	struct pmap *pm;
+	pt_entry_t *pte, flags;
+	int error;
+
+	pm = vm->vm_pmap;
+
+	if (vaddr >= pm->pm_end || vaddr < pm->pm_base)
+		return (ERROR_NOT_PERMITTED);
+
+	pv = pool_allocate(&pmap_pv_pool);
+	if (pv == NULL)
+		return (ERROR_EXHAUSTED);
+
+	error = pmap_alloc_pte(pm, vaddr, &pte);
+	if (error != 0) {
+		pool_free(pv);
+		pmap_collect(pm);
+		return (error);
+	}
+	flags = PG_V;
+	if (vm == &kernel_vm)
+		flags |= PG_G;
+	flags |= PG_C_CNC;
+	flags |= swflags;
+
+	PMAP_PV_LOCK();
+	pv = pmap_update(pm, vaddr, page, flags, pv);
+	PMAP_PV_UNLOCK();
+
+	/* Free the entry for any mapping which was replaced.  */
+	if (pv != NULL)
+		pool_free(pv);
+	return (0);
+}
+
 static struct pmap_lev0 *
 pmap_find0(struct pmap *pm, vaddr_t vaddr)
 {
@@ -406,12 +610,47 @@ pmap_pinit(struct pmap *pm, vaddr_t base, vaddr_t end)
 		pm->pm_level0[l0] = NULL;
 }
 
-static void
-pmap_update(struct pmap *pm, vaddr_t vaddr, struct vm_page *page, pt_entry_t flags)
+/*
+ * Find and remove the pv entry for a mapping of paddr.
+ */
+static struct pmap_pv *
+pmap_pv_remove(struct pmap *pm, vaddr_t vaddr, paddr_t paddr)
+{
+	struct vm_page *page;
+	struct pmap_pv *pv;
+	int error;
+
+	SPINLOCK_ASSERT_HELD(&pmap_pv_lock);
+
+	error = page_lookup(paddr, &page);
+	if (error != 0)
+		panic("%s: page_lookup failed: %m", __func__, error);
+
+	SLIST_FOREACH(pv, &page->pg_mappings, pv_link) {
+		if (pv->pv_pmap == pm && pv->pv_vaddr == vaddr)
+			break;
+	}
+	if (pv == NULL)
+		panic("%s: mapping of %p has no pv entry.", __func__,
+		      (void *)vaddr);
+	SLIST_REMOVE(&page->pg_mappings, pv, struct pmap_pv, pv_link);
+
+	return (pv);
+}
+
+/*
+ * Enter the mapping, recording it with the supplied pv entry.  If it replaces
+ * an existing mapping, the entry for that is returned to be freed.
+ */
+static struct pmap_pv *
+pmap_update(struct pmap *pm, vaddr_t vaddr, struct vm_page *page, pt_entry_t flags, struct pmap_pv *pv)
 {
+	struct pmap_pv *opv;
 	pt_entry_t *pte;
 	paddr_t opaddr, paddr;
 
+	SPINLOCK_ASSERT_HELD(&pmap_pv_lock);
+
 	paddr = page_address(page);
 	vaddr &= ~PAGE_MASK;
 
@@ -419,16 +658,24 @@ pmap_update(struct pmap *pm, vaddr_t vaddr, struct vm_page *page, pt_entry_t fla
 	if (pte == NULL)
 		panic("%s: update of PTE that isn't there.", __func__);
 
+	opv = NULL;
 	opaddr = TLBLO_PTE_TO_PA(*pte);
 	if (pte_test(pte, PG_V)) {
 		if (opaddr == paddr) {
 			/* Mapping stayed the same, just check flags.  */
 			panic("%s: mapping stayed the same.", __func__);
-			return;
+			return (pv);
 		}
+		opv = pmap_pv_remove(pm, vaddr, opaddr);
 		tlb_invalidate(pm, vaddr);
 	}
 	atomic_store64(pte, TLBLO_PA_TO_PFN(paddr) | flags);
+
+	pv->pv_pmap = pm;
+	pv->pv_vaddr = vaddr;
+	SLIST_INSERT_HEAD(&page->pg_mappings, pv, pv_link);
+
+	return (opv);
 }
 
 static void
@@ -16,6 +16,7 @@
 #endif
 #include <core/console.h>
 #include <vm/vm.h>
+#include <vm/vm_fault.h>
 #include <vm/vm_page.h>
 
 /*
@@ -127,6 +128,7 @@ tlb_modify(vaddr_t vaddr)
 {
 	pt_entry_t *pte;
 	struct vm *vm;
+	int error;
 
 	if (PAGE_FLOOR(vaddr) == 0)
 		panic("%s: accessing NULL.", __func__);
@@ -134,9 +136,38 @@ tlb_modify(vaddr_t vaddr)
 		vm = &kernel_vm;
 	else
 		vm = current_task()->t_vm;
-	pte = pmap_find(vm->vm_pmap, vaddr); /* XXX lock.  */
+	pte = pmap_find(vm->vm_pmap, vaddr); /* Page tables are never freed.  */
 	if (pte == NULL)
 		panic("%s: pmap_find returned NULL.", __func__);
+	if (pte_test(pte, PG_COW)) {
+		/*
+		 * The fault code leaves a clean, writable mapping in place,
+		 * either of a copy or of the original page, which we can then
+		 * mark dirty as usual.
+		 */
+		error = vm_fault_cow(vm, vaddr);
+		if (error != 0) {
+			if (vm == &kernel_vm)
+				panic("%s: vm_fault_cow failed: %m", __func__, error);
+			/*
+			 * Most likely there was no memory for the copy, which
+			 * is the task's problem rather than the kernel's.
+			 */
+			printf("%s: vm_fault_cow failed: %m\n", __func__, error);
+			printf("Userland copy-on-write fault.  Thread exiting.\n");
+			thread_exit();
+		}
+
+		/*
+		 * Another thread may have broken the share and written to the
+		 * page while we waited, in which case there is nothing left
+		 * to do but load the mapping.
+		 */
+		if (pte_test(pte, PG_D)) {
+			tlb_update(vm->vm_pmap, vaddr, *pte);
+			return;
+		}
+	}
 	if (pte_test(pte, PG_RO))
 		panic("%s: write to read-only page.", __func__);
 	if (pte_test(pte, PG_D))
@@ -175,7 +206,7 @@ tlb_wired_wire(struct tlb_wired_context *wired, struct pmap *pm, vaddr_t vaddr)
 	if (twe == NULL)
 		panic("%s: no free wired slots.", __func__);
 
-	pte = pmap_find(pm, vaddr); /* XXX lock.  */
+	pte = pmap_find(pm, vaddr); /* Page tables are never freed.  */
 	if (pte == NULL)
 		panic("%s: pmap_find returned NULL.", __func__);
 	pte_set(pte, PG_D);	/* XXX Mark page dirty.  */
@@ -59,8 +59,15 @@ void pmap_activate(struct vm *);
 void pmap_bootstrap(void);
 int pmap_extract(struct vm *, vaddr_t, paddr_t *) __non_null(1, 3);
 int pmap_init(struct vm *, vaddr_t, vaddr_t) __non_null(1);
+bool pmap_is_cow(struct vm *, vaddr_t) __non_null(1);
 int pmap_map(struct vm *, vaddr_t, struct vm_page *) __non_null(1, 3);
+int pmap_map_cow(struct vm *, vaddr_t, struct vm_page *) __non_null(1, 3);
+unsigned pmap_page_mappings(struct vm_page *) __non_null(1);
+void pmap_page_protect_cow(struct vm_page *) __non_null(1);
+unsigned pmap_page_remove(struct vm_page *) __non_null(1);
+int pmap_protect_cow(struct vm *, vaddr_t) __non_null(1);
 int pmap_unmap(struct vm *, vaddr_t) __non_null(1);
+int pmap_unprotect_cow(struct vm *, vaddr_t) __non_null(1);
 void pmap_zero(struct vm_page *) __non_null(1);
 
 #endif /* !_CPU_PMAP_H_ */
@@ -152,8 +152,13 @@ struct pmap {
  * VM flags managed in software:
  * 	RO:	Read only.  Never set PG_D on this page, and don't
  * 		listen to requests to write to it.
+ * 	COW:	Copy-on-write.  Always set with PG_RO.  A write to
+ * 		this page is passed to the VM fault code, which will
+ * 		either copy the page or, if this is the last mapping,
+ * 		make it writable again.
  */
-#define	PG_RO	(0x01 << TLBLO_SWBITS_SHIFT)
+#define	PG_RO	(0x01UL << TLBLO_SWBITS_SHIFT)
+#define	PG_COW	(0x02UL << TLBLO_SWBITS_SHIFT)
 
 /*
  * PTE management functions for bits defined above.
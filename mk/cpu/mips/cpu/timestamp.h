@@ -0,0 +1,16 @@
+#ifndef	_CPU_TIMESTAMP_H_
+#define	_CPU_TIMESTAMP_H_
+
+#include <cpu/cpu.h>
+
+/*
+ * A free-running cycle count for measuring short intervals.  Only the low 32
+ * bits are meaningful; take differences with unsigned arithmetic.
+ */
+static inline unsigned
+cpu_timestamp(void)
+{
+	return ((unsigned)cpu_read_count());
+}
+
+#endif /* !_CPU_TIMESTAMP_H_ */
@@ -30,6 +30,10 @@ typedef	unsigned long		uintmax_t;
 typedef	uint64_t	paddr_t;
 typedef	uint64_t	vaddr_t;
 
+	/* Large enough for any cache line we run on (Octeon's are 128 bytes.)  */
+
+#define	CACHE_LINE_SIZE	(128)
+
 #include <platform/types.h>
 #endif
 
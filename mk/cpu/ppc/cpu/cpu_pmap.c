@@ -66,18 +66,59 @@ pmap_init(struct vm *vm, vaddr_t base, vaddr_t end)
 	return (0);
 }
 
+bool
+pmap_is_cow(struct vm *vm, vaddr_t vaddr)
+{
+	return (false);
+}
+
 int
 pmap_map(struct vm *vm, vaddr_t vaddr, struct vm_page *page)
 {
 	return (ERROR_NOT_IMPLEMENTED);
 }
 
+int
+pmap_map_cow(struct vm *vm, vaddr_t vaddr, struct vm_page *page)
+{
+	return (ERROR_NOT_IMPLEMENTED);
+}
+
+unsigned
+pmap_page_mappings(struct vm_page *page)
+{
+	return (0);
+}
+
+void
+pmap_page_protect_cow(struct vm_page *page)
+{
+}
+
+unsigned
+pmap_page_remove(struct vm_page *page)
+{
+	return (0);
+}
+
+int
+pmap_protect_cow(struct vm *vm, vaddr_t vaddr)
+{
+	return (ERROR_NOT_IMPLEMENTED);
+}
+
 int
 pmap_unmap(struct vm *vm, vaddr_t vaddr)
 {
 	return (ERROR_NOT_IMPLEMENTED);
 }
 
+int
+pmap_unprotect_cow(struct vm *vm, vaddr_t vaddr)
+{
+	return (ERROR_NOT_IMPLEMENTED);
+}
+
 void
 pmap_zero(struct vm_page *page)
 {
@@ -0,0 +1,17 @@
+#ifndef	_CPU_TIMESTAMP_H_
+#define	_CPU_TIMESTAMP_H_
+
+/*
+ * A free-running count for measuring short intervals: the low word of the
+ * time base.  Take differences with unsigned arithmetic.
+ */
+static inline unsigned
+cpu_timestamp(void)
+{
+	unsigned tb;
+
+	asm volatile ("mftb %[tb]" : [tb] "=r"(tb));
+	return (tb);
+}
+
+#endif /* !_CPU_TIMESTAMP_H_ */
@@ -27,6 +27,10 @@ typedef	unsigned long long	uintmax_t;
 typedef	uint32_t	paddr_t;
 typedef	uint32_t	vaddr_t;
 
+	/* Cache line size.  */
+
+#define	CACHE_LINE_SIZE	(32)
+
 #include <platform/types.h>
 
 #endif /* !_CPU_TYPES_H_ */
@@ -39,8 +39,12 @@ fs_register(const char *name, struct fs_ops *fso, fs_context_t fsc)
 	fs->fs_ops = fso;
 	fs->fs_context = fsc;
 
+	/*
+	 * Opens of files and directories all come through here, so give the
+	 * service a thread on every CPU.
+	 */
 	error = ipc_service(name, IPC_PORT_UNKNOWN, IPC_PORT_FLAG_PUBLIC | IPC_PORT_FLAG_NEW,
-			    fs_ipc_handler, fs);
+			    IPC_SERVICE_THREADS_PERCPU, fs_ipc_handler, fs);
 	if (error != 0) {
 		free(fs);
 		return (error);
@@ -55,19 +59,9 @@ fs_register(const char *name, struct fs_ops *fso, fs_context_t fsc)
 static int
 fs_exec(struct fs *fs, const char *path)
 {
-	fs_file_context_t fsfc;
-	int error, error2;
-
-	error = fs->fs_ops->fs_file_open(fs->fs_context, path, &fsfc);
-	if (error != 0)
-		return (error);
-
-	error = exec_task(IPC_PORT_UNKNOWN, NULL, path, fs->fs_ops->fs_file_read, fs->fs_context, fsfc);
-
-	error2 = fs->fs_ops->fs_file_close(fs->fs_context, fsfc);
-	if (error2 != 0)
-		panic("%s: file close failed: %m", __func__, error2);
+	int error;
 
+	error = exec_task(IPC_PORT_UNKNOWN, NULL, fs, path);
 	if (error != 0)
 		return (error);
 
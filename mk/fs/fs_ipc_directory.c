@@ -151,7 +151,8 @@ fs_directory_ipc_read_handler(struct fs_directory *fsd, const struct ipc_header
 		resp->next = offset;
 
 		error = ipc_port_send(&ipch, *pagep);
-		*pagep = NULL;
+		if (error == 0)
+			*pagep = NULL;
 	}
 
 	if (error != 0)
@@ -172,30 +173,28 @@ fs_directory_ipc_close_handler(struct fs_directory *fsd, const struct ipc_header
 
 	/*
 	 * XXX
-	 * Need to reference-count the service and only do this close once all
-	 * users are done, and drop the receive right, and have dropping the
-	 * receive right lead to garbage-collecting the port.
-	 *
-	 * At that point, do we even need a close(), or can the caller just drop
-	 * the right to this port?  But then they need to refcount rights and be
-	 * sure they only have this directory open once.
+	 * Other holders of send rights to this port may still be using it;
+	 * they will find it gone.  Closing when the last send right is dropped
+	 * would be better.
 	 */
 
 	error = fs->fs_ops->fs_directory_close(fs->fs_context, fsdc);
-	if (error != 0) {
+	if (error != 0)
 		ipch = IPC_HEADER_ERROR(reqh, error);
-	} else {
+	else
 		ipch = IPC_HEADER_REPLY(reqh);
-	}
-
 	error = ipc_port_send_data(&ipch, NULL, 0);
 	if (error != 0)
-		return (error);
+		printf("%s: ipc_port_send failed: %m\n", __func__, error);
 
 	/*
-	 * XXX
-	 * Check outstanding send rights and then ipc_port_right_drop.
+	 * Dropping the receive right destroys the port, and the service
+	 * exits when it next looks for a message.  Even if the close failed
+	 * there is nothing more the service can do with the directory.
 	 */
+	if (ipc_port_right_drop(reqh->ipchdr_dst, IPC_PORT_RIGHT_RECEIVE) != 0)
+		panic("%s: ipc_port_right_drop failed.", __func__);
+	free(fsd);
 
 	return (0);
 }
@@ -216,7 +215,7 @@ fs_directory_ipc_service_start(struct fs_directory *fsd, ipc_port_t *portp)
 		return (error);
 
 	error = ipc_service(fsd->fsd_path, port, IPC_PORT_FLAG_DEFAULT,
-			    fs_directory_ipc_handler, fsd);
+			    1, fs_directory_ipc_handler, fsd);
 	if (error != 0) {
 		if (ipc_port_right_drop(port, IPC_PORT_RIGHT_RECEIVE) != 0)
 			panic("%s: ipc_port_right_drop failed.", __func__);
@@ -19,9 +19,10 @@
 #include <fs/fs_ops.h>
 #include <vm/vm.h>
 #include <vm/vm_alloc.h>
+#include <vm/vm_page.h>
 
 struct fs_file {
-	char fsf_path[64];
+	char fsf_path[FS_NAME_MAX];
 	struct fs *fsf_fs;
 	fs_file_context_t fsf_context;
 };
@@ -47,7 +48,14 @@ fs_ipc_open_file_handler(struct fs *fs, const struct ipc_header *reqh, void **pa
 		return (ERROR_INVALID);
 	req = *pagep;
 
-	error = fs->fs_ops->fs_file_open(fs->fs_context, req->path, &fsfc);
+	/*
+	 * We keep the path around to be able to reopen the file for exec, so
+	 * don't allow it to be truncated.
+	 */
+	if (memchr(req->path, '\0', sizeof fsf->fsf_path) == NULL)
+		error = ERROR_INVALID;
+	else
+		error = fs->fs_ops->fs_file_open(fs->fs_context, req->path, &fsfc);
 	if (error != 0) {
 		ipch = IPC_HEADER_ERROR(reqh, error);
 
@@ -68,11 +76,9 @@ fs_ipc_open_file_handler(struct fs *fs, const struct ipc_header *reqh, void **pa
 	 * XXX
 	 * [... Previous comments resolved ...]
 	 *
-	 * Add to that that we want this service to be refcounted and to go away
-	 * when all its send rights disappear, and this exposes quite a lot of
-	 * work that still needs to be done.
-	 *
-	 * NB: All ports will have to be refcounted in that way.
+	 * Add to that that we want this service to go away when all its send
+	 * rights disappear, rather than only on close, and this exposes quite
+	 * a lot of work that still needs to be done.
 	 */
 
 	error = fs_file_ipc_service_start(fsf, &port);
@@ -134,9 +140,12 @@ fs_file_ipc_read_handler(struct fs_file *fsf, const struct ipc_header *reqh, voi
 	fs_file_context_t fsfc = fsf->fsf_context;
 	struct fs *fs = fsf->fsf_fs;
 	struct fs_file_read_request *req;
+	struct vm_page *pages[IPC_DATA_PAGES_MAX];
 	struct ipc_header ipch;
-	size_t length;
-	int error;
+	size_t chunk, length, want;
+	unsigned i, npages;
+	vaddr_t vaddr;
+	int error, error2;
 
 	if (pagep == NULL)
 		return (ERROR_INVALID);
@@ -146,11 +155,53 @@ fs_file_ipc_read_handler(struct fs_file *fsf, const struct ipc_header *reqh, voi
 		return (ERROR_INVALID);
 
 	/*
-	 * Note that we reuse p as a buffer.
+	 * Read into fresh pages a page at a time, stopping early at the end of
+	 * the file, and send them all back in one message.
 	 */
-	length = req->length > PAGE_SIZE ? PAGE_SIZE : req->length;
-	error = fs->fs_ops->fs_file_read(fs->fs_context, fsfc, *pagep, req->offset, &length);
+	want = req->length;
+	if (want > IPC_DATA_PAGES_MAX * PAGE_SIZE)
+		want = IPC_DATA_PAGES_MAX * PAGE_SIZE;
+	length = 0;
+	npages = 0;
+	error = 0;
+	while (length < want) {
+		error = page_alloc(PAGE_FLAG_DEFAULT, &pages[npages]);
+		if (error != 0)
+			break;
+
+		error = page_map_direct(&kernel_vm, pages[npages], &vaddr);
+		if (error != 0) {
+			page_release(pages[npages]);
+			break;
+		}
+
+		chunk = want - length;
+		if (chunk > PAGE_SIZE)
+			chunk = PAGE_SIZE;
+		error = fs->fs_ops->fs_file_read(fs->fs_context, fsfc, (void *)vaddr,
+						 req->offset + length, &chunk);
+		if (error == 0 && chunk != PAGE_SIZE)
+			memset((void *)(vaddr + chunk), 0, PAGE_SIZE - chunk);
+
+		error2 = page_unmap_direct(&kernel_vm, pages[npages], vaddr);
+		if (error2 != 0)
+			panic("%s: page_unmap_direct failed: %m", __func__, error2);
+
+		if (error != 0 || chunk == 0) {
+			page_release(pages[npages]);
+			break;
+		}
+		npages++;
+		length += chunk;
+
+		if (chunk != PAGE_SIZE)
+			break;
+	}
+
 	if (error != 0) {
+		for (i = 0; i < npages; i++)
+			page_release(pages[i]);
+
 		ipch = IPC_HEADER_ERROR(reqh, error);
 
 		error = ipc_port_send_data(&ipch, NULL, 0);
@@ -161,9 +212,11 @@ fs_file_ipc_read_handler(struct fs_file *fsf, const struct ipc_header *reqh, voi
 		if (length == 0) {
 			error = ipc_port_send_data(&ipch, NULL, 0);
 		} else {
-			error = ipc_port_send(&ipch, *pagep);
-			/* XXX Does ipc_port_send always consume the page [on error]?  */
-			*pagep = NULL;
+			error = ipc_port_send_pages(&ipch, pages, npages);
+			if (error != 0) {
+				for (i = 0; i < npages; i++)
+					page_release(pages[i]);
+			}
 		}
 	}
 
@@ -185,30 +238,28 @@ fs_file_ipc_close_handler(struct fs_file *fsf, const struct ipc_header *reqh, vo
 
 	/*
 	 * XXX
-	 * Need to reference-count the service and only do this close once all
-	 * users are done, and drop the receive right, and have dropping the
-	 * receive right lead to garbage-collecting the port.
-	 *
-	 * At that point, do we even need a close(), or can the caller just drop
-	 * the right to this port?  But then they need to refcount rights and be
-	 * sure they only have this file open once.
+	 * Other holders of send rights to this port may still be using it;
+	 * they will find it gone.  Closing when the last send right is dropped
+	 * would be better.
 	 */
 
 	error = fs->fs_ops->fs_file_close(fs->fs_context, fsfc);
-	if (error != 0) {
+	if (error != 0)
 		ipch = IPC_HEADER_ERROR(reqh, error);
-	} else {
+	else
 		ipch = IPC_HEADER_REPLY(reqh);
-	}
-
 	error = ipc_port_send_data(&ipch, NULL, 0);
 	if (error != 0)
-		return (error);
+		printf("%s: ipc_port_send failed: %m\n", __func__, error);
 
 	/*
-	 * XXX
-	 * Check outstanding send rights and then ipc_port_right_drop.
+	 * Dropping the receive right destroys the port, and the service
+	 * exits when it next looks for a message.  Even if the close failed
+	 * there is nothing more the service can do with the file.
 	 */
+	if (ipc_port_right_drop(reqh->ipchdr_dst, IPC_PORT_RIGHT_RECEIVE) != 0)
+		panic("%s: ipc_port_right_drop failed.", __func__);
+	free(fsf);
 
 	return (0);
 }
@@ -217,7 +268,6 @@ fs_file_ipc_close_handler(struct fs_file *fsf, const struct ipc_header *reqh, vo
 static int
 fs_file_ipc_exec_handler(struct fs_file *fsf, const struct ipc_header *reqh, void **pagep)
 {
-	fs_file_context_t fsfc = fsf->fsf_context;
 	struct fs *fs = fsf->fsf_fs;
 	struct ipc_header ipch;
 	ipc_port_t child;
@@ -226,7 +276,11 @@ fs_file_ipc_exec_handler(struct fs_file *fsf, const struct ipc_header *reqh, voi
 	if (pagep != NULL)
 		return (ERROR_INVALID);
 
-	error = exec_task(reqh->ipchdr_src, &child, fsf->fsf_path, fs->fs_ops->fs_file_read, fs->fs_context, fsfc);
+	/*
+	 * The new task's VM object opens the file for itself, so that it is
+	 * unaffected by this file later being closed.
+	 */
+	error = exec_task(reqh->ipchdr_src, &child, fs, fsf->fsf_path);
 	if (error != 0) {
 		ipch = IPC_HEADER_ERROR(reqh, error);
 	} else {
@@ -257,7 +311,7 @@ fs_file_ipc_service_start(struct fs_file *fsf, ipc_port_t *portp)
 		return (error);
 
 	error = ipc_service(fsf->fsf_path, port, IPC_PORT_FLAG_DEFAULT,
-			    fs_file_ipc_handler, fsf);
+			    1, fs_file_ipc_handler, fsf);
 	if (error != 0) {
 		if (ipc_port_right_drop(port, IPC_PORT_RIGHT_RECEIVE) != 0)
 			panic("%s: ipc_port_right_drop failed.", __func__);
@@ -21,6 +21,7 @@ struct fs {
 typedef	int fs_file_open_op_t(fs_context_t, const char *, fs_file_context_t *) __non_null(2, 3);
 typedef	int fs_file_read_op_t(fs_context_t, fs_file_context_t, void *, off_t, size_t *) __non_null(3, 5);
 typedef	int fs_file_close_op_t(fs_context_t, fs_file_context_t);
+typedef	int fs_file_id_op_t(fs_context_t, fs_file_context_t, uint64_t *) __non_null(3);
 
 typedef	int fs_directory_open_op_t(fs_context_t, const char *, fs_directory_context_t *) __non_null(2, 3);
 typedef	int fs_directory_read_op_t(fs_context_t, fs_directory_context_t, struct fs_directory_entry *, off_t *, size_t *) __non_null(3, 5);
@@ -30,6 +31,12 @@ struct fs_ops {
 	fs_file_open_op_t *fs_file_open;
 	fs_file_read_op_t *fs_file_read;
 	fs_file_close_op_t *fs_file_close;
+	/*
+	 * Optional.  Gives a number which is unique to the underlying file
+	 * within this filesystem, like an inode number, so that the VM can
+	 * share pages between everyone using the same file.
+	 */
+	fs_file_id_op_t *fs_file_id;
 
 	fs_directory_open_op_t *fs_directory_open;
 	fs_directory_read_op_t *fs_directory_read;
@@ -37,7 +37,7 @@ network_interface_attach(struct network_interface *netif,
 
 	/* XXX This is gross.  */
 	error = ipc_service(netif->ni_name, IPC_PORT_UNKNOWN, IPC_PORT_FLAG_PUBLIC | IPC_PORT_FLAG_NEW,
-			    network_interface_ipc_handler, netif);
+			    1, network_interface_ipc_handler, netif);
 	if (error != 0)
 		return (error);
 
@@ -1,6 +1,7 @@
 #include <core/types.h>
 #include <core/endian.h>
 #include <core/error.h>
+#include <core/mutex.h>
 #include <core/string.h>
 #include <io/storage/device.h>
 #include <io/storage/tarfs/tarfs_mount.h>
@@ -74,7 +75,13 @@ struct tarfs_file_context {
 	uint8_t f_scratch[PAGE_SIZE]; /* XXX */
 };
 
+/*
+ * The header, block and name buffers in the mount are shared by every
+ * operation, which may be called from several service threads at once, so
+ * the lock is held by each operation which uses them.
+ */
 struct tarfs_mount {
+	struct mutex tm_lock;
 	unsigned tm_flags;
 
 	struct storage_device *tm_sdev;
@@ -98,11 +105,13 @@ struct tarfs_mount {
 static fs_file_open_op_t tarfs_op_file_open;
 static fs_file_read_op_t tarfs_op_file_read;
 static fs_file_close_op_t tarfs_op_file_close;
+static fs_file_id_op_t tarfs_op_file_id;
 
 static fs_directory_open_op_t tarfs_op_directory_open;
 static fs_directory_read_op_t tarfs_op_directory_read;
 static fs_directory_close_op_t tarfs_op_directory_close;
 
+static int tarfs_file_open(struct tarfs_mount *, const char *, fs_file_context_t *);
 static int tarfs_lookup(struct tarfs_mount *, const char *, struct tarfs_file_context *);
 static bool tarfs_lookup_match(struct tarfs_mount *, const struct tarfs_file_context *, const uint8_t *, size_t, bool);
 static int tarfs_read_header(struct tarfs_mount *, uint64_t, bool *);
@@ -112,6 +121,7 @@ static struct fs_ops tarfs_fs_ops = {
 	.fs_file_open = tarfs_op_file_open,
 	.fs_file_read = tarfs_op_file_read,
 	.fs_file_close = tarfs_op_file_close,
+	.fs_file_id = tarfs_op_file_id,
 
 	.fs_directory_open = tarfs_op_directory_open,
 	.fs_directory_read = tarfs_op_directory_read,
@@ -130,6 +140,7 @@ tarfs_mount(struct storage_device *sdev)
 		return (error);
 
 	tm = (struct tarfs_mount *)tmaddr;
+	mutex_init(&tm->tm_lock, "tarfs Mount", MUTEX_FLAG_DEFAULT);
 	tm->tm_flags = TARFS_MOUNT_DEFAULT;
 	tm->tm_sdev = sdev;
 	tm->tm_linklen = 0;
@@ -152,78 +163,14 @@ tarfs_mount(struct storage_device *sdev)
 static int
 tarfs_op_file_open(fs_context_t fsc, const char *name, fs_file_context_t *fsfcp)
 {
-	struct tarfs_file_context *fc;
 	struct tarfs_mount *tm = fsc;
-	vaddr_t vaddr;
-	size_t linkleft, linkuse;
-	char *linkname;
-	int error, error2;
-
-	error = vm_alloc(&kernel_vm, sizeof *fc, &vaddr, VM_ALLOC_DEFAULT);
-	if (error != 0)
-		return (error);
-	fc = (struct tarfs_file_context *)vaddr;
-
-	error = tarfs_lookup(tm, name, fc);
-	if (error != 0) {
-		error2 = vm_free(&kernel_vm, sizeof *fc, vaddr);
-		if (error2 != 0)
-			panic("%s: vm_free failed: %m", __func__, error2);
-
-		return (error);
-	}
-
-	/*
-	 * Check file type.
-	 */
-	switch (fc->f_header.th_typeflag) {
-	case '0': /* Regular file.  */
-		break;
-	case '1': /* Link.  */
-		if (memchr(fc->f_header.th_linkname, '\0', sizeof fc->f_header.th_linkname) == NULL) {
-			error = vm_free(&kernel_vm, sizeof *fc, vaddr);
-			if (error != 0)
-				panic("%s: vm_free failed: %m", __func__, error);
-			return (ERROR_INVALID);
-		}
-
-		ASSERT(tm->tm_linklen <= sizeof tm->tm_linkbuf, "Must be in buffer bounds.");
-		linkleft = sizeof tm->tm_linkbuf - tm->tm_linklen;
-		linkname = tm->tm_linkbuf + tm->tm_linklen;
-		linkuse = strlcpy(linkname, (const char *)(const void *)fc->f_header.th_linkname, linkleft);
-		if (linkuse >= linkleft) {
-			error = vm_free(&kernel_vm, sizeof *fc, vaddr);
-			if (error != 0)
-				panic("%s: vm_free failed: %m", __func__, error);
-			return (ERROR_INVALID);
-		}
-
-		error = vm_free(&kernel_vm, sizeof *fc, vaddr);
-		if (error != 0)
-			panic("%s: vm_free failed: %m", __func__, error);
-
-		/* Skip over the . in ./ if present.  */
-		if (strncmp(linkname, "./", 2) == 0)
-			linkname++;
-
-		/*
-		 * Perform an open of the linked-to file.
-		 */
-		tm->tm_linklen += linkuse;
-		error = tarfs_op_file_open(fsc, linkname, fsfcp);
-		tm->tm_linklen -= linkuse;
-		return (error);
-	default:
-		error = vm_free(&kernel_vm, sizeof *fc, vaddr);
-		if (error != 0)
-			panic("%s: vm_free failed: %m", __func__, error);
-
-		return (ERROR_WRONG_KIND);
-	}
+	int error;
 
-	*fsfcp = fc;
+	mutex_lock(&tm->tm_lock);
+	error = tarfs_file_open(tm, name, fsfcp);
+	mutex_unlock(&tm->tm_lock);
 
-	return (0);
+	return (error);
 }
 
 static int
@@ -244,13 +191,17 @@ tarfs_op_file_read(fs_context_t fsc, fs_file_context_t fsfc, void *buf, off_t of
 		return (0);
 	}
 
+	mutex_lock(&tm->tm_lock);
 	error = storage_device_read(tm->tm_sdev, tm->tm_block,
 				    sizeof tm->tm_block, fc->f_daddr + address);
-	if (error != 0)
+	if (error != 0) {
+		mutex_unlock(&tm->tm_lock);
 		return (error);
+	}
 
 	len = MIN(MIN(*lenp, TARFS_BSIZE - offset), fc->f_dsize - off);
 	memcpy(buf, &tm->tm_block[offset], len);
+	mutex_unlock(&tm->tm_lock);
 	*lenp = len;
 
 	return (0);
@@ -271,6 +222,22 @@ tarfs_op_file_close(fs_context_t fsc, fs_file_context_t fsfc)
 	return (0);
 }
 
+/*
+ * Links have been resolved by the time the file is open, so the address of the
+ * file's data identifies it.
+ */
+static int
+tarfs_op_file_id(fs_context_t fsc, fs_file_context_t fsfc, uint64_t *idp)
+{
+	struct tarfs_file_context *fc = fsfc;
+
+	(void)fsc;
+
+	*idp = fc->f_daddr;
+
+	return (0);
+}
+
 static int
 tarfs_op_directory_open(fs_context_t fsc, const char *name, fs_directory_context_t *fsdcp)
 {
@@ -284,7 +251,9 @@ tarfs_op_directory_open(fs_context_t fsc, const char *name, fs_directory_context
 		return (error);
 	dc = (struct tarfs_file_context *)vaddr;
 
+	mutex_lock(&tm->tm_lock);
 	error = tarfs_lookup(tm, name, dc);
+	mutex_unlock(&tm->tm_lock);
 	if (error != 0) {
 		error2 = vm_free(&kernel_vm, sizeof *dc, vaddr);
 		if (error2 != 0)
@@ -320,20 +289,26 @@ tarfs_op_directory_read(fs_context_t fsc, fs_directory_context_t fsdc, struct fs
 
 	skip = *offp;
 
+	mutex_lock(&tm->tm_lock);
 	offset = dc->f_daddr + ROUNDUP(dc->f_dsize, TARFS_BSIZE);
 	for (;;) {
 		error = tarfs_read_header(tm, offset, &eof);
-		if (error != 0)
+		if (error != 0) {
+			mutex_unlock(&tm->tm_lock);
 			return (error);
+		}
 
 		if (eof) {
+			mutex_unlock(&tm->tm_lock);
 			*offp = 0;
 			*cntp = 0;
 			return (0);
 		}
 
-		if (!tar_header_decode(tm->tm_header.th_size, sizeof tm->tm_header.th_size, &dsize))
+		if (!tar_header_decode(tm->tm_header.th_size, sizeof tm->tm_header.th_size, &dsize)) {
+			mutex_unlock(&tm->tm_lock);
 			return (ERROR_INVALID);
+		}
 
 		if (tarfs_lookup_match(tm, dc, tm->tm_header.th_name, sizeof tm->tm_header.th_name, true)) {
 			if (skip == 0)
@@ -343,9 +318,12 @@ tarfs_op_directory_read(fs_context_t fsc, fs_directory_context_t fsdc, struct fs
 		offset += TARFS_BSIZE + ROUNDUP(dsize, TARFS_BSIZE); /* Skip header block and data size.  */
 	}
 
-	if (tm->tm_match.tp_namecnt == 0)
+	if (tm->tm_match.tp_namecnt == 0) {
+		mutex_unlock(&tm->tm_lock);
 		return (ERROR_INVALID);
+	}
 	strlcpy(de->name, tm->tm_match.tp_names[tm->tm_match.tp_namecnt - 1], sizeof de->name); /* Yield last component of name.  */
+	mutex_unlock(&tm->tm_lock);
 	*offp = *offp + 1;
 	*cntp = 1;
 	return (0);
@@ -366,6 +344,85 @@ tarfs_op_directory_close(fs_context_t fsc, fs_directory_context_t fsdc)
 	return (0);
 }
 
+/*
+ * Called with the mount locked, which is held across any links followed.
+ */
+static int
+tarfs_file_open(struct tarfs_mount *tm, const char *name, fs_file_context_t *fsfcp)
+{
+	struct tarfs_file_context *fc;
+	vaddr_t vaddr;
+	size_t linkleft, linkuse;
+	char *linkname;
+	int error, error2;
+
+	error = vm_alloc(&kernel_vm, sizeof *fc, &vaddr, VM_ALLOC_DEFAULT);
+	if (error != 0)
+		return (error);
+	fc = (struct tarfs_file_context *)vaddr;
+
+	error = tarfs_lookup(tm, name, fc);
+	if (error != 0) {
+		error2 = vm_free(&kernel_vm, sizeof *fc, vaddr);
+		if (error2 != 0)
+			panic("%s: vm_free failed: %m", __func__, error2);
+
+		return (error);
+	}
+
+	/*
+	 * Check file type.
+	 */
+	switch (fc->f_header.th_typeflag) {
+	case '0': /* Regular file.  */
+		break;
+	case '1': /* Link.  */
+		if (memchr(fc->f_header.th_linkname, '\0', sizeof fc->f_header.th_linkname) == NULL) {
+			error = vm_free(&kernel_vm, sizeof *fc, vaddr);
+			if (error != 0)
+				panic("%s: vm_free failed: %m", __func__, error);
+			return (ERROR_INVALID);
+		}
+
+		ASSERT(tm->tm_linklen <= sizeof tm->tm_linkbuf, "Must be in buffer bounds.");
+		linkleft = sizeof tm->tm_linkbuf - tm->tm_linklen;
+		linkname = tm->tm_linkbuf + tm->tm_linklen;
+		linkuse = strlcpy(linkname, (const char *)(const void *)fc->f_header.th_linkname, linkleft);
+		if (linkuse >= linkleft) {
+			error = vm_free(&kernel_vm, sizeof *fc, vaddr);
+			if (error != 0)
+				panic("%s: vm_free failed: %m", __func__, error);
+			return (ERROR_INVALID);
+		}
+
+		error = vm_free(&kernel_vm, sizeof *fc, vaddr);
+		if (error != 0)
+			panic("%s: vm_free failed: %m", __func__, error);
+
+		/* Skip over the . in ./ if present.  */
+		if (strncmp(linkname, "./", 2) == 0)
+			linkname++;
+
+		/*
+		 * Perform an open of the linked-to file.
+		 */
+		tm->tm_linklen += linkuse;
+		error = tarfs_file_open(tm, linkname, fsfcp);
+		tm->tm_linklen -= linkuse;
+		return (error);
+	default:
+		error = vm_free(&kernel_vm, sizeof *fc, vaddr);
+		if (error != 0)
+			panic("%s: vm_free failed: %m", __func__, error);
+
+		return (ERROR_WRONG_KIND);
+	}
+
+	*fsfcp = fc;
+
+	return (0);
+}
+
 static int
 tarfs_lookup(struct tarfs_mount *tm, const char *path, struct tarfs_file_context *fc)
 {
@@ -1,6 +1,7 @@
 #include <core/types.h>
 #include <core/endian.h>
 #include <core/error.h>
+#include <core/mutex.h>
 #include <core/string.h>
 #include <io/storage/device.h>
 #include <io/storage/ufs/ufs_directory.h>
@@ -25,11 +26,18 @@ struct ufs_directory_context {
 };
 
 struct ufs_file_context {
+	uint32_t f_inode;
 	struct ufs2_inode f_in;
 	uint8_t f_block[UFS_MAX_BSIZE];
 };
 
+/*
+ * The lookup context and indirect block buffer are shared by every operation,
+ * which may be called from several service threads at once, so the lock is
+ * held by each operation which uses them.
+ */
 struct ufs_mount {
+	struct mutex um_lock;
 	unsigned um_flags;
 
 	struct storage_device *um_sdev;
@@ -52,6 +60,7 @@ static off_t ufs_superblock_offsets[] = UFS_SUPERBLOCK_OFFSETS;
 static fs_file_open_op_t ufs_op_file_open;
 static fs_file_read_op_t ufs_op_file_read;
 static fs_file_close_op_t ufs_op_file_close;
+static fs_file_id_op_t ufs_op_file_id;
 
 static fs_directory_open_op_t ufs_op_directory_open;
 static fs_directory_read_op_t ufs_op_directory_read;
@@ -60,7 +69,7 @@ static fs_directory_close_op_t ufs_op_directory_close;
 static int ufs_lookup(struct ufs_mount *, const char *, uint32_t *);
 static int ufs_map_block(struct ufs_mount *, struct ufs2_inode *, off_t, uint64_t *);
 static int ufs_read_block(struct ufs_mount *, struct ufs2_inode *, uint64_t, uint8_t *);
-static int ufs_read_directory(struct ufs_mount *, struct ufs2_inode *, uint64_t, struct ufs_directory_entry *, char *, size_t);
+static int ufs_read_directory(struct ufs_mount *, struct ufs_directory_context *, uint64_t, char *, size_t);
 static int ufs_read_fsbn(struct ufs_mount *, uint64_t, uint8_t *);
 static int ufs_read_inode(struct ufs_mount *, uint32_t, struct ufs2_inode *);
 static int ufs_read_superblock(struct ufs_mount *);
@@ -69,6 +78,7 @@ static struct fs_ops ufs_fs_ops = {
 	.fs_file_open = ufs_op_file_open,
 	.fs_file_read = ufs_op_file_read,
 	.fs_file_close = ufs_op_file_close,
+	.fs_file_id = ufs_op_file_id,
 
 	.fs_directory_open = ufs_op_directory_open,
 	.fs_directory_read = ufs_op_directory_read,
@@ -87,6 +97,7 @@ ufs_mount(struct storage_device *sdev)
 		return (error);
 
 	um = (struct ufs_mount *)umaddr;
+	mutex_init(&um->um_lock, "UFS Mount", MUTEX_FLAG_DEFAULT);
 	um->um_flags = UFS_MOUNT_DEFAULT;
 	um->um_sdev = sdev;
 	um->um_sboff = -1;
@@ -120,16 +131,11 @@ ufs_op_file_open(fs_context_t fsc, const char *name, fs_file_context_t *fsfcp)
 		return (error);
 	fc = (struct ufs_file_context *)vaddr;
 
+	mutex_lock(&um->um_lock);
 	error = ufs_lookup(um, name, &inode);
-	if (error != 0) {
-		error2 = vm_free(&kernel_vm, sizeof *fc, vaddr);
-		if (error2 != 0)
-			panic("%s: vm_free failed: %m", __func__, error2);
-
-		return (error);
-	}
-
-	error = ufs_read_inode(um, inode, &fc->f_in);
+	if (error == 0)
+		error = ufs_read_inode(um, inode, &fc->f_in);
+	mutex_unlock(&um->um_lock);
 	if (error != 0) {
 		error2 = vm_free(&kernel_vm, sizeof *fc, vaddr);
 		if (error2 != 0)
@@ -149,6 +155,7 @@ ufs_op_file_open(fs_context_t fsc, const char *name, fs_file_context_t *fsfcp)
 		return (ERROR_WRONG_KIND);
 	}
 
+	fc->f_inode = inode;
 	*fsfcp = fc;
 
 	return (0);
@@ -172,7 +179,9 @@ ufs_op_file_read(fs_context_t fsc, fs_file_context_t fsfc, void *buf, off_t off,
 		return (0);
 	}
 
+	mutex_lock(&um->um_lock);
 	error = ufs_read_block(um, &fc->f_in, address, fc->f_block);
+	mutex_unlock(&um->um_lock);
 	if (error != 0)
 		return (error);
 
@@ -198,6 +207,18 @@ ufs_op_file_close(fs_context_t fsc, fs_file_context_t fsfc)
 	return (0);
 }
 
+static int
+ufs_op_file_id(fs_context_t fsc, fs_file_context_t fsfc, uint64_t *idp)
+{
+	struct ufs_file_context *fc = fsfc;
+
+	(void)fsc;
+
+	*idp = fc->f_inode;
+
+	return (0);
+}
+
 static int
 ufs_op_directory_open(fs_context_t fsc, const char *name, fs_directory_context_t *fsdcp)
 {
@@ -212,16 +233,11 @@ ufs_op_directory_open(fs_context_t fsc, const char *name, fs_directory_context_t
 		return (error);
 	dc = (struct ufs_directory_context *)vaddr;
 
+	mutex_lock(&um->um_lock);
 	error = ufs_lookup(um, name, &inode);
-	if (error != 0) {
-		error2 = vm_free(&kernel_vm, sizeof *dc, vaddr);
-		if (error2 != 0)
-			panic("%s: vm_free failed: %m", __func__, error2);
-
-		return (error);
-	}
-
-	error = ufs_read_inode(um, inode, &dc->d_in);
+	if (error == 0)
+		error = ufs_read_inode(um, inode, &dc->d_in);
+	mutex_unlock(&um->um_lock);
 	if (error != 0) {
 		error2 = vm_free(&kernel_vm, sizeof *dc, vaddr);
 		if (error2 != 0)
@@ -263,7 +279,9 @@ ufs_op_directory_read(fs_context_t fsc, fs_directory_context_t fsdc, struct fs_d
 		return (0);
 	}
 
-	error = ufs_read_directory(um, &dc->d_in, offset, &dc->d_entry, de->name, sizeof de->name);
+	mutex_lock(&um->um_lock);
+	error = ufs_read_directory(um, dc, offset, de->name, sizeof de->name);
+	mutex_unlock(&um->um_lock);
 	if (error != 0)
 		return (error);
 
@@ -330,7 +348,7 @@ ufs_lookup(struct ufs_mount *um, const char *path, uint32_t *inodep)
 			if (offset == dc->d_in.in_size)
 				return (ERROR_NOT_FOUND);
 
-			error = ufs_read_directory(um, &dc->d_in, offset, &dc->d_entry, dc->d_name, sizeof dc->d_name);
+			error = ufs_read_directory(um, dc, offset, dc->d_name, sizeof dc->d_name);
 			if (error != 0)
 				return (error);
 
@@ -444,23 +462,23 @@ ufs_read_block(struct ufs_mount *um, struct ufs2_inode *in, uint64_t off, uint8_
 }
 
 static int
-ufs_read_directory(struct ufs_mount *um, struct ufs2_inode *in, uint64_t off, struct ufs_directory_entry *de, char *buf, size_t buflen)
+ufs_read_directory(struct ufs_mount *um, struct ufs_directory_context *dc, uint64_t off, char *buf, size_t buflen)
 {
 	unsigned offset = off % UFS_BSIZE(&um->um_sb);
 	int error;
 
 	if (offset == 0) {
-		error = ufs_read_block(um, in, off, um->um_dc.d_block);
+		error = ufs_read_block(um, &dc->d_in, off, dc->d_block);
 		if (error != 0)
 			return (error);
 	}
 
-	memcpy(de, &um->um_dc.d_block[offset], sizeof *de);
+	memcpy(&dc->d_entry, &dc->d_block[offset], sizeof dc->d_entry);
 
 	if ((um->um_flags & UFS_MOUNT_SWAP) != 0)
-		ufs_directory_entry_swap(de);
+		ufs_directory_entry_swap(&dc->d_entry);
 
-	strlcpy(buf, (char *)&um->um_dc.d_block[offset + sizeof *de], buflen);
+	strlcpy(buf, (char *)&dc->d_block[offset + sizeof dc->d_entry], buflen);
 
 	return (0);
 }
@@ -29,10 +29,35 @@ struct ipc_header {
 	ipc_port_t ipchdr_dst;
 	ipc_port_right_t ipchdr_right;	/* Right to give dst on src.  */
 	ipc_msg_t ipchdr_msg;		/* Opaque to IPC code, except IPC_MSG_NONE.  */
+	uint32_t ipchdr_npages;		/* Set by IPC code on receive.  */
 	ipc_cookie_t ipchdr_cookie;	/* Opaque to IPC code.  */
 	ipc_parameter_t ipchdr_param;	/* Opaque to IPC code.  */
 };
 
+/*
+ * Data up to this size is carried in the message itself rather than in a page.
+ */
+#define	IPC_DATA_INLINE_MAX	(128)
+
+/*
+ * Larger data is sent in up to this many pages, which the receiver finds
+ * mapped at consecutive addresses.
+ */
+#define	IPC_DATA_PAGES_MAX	(16)
+
+/*
+ * Pages sent by ipc_port_send_vector are either moved, in which case the
+ * sender gives them up, or copied, in which case the sender keeps them and they
+ * are shared copy-on-write with the receiver.
+ */
+struct ipc_page_vector {
+	void *ipcpv_page;
+	uint32_t ipcpv_flags;
+};
+
+#define	IPC_PAGE_FLAG_MOVE	(0x00000000)
+#define	IPC_PAGE_FLAG_COPY	(0x00000001)
+
 /*
  * Message field encoding.
  *
@@ -40,6 +65,13 @@ struct ipc_header {
  */
 #define	IPC_MSG_NONE		(0)	/* Requires no right to send, may not have data.  */
 
+/*
+ * Sent by the IPC code, from a port which has lost its last receive right, to
+ * the port each holder of a send right on it asked to be notified at with
+ * ipc_port_right_notify.  The parameter is the dead port, too.
+ */
+#define	IPC_MSG_DEAD_NAME	(0x0fff)
+
 /*
  * These are conventional but not semantic to the IPC code.
  */
@@ -0,0 +1,145 @@
+#include <core/types.h>
+#include <core/error.h>
+#include <core/string.h>
+#include <ipc/ipc.h>
+#include <ipc/mailbox.h>
+#include <ipc/port.h>
+#include <vm/vm_page.h>
+
+/*
+ * The mailbox is mapped from a user task, which may change it out from under
+ * us at any time, so each field is read only once and checked after copying.
+ */
+
+static int ipc_mailbox_receive(struct ipc_mailbox *, ipc_port_t, unsigned, unsigned, unsigned, unsigned *);
+static unsigned ipc_mailbox_send(struct ipc_mailbox *, unsigned);
+
+int
+ipc_mailbox_process(struct ipc_mailbox *mb)
+{
+	unsigned flags, nreceive, nsend, offset, received;
+	ipc_port_t port;
+	int error;
+
+	nsend = mb->imb_send_count;
+	offset = mb->imb_receive_offset;
+	nreceive = mb->imb_receive_count;
+	port = mb->imb_receive_port;
+	flags = mb->imb_flags;
+
+	if (nsend > (PAGE_SIZE - sizeof *mb) / sizeof (struct ipc_mailbox_send))
+		return (ERROR_INVALID);
+	if (nreceive != 0) {
+		if (offset < sizeof *mb || offset > PAGE_SIZE ||
+		    (offset % sizeof (uint64_t)) != 0)
+			return (ERROR_INVALID);
+		if (nreceive > (PAGE_SIZE - offset) / sizeof (struct ipc_mailbox_receive))
+			return (ERROR_INVALID);
+	}
+
+	if (nsend != 0)
+		mb->imb_send_count = ipc_mailbox_send(mb, nsend);
+
+	if (nreceive != 0) {
+		error = ipc_mailbox_receive(mb, port, flags, offset, nreceive,
+					    &received);
+		mb->imb_receive_count = received;
+		if (error != 0)
+			return (error);
+	}
+
+	return (0);
+}
+
+/*
+ * Returns ERROR_AGAIN if nothing could be received without waiting for it.
+ */
+static int
+ipc_mailbox_receive(struct ipc_mailbox *mb, ipc_port_t port, unsigned flags,
+		    unsigned offset, unsigned nreceive, unsigned *receivedp)
+{
+	struct ipc_mailbox_receive *imr;
+	struct ipc_header ipch;
+	size_t datalen;
+	unsigned i;
+	int error;
+	void *page;
+
+	for (i = 0; i < nreceive; i++) {
+		imr = (struct ipc_mailbox_receive *)((uintptr_t)mb + offset) + i;
+
+		for (;;) {
+			if ((flags & IPC_MAILBOX_FLAG_PAGES) != 0) {
+				error = ipc_port_receive(port, &ipch, &page);
+				datalen = 0;
+			} else {
+				error = ipc_port_receive_data(port, &ipch,
+							      imr->imr_data,
+							      &datalen, &page);
+			}
+			if (error != ERROR_AGAIN || i != 0 ||
+			    (flags & IPC_MAILBOX_FLAG_WAIT) == 0)
+				break;
+
+			error = ipc_port_wait(port);
+			if (error != 0)
+				break;
+		}
+		if (error != 0) {
+			*receivedp = i;
+			if (i != 0)
+				return (0);
+			return (error);
+		}
+
+		imr->imr_header = ipch;
+		imr->imr_page = page;
+		imr->imr_datalen = datalen;
+	}
+
+	*receivedp = i;
+	return (0);
+}
+
+/*
+ * Returns the number of messages which could not be sent, having moved them to
+ * the front of the mailbox.
+ */
+static unsigned
+ipc_mailbox_send(struct ipc_mailbox *mb, unsigned nsend)
+{
+	struct ipc_mailbox_send *ims, *failed;
+	struct ipc_header ipch;
+	unsigned i, nfailed;
+	size_t datalen;
+	void *page;
+	int error;
+
+	nfailed = 0;
+	for (i = 0; i < nsend; i++) {
+		ims = IPC_MAILBOX_SEND(mb, i);
+
+		ipch = ims->ims_header;
+		page = ims->ims_page;
+		datalen = ims->ims_datalen;
+
+		if (datalen > IPC_DATA_INLINE_MAX ||
+		    (page != NULL && datalen != 0))
+			error = ERROR_INVALID;
+		else if (page != NULL)
+			error = ipc_port_send(&ipch, page);
+		else if (datalen != 0)
+			error = ipc_port_send_data(&ipch, ims->ims_data, datalen);
+		else
+			error = ipc_port_send_data(&ipch, NULL, 0);
+		if (error == 0)
+			continue;
+
+		failed = IPC_MAILBOX_SEND(mb, nfailed++);
+		if (failed != ims)
+			memcpy(failed, ims, sizeof *ims);
+		failed->ims_error = error;
+	}
+
+	return (nfailed);
+}
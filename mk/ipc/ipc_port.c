@@ -2,18 +2,25 @@
 #include <core/btree.h>
 #include <core/cv.h>
 #include <core/console.h>
+#include <core/critical.h>
 #include <core/error.h>
 #include <core/malloc.h>
+#include <core/mp.h>
 #include <core/mutex.h>
 #include <core/pool.h>
+#include <core/rwlock.h>
 #include <core/startup.h>
 #include <core/string.h>
 #include <core/task.h>
 #include <core/thread.h>
 #include <ipc/ipc.h>
 #include <ipc/port.h>
+#include <ipc/trace.h>
 #include <vm/vm.h>
+#include <vm/vm_fault.h>
 #include <vm/vm_index.h>
+#include <vm/vm_map.h>
+#include <vm/vm_object.h>
 #include <vm/vm_page.h>
 
 struct ipc_port;
@@ -25,13 +32,20 @@ struct ipc_port;
  */
 struct ipc_message {
 	struct ipc_header ipcmsg_header;
-	struct vm_page *ipcmsg_page;
-	TAILQ_ENTRY(struct ipc_message) ipcmsg_link;
+	unsigned ipcmsg_npages;
+	struct vm_page *ipcmsg_pages[IPC_DATA_PAGES_MAX];
+	struct ipc_message *ipcmsg_next;
+	size_t ipcmsg_datalen;
+	uint8_t ipcmsg_data[IPC_DATA_INLINE_MAX];
 };
 
 struct ipc_port_right {
+	struct ipc_port *ipcpr_port;
 	struct task *ipcpr_task;
 	ipc_port_right_t ipcpr_right;
+	unsigned ipcpr_send_refs;	/* Send rights held.  */
+	unsigned ipcpr_send_once_refs;	/* Send-once rights held.  */
+	ipc_port_t ipcpr_notify;	/* Where to say the port died.  */
 	/*
 	 * Each port right is in a BTREE by task that lets
 	 * rights be looked up for a given task on a port
@@ -41,43 +55,103 @@ struct ipc_port_right {
 	/*
 	 * Each port right is in a STAILQ that lets all
 	 * rights associated with a task be enumerated.
-	 * The STAILQ_HEAD is in the ipc_task structure.
+	 * The STAILQ_HEAD is in the ipc_task structure,
+	 * and is protected by the task's lock.
 	 */
 	STAILQ_ENTRY(struct ipc_port_right) ipcpr_link;
 };
 
+/*
+ * The port table holds a reference to each port, which is dropped when the last
+ * receive right goes and the port is taken out of the table.  Anyone who uses a
+ * port after dropping the table lock without holding the port's lock, such as
+ * a sender queueing a message or a receiver asleep on it, holds a reference of
+ * their own.  Messages still queued when the last reference goes are freed
+ * with the port.
+ */
 struct ipc_port {
 	struct mutex ipcp_mutex;
 	struct cv *ipcp_cv;
 	ipc_port_t ipcp_port;
 	ipc_port_flags_t ipcp_flags;
-	TAILQ_HEAD(, struct ipc_message) ipcp_msgs;
-	BTREE_NODE(struct ipc_port) ipcp_link;
+	uint64_t ipcp_refcnt;
+	unsigned ipcp_receivers;	/* Tasks with a receive right.  */
 	/*
-	 * XXX
-	 * Need a count of receive rights and to expire _all_
-	 * rights when the last receive right is dropped.
+	 * Senders push messages onto the incoming list with a compare-and-set
+	 * and never take the port lock to do so.  Receivers, with the port lock
+	 * held, take the whole incoming list at once when they run out of ready
+	 * messages and reverse it into arrival order.
 	 */
+	uint64_t ipcp_incoming;
+	struct ipc_message *ipcp_ready;
+	BTREE_NODE(struct ipc_port) ipcp_link;
 	BTREE_ROOT(struct ipc_port_right) ipcp_rights;
 };
 
+/*
+ * Port numbers are handed to each CPU in blocks, so that picking one needs no
+ * lock and touches no shared counter in the common case.  Blocks are taken in
+ * turn from a global count, so a number only comes around again once every
+ * other number has been used; if the port which had it is still alive by
+ * then, the number is skipped.  Each CPU's block has a cache line to itself,
+ * so that taking a number doesn't bounce lines between CPUs.
+ */
+#define	IPC_PORT_BLOCK_SIZE	(256)
+
+struct ipc_port_block {
+	ipc_port_t ipcpb_next;
+	ipc_port_t ipcpb_end;
+} __aligned(CACHE_LINE_SIZE);
+
 static BTREE_ROOT(struct ipc_port) ipc_ports = BTREE_ROOT_INITIALIZER();
-static struct mutex ipc_ports_lock;
+static struct rwlock ipc_ports_lock;
 static struct pool ipc_port_pool;
 static struct pool ipc_port_right_pool;
-static ipc_port_t ipc_port_next		= IPC_PORT_UNRESERVED_START;
+static struct ipc_port_block ipc_port_blocks[MAXCPUS];
+static uint64_t ipc_port_block_next;
 
-#define	IPC_PORTS_LOCK()	mutex_lock(&ipc_ports_lock)
-#define	IPC_PORTS_UNLOCK()	mutex_unlock(&ipc_ports_lock)
+/*
+ * The port table is only written when ports are allocated and destroyed;
+ * sends, receives and right changes just look ports up, so they take the table
+ * lock shared.
+ */
+#define	IPC_PORTS_RLOCK()	rwlock_rlock(&ipc_ports_lock)
+#define	IPC_PORTS_RUNLOCK()	rwlock_runlock(&ipc_ports_lock)
+#define	IPC_PORTS_WLOCK()	rwlock_wlock(&ipc_ports_lock)
+#define	IPC_PORTS_WUNLOCK()	rwlock_wunlock(&ipc_ports_lock)
 
 #define	IPC_PORT_LOCK(p)	mutex_lock(&(p)->ipcp_mutex)
 #define	IPC_PORT_UNLOCK(p)	mutex_unlock(&(p)->ipcp_mutex)
+#define	IPC_PORT_ASSERT_LOCKED(p)					\
+	ASSERT(MUTEX_HELD(&(p)->ipcp_mutex), "Port must be locked.")
 
 static struct ipc_port *ipc_port_alloc(void);
+static bool ipc_port_buffer_check(struct task *, vaddr_t, size_t, unsigned);
+static struct ipc_message *ipc_port_dequeue(struct ipc_port *);
+static void ipc_port_destroy(struct ipc_port *);
+static bool ipc_port_enqueue(struct ipc_port *, struct ipc_message *);
+static struct ipc_port *ipc_port_find(ipc_port_t);
+static void ipc_port_free(struct ipc_port *);
+static void ipc_port_hold(struct ipc_port *);
 static struct ipc_port *ipc_port_lookup(ipc_port_t);
+static int ipc_port_map_pages(struct task *, struct ipc_message *, vaddr_t *);
+static void ipc_port_notify(struct ipc_message *);
+static ipc_port_t ipc_port_number(void);
+static int ipc_port_page_copy(struct task *, vaddr_t, struct vm_page **);
+static void ipc_port_page_free_address(struct task *, vaddr_t);
+static int ipc_port_page_move(struct task *, vaddr_t, struct vm_page **);
+static void ipc_port_page_restore(struct task *, vaddr_t, struct vm_page *);
+static void ipc_port_pages_release(struct vm_page **, unsigned);
+static bool ipc_port_pending(struct ipc_port *);
+static int ipc_port_place_pages(struct task *, struct ipc_message *, vaddr_t, size_t);
+static int ipc_port_receive_message(ipc_port_t, struct ipc_header *, void *, size_t *, void *, size_t, void **);
 static int ipc_port_register(struct ipc_port *, ipc_port_t, ipc_port_flags_t);
+static void ipc_port_release(struct ipc_port *);
+static int ipc_port_send_message(const struct ipc_header *, struct vm_page **, unsigned, const void *, size_t);
+static void ipc_port_vector_undo(struct task *, const struct ipc_page_vector *, struct vm_page **, unsigned);
 
 static bool ipc_port_right_check(struct ipc_port *, struct task *, ipc_port_right_t);
+static void ipc_port_right_free(struct ipc_port *, struct ipc_port_right *);
 static int ipc_port_right_insert(struct ipc_port *, struct task *, ipc_port_right_t);
 static struct ipc_port_right *ipc_port_right_lookup(struct ipc_port *, struct task *);
 static int ipc_port_right_remove(struct ipc_port *, struct task *, ipc_port_right_t);
@@ -99,13 +173,13 @@ ipc_port_init(void)
 	if (error != 0)
 		panic("%s: pool_create failed: %m", __func__, error);
 
-	mutex_init(&ipc_ports_lock, "IPC Ports", MUTEX_FLAG_DEFAULT);
+	rwlock_init(&ipc_ports_lock, "IPC Ports");
 }
 
 int
 ipc_port_allocate(ipc_port_t *portp, ipc_port_flags_t flags)
 {
-	struct ipc_port *ipcp, *old;
+	struct ipc_port *ipcp;
 	ipc_port_t port;
 	int error;
 
@@ -113,33 +187,26 @@ ipc_port_allocate(ipc_port_t *portp, ipc_port_flags_t flags)
 	if (ipcp == NULL)
 		return (ERROR_EXHAUSTED);
 
-	IPC_PORTS_LOCK();
 	for (;;) {
-		if (ipc_port_next < IPC_PORT_UNRESERVED_START) {
-			ipc_port_next = IPC_PORT_UNRESERVED_START;
+		port = ipc_port_number();
+		if (port < IPC_PORT_UNRESERVED_START)
 			continue;
-		}
-		port = ipc_port_next++;
-
-		old = ipc_port_lookup(port);
-		if (old != NULL) {
-			IPC_PORT_UNLOCK(old);
-			continue;
-		}
 
+		IPC_PORTS_WLOCK();
 		IPC_PORT_LOCK(ipcp);
 		error = ipc_port_register(ipcp, port, flags);
-		if (error != 0)
+		IPC_PORT_UNLOCK(ipcp);
+		IPC_PORTS_WUNLOCK();
+		if (error == 0)
+			break;
+		if (error != ERROR_NOT_FREE)
 			panic("%s: ipc_port_register failed: %m", __func__,
 			      error);
-		IPC_PORT_UNLOCK(ipcp);
-
-		IPC_PORTS_UNLOCK();
+	}
 
-		*portp = port;
+	*portp = port;
 
-		return (0);
-	}
+	return (0);
 }
 
 int
@@ -151,191 +218,230 @@ ipc_port_allocate_reserved(ipc_port_t port, ipc_port_flags_t flags)
 	if (port == IPC_PORT_UNKNOWN || port >= IPC_PORT_UNRESERVED_START)
 		return (ERROR_INVALID);
 
-	IPC_PORTS_LOCK();
+	IPC_PORTS_RLOCK();
 	old = ipc_port_lookup(port);
 	if (old != NULL) {
 		IPC_PORT_UNLOCK(old);
-		IPC_PORTS_UNLOCK();
+		IPC_PORTS_RUNLOCK();
 		return (ERROR_NOT_FREE);
 	}
-	IPC_PORTS_UNLOCK();
+	IPC_PORTS_RUNLOCK();
 
 	ipcp = ipc_port_alloc();
 	if (ipcp == NULL)
 		return (ERROR_EXHAUSTED);
 
-	IPC_PORTS_LOCK();
+	IPC_PORTS_WLOCK();
 	IPC_PORT_LOCK(ipcp);
 	error = ipc_port_register(ipcp, port, flags);
 	if (error != 0)
 		panic("%s: ipc_port_register failed: %m", __func__, error);
 	IPC_PORT_UNLOCK(ipcp);
-	IPC_PORTS_UNLOCK();
+	IPC_PORTS_WUNLOCK();
 
 	return (0);
 }
 
+int
+ipc_port_receive(ipc_port_t port, struct ipc_header *ipch, void **vpagep)
+{
+	return (ipc_port_receive_message(port, ipch, NULL, NULL, NULL, 0, vpagep));
+}
+
 /*
- * XXX
- * receive could take a task-local port number like a fd and speed lookup and
- * minimize locking.
+ * Like ipc_port_receive, but the receiver posts a buffer of whole pages for a
+ * message's data to be placed in, so that the same memory can be used for
+ * every message rather than taking a fresh mapping for each.  A user task's
+ * buffer must be anonymous memory, and the pages already there are replaced by
+ * the message's and go to the task's recycle pool; a kernel buffer is copied
+ * into.  Messages which don't fit, or which can't be placed for any other
+ * reason, are mapped elsewhere just as by ipc_port_receive, so the caller must
+ * check whether *vpagep is buf.
  */
 int
-ipc_port_receive(ipc_port_t port, struct ipc_header *ipch, void **vpagep)
+ipc_port_receive_buffer(ipc_port_t port, struct ipc_header *ipch, void *buf,
+			size_t buflen, void **vpagep)
 {
-	struct ipc_message *ipcmsg;
-	struct ipc_port *ipcp;
-	struct task *task;
-	vaddr_t vaddr;
-	int error, error2;
+	if (!PAGE_ALIGNED((vaddr_t)buf) || !PAGE_ALIGNED(buflen) ||
+	    buflen == 0 || buflen > IPC_DATA_PAGES_MAX * PAGE_SIZE)
+		return (ERROR_INVALID);
+	return (ipc_port_receive_message(port, ipch, NULL, NULL, buf, buflen,
+					 vpagep));
+}
 
-	task = current_task();
+/*
+ * Like ipc_port_receive, but data sent inline is copied to the caller's
+ * buffer, which must hold IPC_DATA_INLINE_MAX bytes, rather than into a page.
+ * Nothing past the end of the data is written.
+ */
+int
+ipc_port_receive_data(ipc_port_t port, struct ipc_header *ipch, void *data,
+		      size_t *datalenp, void **vpagep)
+{
+	return (ipc_port_receive_message(port, ipch, data, datalenp, NULL, 0,
+					 vpagep));
+}
 
-	ASSERT(task != NULL, "Must have a running task.");
-	ASSERT(ipch != NULL, "Must be able to copy out header.");
+int
+ipc_port_right_drop(ipc_port_t port, ipc_port_right_t right)
+{
+	return (ipc_port_right_revoke(current_task(), port, right));
+}
 
-	IPC_PORTS_LOCK();
-	ipcp = ipc_port_lookup(port);
+int
+ipc_port_right_grant(struct task *task, ipc_port_t src, ipc_port_right_t right)
+{
+	struct ipc_port *ipcp;
+	int error;
+
+	IPC_PORTS_RLOCK();
+	ipcp = ipc_port_lookup(src);
 	if (ipcp == NULL) {
-		IPC_PORTS_UNLOCK();
+		IPC_PORTS_RUNLOCK();
 		return (ERROR_NOT_FOUND);
 	}
-	IPC_PORTS_UNLOCK();
+	IPC_PORTS_RUNLOCK();
 
-	if (!ipc_port_right_check(ipcp, task, IPC_PORT_RIGHT_RECEIVE)) {
+	if (!ipc_port_right_check(ipcp, current_task(), IPC_PORT_RIGHT_RECEIVE)) {
 		IPC_PORT_UNLOCK(ipcp);
 		return (ERROR_NO_RIGHT);
 	}
 
-	if (TAILQ_EMPTY(&ipcp->ipcp_msgs)) {
+	error = ipc_port_right_insert(ipcp, task, right);
+	if (error != 0) {
 		IPC_PORT_UNLOCK(ipcp);
-		return (ERROR_AGAIN);
+		return (error);
 	}
-
-	ipcmsg = TAILQ_FIRST(&ipcp->ipcp_msgs);
-	ASSERT(ipcmsg != NULL, "Queue must not change out from under us.");
-	ASSERT(ipcmsg->ipcmsg_header.ipchdr_dst == ipcp->ipcp_port,
-	       "Destination must be this port.");
-	TAILQ_REMOVE(&ipcp->ipcp_msgs, ipcmsg, ipcmsg_link);
 	IPC_PORT_UNLOCK(ipcp);
+	return (0);
+}
 
-	/*
-	 * Insert any passed rights.
-	 */
-	if (ipcmsg->ipcmsg_header.ipchdr_right != IPC_PORT_RIGHT_NONE) {
-		ipcp = ipc_port_lookup(ipcmsg->ipcmsg_header.ipchdr_src);
-		if (ipcp == NULL)
-			panic("%s: port disappeared.", __func__);
-		error = ipc_port_right_insert(ipcp, task, ipcmsg->ipcmsg_header.ipchdr_right);
-		if (error != 0)
-			panic("%s: grating rights failed: %m", __func__,
-			      error);
-		IPC_PORT_UNLOCK(ipcp);
-	}
+/*
+ * Ask for an IPC_MSG_DEAD_NAME message to be sent to notify, on which the task
+ * must have a receive right, when port dies.  The task must have a send right
+ * on port; rights on public ports are not tracked, so no notification can be
+ * asked for on them.
+ */
+int
+ipc_port_right_notify(ipc_port_t port, ipc_port_t notify)
+{
+	struct ipc_port_right *ipcpr;
+	struct ipc_port *ipcp;
+	struct task *task;
 
-	if (ipcmsg->ipcmsg_page == NULL) {
-		if (vpagep != NULL)
-			*vpagep = NULL;
-	} else {
-		if (vpagep == NULL) {
-			/*
-			 * A task may refuse a page flip for any number of reasons.
-			 */
-			page_release(ipcmsg->ipcmsg_page);
-		} else {
-			/*
-			 * Map this page into the receiving task.
-			 */
-			if ((task->t_flags & TASK_KERNEL) == 0) {
-				/*
-				 * User task.
-				 */
-				error = vm_alloc_address(task->t_vm, &vaddr, 1, false);
-				if (error != 0) {
-					page_release(ipcmsg->ipcmsg_page);
-					free(ipcmsg);
-					return (error);
-				}
+	task = current_task();
 
-				error = page_map(task->t_vm, vaddr, ipcmsg->ipcmsg_page);
-				if (error != 0) {
-					error2 = vm_free_address(task->t_vm, vaddr);
-					if (error2 != 0)
-						panic("%s: vm_free_address failed: %m", __func__, error);
-					page_release(ipcmsg->ipcmsg_page);
-					free(ipcmsg);
-				}
-			} else {
-				/*
-				 * Kernel task.
-				 */
-				error = page_map_direct(&kernel_vm, ipcmsg->ipcmsg_page, &vaddr);
-				if (error != 0) {
-					page_release(ipcmsg->ipcmsg_page);
-					free(ipcmsg);
-					return (error);
-				}
-			}
-			*vpagep = (void *)vaddr;
-		}
+	IPC_PORTS_RLOCK();
+	ipcp = ipc_port_lookup(notify);
+	if (ipcp == NULL) {
+		IPC_PORTS_RUNLOCK();
+		return (ERROR_NOT_FOUND);
+	}
+	if (!ipc_port_right_check(ipcp, task, IPC_PORT_RIGHT_RECEIVE)) {
+		IPC_PORT_UNLOCK(ipcp);
+		IPC_PORTS_RUNLOCK();
+		return (ERROR_NO_RIGHT);
 	}
+	IPC_PORT_UNLOCK(ipcp);
 
-	*ipch = ipcmsg->ipcmsg_header;
+	ipcp = ipc_port_lookup(port);
+	if (ipcp == NULL) {
+		IPC_PORTS_RUNLOCK();
+		return (ERROR_NOT_FOUND);
+	}
+	IPC_PORTS_RUNLOCK();
 
-	free(ipcmsg);
+	ipcpr = ipc_port_right_lookup(ipcp, task);
+	if (ipcpr == NULL ||
+	    (ipcpr->ipcpr_right & (IPC_PORT_RIGHT_SEND | IPC_PORT_RIGHT_SEND_ONCE)) == 0) {
+		IPC_PORT_UNLOCK(ipcp);
+		return (ERROR_NO_RIGHT);
+	}
+	ipcpr->ipcpr_notify = notify;
+	IPC_PORT_UNLOCK(ipcp);
 
 	return (0);
 }
 
+/*
+ * Drop a task's right on a port, as ipc_port_right_drop does for the current
+ * task.
+ */
 int
-ipc_port_right_drop(ipc_port_t port, ipc_port_right_t right)
+ipc_port_right_revoke(struct task *task, ipc_port_t port, ipc_port_right_t right)
 {
 	struct ipc_port *ipcp;
+	bool dead;
 	int error;
 
-	IPC_PORTS_LOCK();
+	IPC_PORTS_RLOCK();
 	ipcp = ipc_port_lookup(port);
 	if (ipcp == NULL) {
-		IPC_PORTS_UNLOCK();
+		IPC_PORTS_RUNLOCK();
 		return (ERROR_NOT_FOUND);
 	}
-	IPC_PORTS_UNLOCK();
+	IPC_PORTS_RUNLOCK();
 
-	error = ipc_port_right_remove(ipcp, current_task(), right);
+	error = ipc_port_right_remove(ipcp, task, right);
 	if (error != 0) {
 		IPC_PORT_UNLOCK(ipcp);
 		return (error);
 	}
+	dead = (right & IPC_PORT_RIGHT_RECEIVE) != 0 && ipcp->ipcp_receivers == 0;
 	IPC_PORT_UNLOCK(ipcp);
+
+	/*
+	 * Nobody can gain a receive right without already having one, so the
+	 * port cannot come back to life before it is destroyed.
+	 */
+	if (dead)
+		ipc_port_destroy(ipcp);
 	return (0);
 }
 
-int
-ipc_port_right_grant(struct task *task, ipc_port_t src, ipc_port_right_t right)
+/*
+ * Called when a task goes away, to drop every right it still has.
+ */
+void
+ipc_port_rights_drop(struct task *task)
 {
+	struct ipc_task *ipct = &task->t_ipc;
+	struct ipc_port_right *ipcpr;
 	struct ipc_port *ipcp;
-	int error;
+	bool dead;
 
-	IPC_PORTS_LOCK();
-	ipcp = ipc_port_lookup(src);
-	if (ipcp == NULL) {
-		IPC_PORTS_UNLOCK();
-		return (ERROR_NOT_FOUND);
-	}
-	IPC_PORTS_UNLOCK();
+	for (;;) {
+		/*
+		 * A right on the task's list has not yet been freed by its
+		 * port being destroyed, so the port is still in the table and
+		 * it is safe to take a reference.
+		 */
+		IPC_TASK_LOCK(ipct);
+		ipcpr = STAILQ_FIRST(&ipct->ipct_rights);
+		if (ipcpr == NULL) {
+			IPC_TASK_UNLOCK(ipct);
+			return;
+		}
+		ipcp = ipcpr->ipcpr_port;
+		ipc_port_hold(ipcp);
+		IPC_TASK_UNLOCK(ipct);
 
-	if (!ipc_port_right_check(ipcp, current_task(), IPC_PORT_RIGHT_RECEIVE)) {
+		dead = false;
+		IPC_PORT_LOCK(ipcp);
+		ipcpr = ipc_port_right_lookup(ipcp, task);
+		if (ipcpr != NULL) {
+			if ((ipcpr->ipcpr_right & IPC_PORT_RIGHT_RECEIVE) != 0) {
+				ipcp->ipcp_receivers--;
+				dead = ipcp->ipcp_receivers == 0;
+			}
+			ipc_port_right_free(ipcp, ipcpr);
+		}
 		IPC_PORT_UNLOCK(ipcp);
-		return (ERROR_NO_RIGHT);
-	}
 
-	error = ipc_port_right_insert(ipcp, task, right);
-	if (error != 0) {
-		IPC_PORT_UNLOCK(ipcp);
-		return (error);
+		if (dead)
+			ipc_port_destroy(ipcp);
+		ipc_port_release(ipcp);
 	}
-	IPC_PORT_UNLOCK(ipcp);
-	return (0);
 }
 
 int
@@ -345,24 +451,26 @@ ipc_port_right_send(ipc_port_t dst, ipc_port_t src, ipc_port_right_t right)
 	struct ipc_port_right *ipcpr;
 	int error;
 
-	IPC_PORTS_LOCK();
+	IPC_PORTS_RLOCK();
 	srcp = ipc_port_lookup(src);
 	if (srcp == NULL) {
-		IPC_PORTS_UNLOCK();
+		IPC_PORTS_RUNLOCK();
 		return (ERROR_NOT_FOUND);
 	}
-	IPC_PORTS_UNLOCK();
 
 	if (!ipc_port_right_check(srcp, current_task(), IPC_PORT_RIGHT_RECEIVE)) {
 		IPC_PORT_UNLOCK(srcp);
+		IPC_PORTS_RUNLOCK();
 		return (ERROR_NO_RIGHT);
 	}
 
 	dstp = ipc_port_lookup(dst);
 	if (dstp == NULL) {
 		IPC_PORT_UNLOCK(srcp);
+		IPC_PORTS_RUNLOCK();
 		return (ERROR_NOT_FOUND);
 	}
+	IPC_PORTS_RUNLOCK();
 
 	/*
 	 * For each task with a receive right on dst,
@@ -384,12 +492,15 @@ ipc_port_right_send(ipc_port_t dst, ipc_port_t src, ipc_port_right_t right)
 	return (0);
 }
 
+/*
+ * Move a page to the receiver.  On success the page's address is freed in the
+ * sender; on failure the page is left mapped where it was.
+ */
 int
 ipc_port_send(const struct ipc_header *ipch, void *vpage)
 {
 	struct vm_page *page;
 	struct task *task;
-	struct vm *vm;
 	int error;
 
 	task = current_task();
@@ -397,31 +508,50 @@ ipc_port_send(const struct ipc_header *ipch, void *vpage)
 	ASSERT(task != NULL, "Must have a running task.");
 	ASSERT(ipch != NULL, "Must have a header.");
 
-	/*
-	 * Extract the vm_page for this page.
-	 */
 	if (vpage == NULL) {
 		page = NULL;
 	} else {
-		if ((task->t_flags & TASK_KERNEL) == 0)
-			vm = task->t_vm;
-		else
-			vm = &kernel_vm;
-		error = page_extract(vm, (vaddr_t)vpage, &page);
+		error = ipc_port_page_move(task, (vaddr_t)vpage, &page);
+		if (error != 0)
+			return (error);
+	}
+
+	error = ipc_port_send_page(ipch, page);
+	if (error != 0) {
+		if (page != NULL)
+			ipc_port_page_restore(task, (vaddr_t)vpage, page);
+		return (error);
+	}
+
+	if (page != NULL)
+		ipc_port_page_free_address(task, (vaddr_t)vpage);
+
+	return (0);
+}
+
+/*
+ * Like ipc_port_send, but the sender keeps its mapping of the page.  The page
+ * is shared copy-on-write between sender and receiver, so nothing is copied
+ * unless and until one of them writes to it.
+ */
+int
+ipc_port_send_copy(const struct ipc_header *ipch, void *vpage)
+{
+	struct vm_page *page;
+	struct task *task;
+	int error;
+
+	task = current_task();
+
+	ASSERT(task != NULL, "Must have a running task.");
+	ASSERT(ipch != NULL, "Must have a header.");
+
+	if (vpage == NULL) {
+		page = NULL;
+	} else {
+		error = ipc_port_page_copy(task, (vaddr_t)vpage, &page);
 		if (error != 0)
 			return (error);
-		if (vm == &kernel_vm) {
-			error = page_unmap_direct(vm, page, (vaddr_t)vpage);
-			if (error != 0)
-				panic("%s: could not unmap direct page: %m", __func__, error);
-		} else {
-			error = page_unmap(vm, (vaddr_t)vpage, page);
-			if (error != 0)
-				panic("%s: could not unmap source page: %m", __func__, error);
-			error = vm_free_address(vm, (vaddr_t)vpage);
-			if (error != 0)
-				panic("%s: could not free source page address: %m", __func__, error);
-		}
 	}
 
 	error = ipc_port_send_page(ipch, page);
@@ -440,9 +570,11 @@ ipc_port_send(const struct ipc_header *ipch, void *vpage)
 int
 ipc_port_send_data(const struct ipc_header *ipch, const void *p, size_t len)
 {
-	struct vm_page *page;
+	struct vm_page *pages[IPC_DATA_PAGES_MAX];
+	unsigned i, npages;
 	struct task *task;
 	vaddr_t vaddr;
+	size_t chunk;
 	int error;
 
 	task = current_task();
@@ -460,32 +592,52 @@ ipc_port_send_data(const struct ipc_header *ipch, const void *p, size_t len)
 	}
 
 	ASSERT(len != 0, "Cannot send data without data length.");
-	ASSERT(len <= PAGE_SIZE, "Cannot send more than a page.");
-
-	error = page_alloc(PAGE_FLAG_DEFAULT, &page);
-	if (error != 0)
-		return (error);
-
-	error = page_map_direct(&kernel_vm, page, &vaddr);
-	if (error != 0) {
-		page_release(page);
-		return (error);
-	}
+	if (len > IPC_DATA_PAGES_MAX * PAGE_SIZE)
+		return (ERROR_INVALID);
 
-	memcpy((void *)vaddr, p, len);
 	/*
-	 * Clear any trailing data so we don't leak kernel information.
+	 * Small messages are carried in the message itself, leaving pages for
+	 * bulk data.
 	 */
-	if (len != PAGE_SIZE)
-		memset((void *)(vaddr + len), 0, PAGE_SIZE - len);
+	if (len <= IPC_DATA_INLINE_MAX) {
+		error = ipc_port_send_message(ipch, NULL, 0, p, len);
+		if (error != 0)
+			return (error);
+		return (0);
+	}
 
-	error = page_unmap_direct(&kernel_vm, page, vaddr);
-	if (error != 0)
-		panic("%s: page_unmap_direct failed: %m", __func__, error);
+	npages = PAGE_COUNT(len);
+	for (i = 0; i < npages; i++) {
+		error = page_alloc(PAGE_FLAG_DEFAULT, &pages[i]);
+		if (error != 0) {
+			ipc_port_pages_release(pages, i);
+			return (error);
+		}
 
-	error = ipc_port_send_page(ipch, page);
+		error = page_map_direct(&kernel_vm, pages[i], &vaddr);
+		if (error != 0) {
+			ipc_port_pages_release(pages, i + 1);
+			return (error);
+		}
+
+		chunk = len - i * PAGE_SIZE;
+		if (chunk > PAGE_SIZE)
+			chunk = PAGE_SIZE;
+		memcpy((void *)vaddr, (const uint8_t *)p + i * PAGE_SIZE, chunk);
+		/*
+		 * Clear any trailing data so we don't leak kernel information.
+		 */
+		if (chunk != PAGE_SIZE)
+			memset((void *)(vaddr + chunk), 0, PAGE_SIZE - chunk);
+
+		error = page_unmap_direct(&kernel_vm, pages[i], vaddr);
+		if (error != 0)
+			panic("%s: page_unmap_direct failed: %m", __func__, error);
+	}
+
+	error = ipc_port_send_message(ipch, pages, npages, NULL, 0);
 	if (error != 0) {
-		page_release(page);
+		ipc_port_pages_release(pages, npages);
 		return (error);
 	}
 
@@ -495,75 +647,72 @@ ipc_port_send_data(const struct ipc_header *ipch, const void *p, size_t len)
 int
 ipc_port_send_page(const struct ipc_header *ipch, struct vm_page *page)
 {
-	struct ipc_message *ipcmsg;
-	struct ipc_port *ipcp;
+	if (page == NULL)
+		return (ipc_port_send_message(ipch, NULL, 0, NULL, 0));
+	return (ipc_port_send_message(ipch, &page, 1, NULL, 0));
+}
+
+/*
+ * On success, the pages belong to the receiver; on failure, they still belong
+ * to the caller.
+ */
+int
+ipc_port_send_pages(const struct ipc_header *ipch, struct vm_page **pages,
+		    unsigned npages)
+{
+	if (npages > IPC_DATA_PAGES_MAX)
+		return (ERROR_INVALID);
+	return (ipc_port_send_message(ipch, pages, npages, NULL, 0));
+}
+
+/*
+ * Send a run of pages, each of which may be moved or copied, as one message.
+ * Moved pages are unmapped, but their addresses are left allocated, so that a
+ * buffer of several pages can be sent and then refilled or freed as a whole.
+ * If sending fails, moved pages are mapped back where they were, as with
+ * ipc_port_send.
+ */
+int
+ipc_port_send_vector(const struct ipc_header *ipch,
+		     const struct ipc_page_vector *ipcpv, unsigned npages)
+{
+	struct vm_page *pages[IPC_DATA_PAGES_MAX];
 	struct task *task;
+	vaddr_t vaddr;
+	unsigned i;
+	int error;
 
 	task = current_task();
 
 	ASSERT(task != NULL, "Must have a running task.");
-	ASSERT(ipch != NULL, "Must have a header.");
 
-	/*
-	 * A message of IPC_MSG_NONE may always be sent to any port by any
-	 * port, may not contain any data, and may be used to grant rights.
-	 *
-	 * XXX There is probably a DoS in allowing rights to be inserted
-	 *     for arbitrary tasks, but it's limited to the number of ports,
-	 *     so clamping that value for untrusted tasks is probably a fine
-	 *     compromise for now.
-	 */
-	if (ipch->ipchdr_msg == IPC_MSG_NONE && page != NULL)
-		return (ERROR_INVALID);
-
-	IPC_PORTS_LOCK();
-
-	/*
-	 * Step 1:
-	 * Check that the sending task has a receive right on the source port.
-	 */
-	ipcp = ipc_port_lookup(ipch->ipchdr_src);
-	if (ipcp == NULL) {
-		IPC_PORTS_UNLOCK();
+	if (npages == 0 || npages > IPC_DATA_PAGES_MAX)
 		return (ERROR_INVALID);
-	}
 
-	if (!ipc_port_right_check(ipcp, task, IPC_PORT_RIGHT_RECEIVE)) {
-		IPC_PORT_UNLOCK(ipcp);
-		IPC_PORTS_UNLOCK();
-		return (ERROR_NO_RIGHT);
-	}
-	IPC_PORT_UNLOCK(ipcp);
-
-	/*
-	 * Step 2:
-	 * Check that the sending task has a send right on the destination port
-	 * unless the destination port is providing a public service or a knock
-	 * message is being sent.
-	 */
-	ipcp = ipc_port_lookup(ipch->ipchdr_dst);
-	if (ipcp == NULL) {
-		IPC_PORTS_UNLOCK();
-		return (ERROR_NOT_FOUND);
-	}
-	IPC_PORTS_UNLOCK();
-
-	if ((ipcp->ipcp_flags & IPC_PORT_FLAG_PUBLIC) == 0 &&
-	    ipch->ipchdr_msg != IPC_MSG_NONE) {
-		if (!ipc_port_right_check(ipcp, task, IPC_PORT_RIGHT_SEND)) {
-			IPC_PORT_UNLOCK(ipcp);
-			return (ERROR_NO_RIGHT);
+	for (i = 0; i < npages; i++) {
+		vaddr = (vaddr_t)ipcpv[i].ipcpv_page;
+		switch (ipcpv[i].ipcpv_flags) {
+		case IPC_PAGE_FLAG_MOVE:
+			error = ipc_port_page_move(task, vaddr, &pages[i]);
+			break;
+		case IPC_PAGE_FLAG_COPY:
+			error = ipc_port_page_copy(task, vaddr, &pages[i]);
+			break;
+		default:
+			error = ERROR_INVALID;
+			break;
+		}
+		if (error != 0) {
+			ipc_port_vector_undo(task, ipcpv, pages, i);
+			return (error);
 		}
 	}
 
-	ipcmsg = malloc(sizeof *ipcmsg);
-	ipcmsg->ipcmsg_header = *ipch;
-	ipcmsg->ipcmsg_page = page;
-
-	TAILQ_INSERT_TAIL(&ipcp->ipcp_msgs, ipcmsg, ipcmsg_link);
-	cv_signal(ipcp->ipcp_cv);
-
-	IPC_PORT_UNLOCK(ipcp);
+	error = ipc_port_send_message(ipch, pages, npages, NULL, 0);
+	if (error != 0) {
+		ipc_port_vector_undo(task, ipcpv, pages, npages);
+		return (error);
+	}
 
 	return (0);
 }
@@ -578,15 +727,15 @@ ipc_port_wait(ipc_port_t port)
 
 	ASSERT(task != NULL, "Must have a running task.");
 
-	IPC_PORTS_LOCK();
+	IPC_PORTS_RLOCK();
 	ipcp = ipc_port_lookup(port);
 	if (ipcp == NULL) {
-		IPC_PORTS_UNLOCK();
+		IPC_PORTS_RUNLOCK();
 		return (ERROR_NOT_FOUND);
 	}
-	IPC_PORTS_UNLOCK();
+	IPC_PORTS_RUNLOCK();
 
-	if (!TAILQ_EMPTY(&ipcp->ipcp_msgs)) {
+	if (ipc_port_pending(ipcp)) {
 		/*
 		 * XXX
 		 * Should we do the right check first?
@@ -603,9 +752,13 @@ ipc_port_wait(ipc_port_t port)
 		return (ERROR_NO_RIGHT);
 	}
 
-	/* XXX refcount.  */
-
+	/*
+	 * The port may be destroyed while we sleep, which wakes us.
+	 */
+	ipc_trace_wait(port);
+	ipc_port_hold(ipcp);
 	cv_wait(ipcp->ipcp_cv);
+	ipc_port_release(ipcp);
 
 	return (0);
 }
@@ -624,7 +777,10 @@ ipc_port_alloc(void)
 	ipcp->ipcp_cv = cv_create(&ipcp->ipcp_mutex);
 	ipcp->ipcp_port = IPC_PORT_UNKNOWN;
 	ipcp->ipcp_flags = IPC_PORT_FLAG_NEW;
-	TAILQ_INIT(&ipcp->ipcp_msgs);
+	ipcp->ipcp_refcnt = 1;
+	ipcp->ipcp_receivers = 0;
+	ipcp->ipcp_incoming = 0;
+	ipcp->ipcp_ready = NULL;
 	BTREE_NODE_INIT(&ipcp->ipcp_link);
 	BTREE_ROOT_INIT(&ipcp->ipcp_rights);
 
@@ -640,13 +796,189 @@ ipc_port_alloc(void)
 	return (ipcp);
 }
 
+/*
+ * Can a message with this many pages be placed in a receiver's buffer?  A user
+ * buffer has to be anonymous memory, so that no object's pages are replaced,
+ * and the receiver's VM lock must be held until the pages are in place.
+ */
+static bool
+ipc_port_buffer_check(struct task *task, vaddr_t buf, size_t buflen,
+		      unsigned npages)
+{
+	if (npages > PAGE_COUNT(buflen))
+		return (false);
+	if ((task->t_flags & TASK_KERNEL) != 0)
+		return (true);
+	return (vm_map_is_anonymous(task->t_vm, buf, buf + npages * PAGE_SIZE));
+}
+
+/*
+ * Take the oldest message off the queue.  Only one receiver at a time may do
+ * this, which the port lock ensures.
+ */
+static struct ipc_message *
+ipc_port_dequeue(struct ipc_port *ipcp)
+{
+	struct ipc_message *ipcmsg, *next, *ready;
+	uint64_t incoming;
+
+	IPC_PORT_ASSERT_LOCKED(ipcp);
+
+	if (ipcp->ipcp_ready == NULL) {
+		do {
+			incoming = atomic_load64(&ipcp->ipcp_incoming);
+			if (incoming == 0)
+				return (NULL);
+		} while (!atomic_cmpset64(&ipcp->ipcp_incoming, incoming, 0));
+
+		/*
+		 * The incoming list is newest-first; reverse it.
+		 */
+		ready = NULL;
+		ipcmsg = (struct ipc_message *)(uintptr_t)incoming;
+		while (ipcmsg != NULL) {
+			next = ipcmsg->ipcmsg_next;
+			ipcmsg->ipcmsg_next = ready;
+			ready = ipcmsg;
+			ipcmsg = next;
+		}
+		ipcp->ipcp_ready = ready;
+	}
+
+	ipcmsg = ipcp->ipcp_ready;
+	ipcp->ipcp_ready = ipcmsg->ipcmsg_next;
+	ipcmsg->ipcmsg_next = NULL;
+
+	return (ipcmsg);
+}
+
+/*
+ * Take a port whose last receive right has gone out of the table, free all of
+ * the rights on it and tell anyone who asked that it is dead.  Receivers asleep
+ * on the port are woken to find it gone, and the port itself is freed once
+ * they and any senders have let go of it.
+ */
+static void
+ipc_port_destroy(struct ipc_port *ipcp)
+{
+	struct ipc_message *ipcmsg, *notices;
+	struct ipc_port_right *ipcpr;
+	struct ipc_port *iter;
+
+	IPC_PORTS_WLOCK();
+	IPC_PORT_LOCK(ipcp);
+	BTREE_REMOVE(ipcp, iter, &ipc_ports, ipcp_link);
+	IPC_PORTS_WUNLOCK();
+
+	notices = NULL;
+	for (;;) {
+		BTREE_MIN(ipcpr, &ipcp->ipcp_rights, ipcpr_node);
+		if (ipcpr == NULL)
+			break;
+		/*
+		 * Notices are only advisory, so if there is no memory for
+		 * one, it is simply not sent.
+		 */
+		ipcmsg = NULL;
+		if (ipcpr->ipcpr_notify != IPC_PORT_UNKNOWN)
+			ipcmsg = malloc(sizeof *ipcmsg);
+		if (ipcmsg != NULL) {
+			ipcmsg->ipcmsg_header.ipchdr_src = ipcp->ipcp_port;
+			ipcmsg->ipcmsg_header.ipchdr_dst = ipcpr->ipcpr_notify;
+			ipcmsg->ipcmsg_header.ipchdr_right = IPC_PORT_RIGHT_NONE;
+			ipcmsg->ipcmsg_header.ipchdr_msg = IPC_MSG_DEAD_NAME;
+			ipcmsg->ipcmsg_header.ipchdr_npages = 0;
+			ipcmsg->ipcmsg_header.ipchdr_cookie = 0;
+			ipcmsg->ipcmsg_header.ipchdr_param = ipcp->ipcp_port;
+			ipcmsg->ipcmsg_npages = 0;
+			ipcmsg->ipcmsg_datalen = 0;
+			ipcmsg->ipcmsg_next = notices;
+			notices = ipcmsg;
+		}
+		ipc_port_right_free(ipcp, ipcpr);
+	}
+	ipcp->ipcp_receivers = 0;
+	cv_signal_broadcast(ipcp->ipcp_cv);
+	IPC_PORT_UNLOCK(ipcp);
+
+	while ((ipcmsg = notices) != NULL) {
+		notices = ipcmsg->ipcmsg_next;
+		ipc_port_notify(ipcmsg);
+	}
+
+	/*
+	 * Drop the table's reference.
+	 */
+	ipc_port_release(ipcp);
+}
+
+/*
+ * Returns true if the queue was empty, in which case the caller must wake up
+ * any receiver.
+ */
+static bool
+ipc_port_enqueue(struct ipc_port *ipcp, struct ipc_message *ipcmsg)
+{
+	uint64_t incoming;
+
+	for (;;) {
+		incoming = atomic_load64(&ipcp->ipcp_incoming);
+		ipcmsg->ipcmsg_next = (struct ipc_message *)(uintptr_t)incoming;
+		if (atomic_cmpset64(&ipcp->ipcp_incoming, incoming,
+				    (uintptr_t)ipcmsg))
+			return (incoming == 0);
+	}
+}
+
+/*
+ * Look up a port without locking it.  The pointer is only good while the port
+ * table lock is held, unless the caller takes a reference.
+ */
 static struct ipc_port *
-ipc_port_lookup(ipc_port_t port)
+ipc_port_find(ipc_port_t port)
 {
 	struct ipc_port *ipcp, *iter;
 
 	BTREE_FIND(&ipcp, iter, &ipc_ports, ipcp_link, (port < iter->ipcp_port),
 		   (port == iter->ipcp_port));
+	return (ipcp);
+}
+
+/*
+ * Free a port which has no references left, along with any messages which were
+ * never received.
+ */
+static void
+ipc_port_free(struct ipc_port *ipcp)
+{
+	struct ipc_message *ipcmsg;
+
+	IPC_PORT_LOCK(ipcp);
+	while ((ipcmsg = ipc_port_dequeue(ipcp)) != NULL) {
+		ipc_port_pages_release(ipcmsg->ipcmsg_pages,
+				       ipcmsg->ipcmsg_npages);
+		free(ipcmsg);
+	}
+	IPC_PORT_UNLOCK(ipcp);
+
+	cv_destroy(ipcp->ipcp_cv);
+	pool_free(ipcp);
+}
+
+static void
+ipc_port_hold(struct ipc_port *ipcp)
+{
+	ASSERT(atomic_load64(&ipcp->ipcp_refcnt) != 0,
+	       "Cannot hold a dead port.");
+	atomic_increment64(&ipcp->ipcp_refcnt);
+}
+
+static struct ipc_port *
+ipc_port_lookup(ipc_port_t port)
+{
+	struct ipc_port *ipcp;
+
+	ipcp = ipc_port_find(port);
 	if (ipcp != NULL) {
 		IPC_PORT_LOCK(ipcp);
 		return (ipcp);
@@ -654,6 +986,503 @@ ipc_port_lookup(ipc_port_t port)
 	return (NULL);
 }
 
+/*
+ * Map the pages of a message into the receiving task at consecutive addresses.
+ * On failure, the pages are released.
+ */
+static int
+ipc_port_map_pages(struct task *task, struct ipc_message *ipcmsg, vaddr_t *vaddrp)
+{
+	struct vm_page **pages, *page;
+	unsigned i, npages;
+	vaddr_t vaddr;
+	struct vm *vm;
+	int error, error2;
+
+	pages = ipcmsg->ipcmsg_pages;
+	npages = ipcmsg->ipcmsg_npages;
+
+	if ((task->t_flags & TASK_KERNEL) == 0) {
+		vm = task->t_vm;
+	} else {
+		vm = &kernel_vm;
+
+		/*
+		 * The kernel cannot map pages copy-on-write, so shared
+		 * pages have to be copied now.
+		 */
+		for (i = 0; i < npages; i++) {
+			if (!page_shared(pages[i]))
+				continue;
+			error = page_copy(pages[i], &page);
+			page_release(pages[i]);
+			if (error != 0) {
+				ipc_port_pages_release(pages, i);
+				ipc_port_pages_release(pages + i + 1,
+						       npages - (i + 1));
+				return (error);
+			}
+			pages[i] = page;
+		}
+
+		if (npages == 1) {
+			error = page_map_direct(vm, pages[0], vaddrp);
+			if (error != 0) {
+				page_release(pages[0]);
+				return (error);
+			}
+			return (0);
+		}
+	}
+
+	error = vm_alloc_address(vm, &vaddr, npages, false);
+	if (error != 0) {
+		ipc_port_pages_release(pages, npages);
+		return (error);
+	}
+
+	for (i = 0; i < npages; i++) {
+		/*
+		 * A page sent by ipc_port_send_copy may still be mapped by the
+		 * sender, in which case we share it copy-on-write rather than
+		 * copying it here.
+		 */
+		if (page_shared(pages[i]))
+			error = page_map_cow(vm, vaddr + i * PAGE_SIZE, pages[i]);
+		else
+			error = page_map(vm, vaddr + i * PAGE_SIZE, pages[i]);
+		if (error != 0)
+			break;
+	}
+	if (error != 0) {
+		while (i-- != 0) {
+			error2 = page_unmap(vm, vaddr + i * PAGE_SIZE, pages[i]);
+			if (error2 != 0)
+				panic("%s: page_unmap failed: %m", __func__, error2);
+		}
+		error2 = vm_free_address(vm, vaddr);
+		if (error2 != 0)
+			panic("%s: vm_free_address failed: %m", __func__, error2);
+		ipc_port_pages_release(pages, npages);
+		return (error);
+	}
+
+	*vaddrp = vaddr;
+	return (0);
+}
+
+/*
+ * Queue a message from the IPC code itself, which needs no rights.  The
+ * message is freed if its destination is gone.
+ */
+static void
+ipc_port_notify(struct ipc_message *ipcmsg)
+{
+	struct ipc_port *ipcp;
+
+	IPC_PORTS_RLOCK();
+	ipcp = ipc_port_find(ipcmsg->ipcmsg_header.ipchdr_dst);
+	if (ipcp == NULL) {
+		IPC_PORTS_RUNLOCK();
+		free(ipcmsg);
+		return;
+	}
+	ipc_port_hold(ipcp);
+	IPC_PORTS_RUNLOCK();
+
+	ipc_trace_message(IPC_TRACE_SEND, &ipcmsg->ipcmsg_header);
+	if (ipc_port_enqueue(ipcp, ipcmsg)) {
+		IPC_PORT_LOCK(ipcp);
+		cv_signal(ipcp->ipcp_cv);
+		IPC_PORT_UNLOCK(ipcp);
+	}
+	ipc_port_release(ipcp);
+}
+
+/*
+ * Pick a port number from this CPU's block, taking a new block when it runs
+ * out.  The number may be reserved or still in use, which the caller checks.
+ */
+static ipc_port_t
+ipc_port_number(void)
+{
+	struct ipc_port_block *ipcpb;
+	uint64_t block;
+	ipc_port_t port;
+
+	critical_enter();
+	ipcpb = &ipc_port_blocks[mp_whoami()];
+	if (ipcpb->ipcpb_next == ipcpb->ipcpb_end) {
+		do {
+			block = atomic_load64(&ipc_port_block_next);
+		} while (!atomic_cmpset64(&ipc_port_block_next, block,
+					  block + 1));
+		/*
+		 * Numbers wrap, and the last block's end with them.
+		 */
+		ipcpb->ipcpb_next = (ipc_port_t)(block * IPC_PORT_BLOCK_SIZE);
+		ipcpb->ipcpb_end = ipcpb->ipcpb_next + IPC_PORT_BLOCK_SIZE;
+	}
+	port = ipcpb->ipcpb_next++;
+	critical_exit();
+
+	return (port);
+}
+
+/*
+ * Share a page with the receiver copy-on-write, leaving the sender's mapping.
+ */
+static int
+ipc_port_page_copy(struct task *task, vaddr_t vaddr, struct vm_page **pagep)
+{
+	int error;
+
+	if ((task->t_flags & TASK_KERNEL) == 0) {
+		error = page_share(task->t_vm, vaddr, pagep);
+		if (error != 0)
+			return (error);
+	} else {
+		/*
+		 * Kernel pages are direct-mapped and can't be made
+		 * copy-on-write, so just copy them.
+		 */
+		error = page_clone(&kernel_vm, vaddr, pagep);
+		if (error != 0)
+			return (error);
+	}
+	return (0);
+}
+
+/*
+ * Once a moved page has been sent, free its address in the sender.  Only this
+ * page is taken out of the sender's allocation, which may need a map to be
+ * split; if there is no memory for that, the address is just left allocated,
+ * and will fault in a fresh page if it is touched again.
+ */
+static void
+ipc_port_page_free_address(struct task *task, vaddr_t vaddr)
+{
+	struct vm *vm;
+	int error;
+
+	if ((task->t_flags & TASK_KERNEL) != 0)
+		return;
+	vm = task->t_vm;
+
+	error = vm_map_remove(vm, vaddr, vaddr + PAGE_SIZE);
+	if (error != 0 && error != ERROR_NOT_FOUND) {
+		if (error != ERROR_EXHAUSTED)
+			panic("%s: vm_map_remove failed: %m", __func__, error);
+		return;
+	}
+	error = vm_free_range(vm, vaddr, vaddr + PAGE_SIZE);
+	if (error != 0 && error != ERROR_EXHAUSTED)
+		panic("%s: could not free source page address: %m", __func__, error);
+}
+
+/*
+ * Take a page away from the sender to be given to the receiver.  Its address
+ * stays allocated until the page has been sent.
+ */
+static int
+ipc_port_page_move(struct task *task, vaddr_t vaddr, struct vm_page **pagep)
+{
+	struct vm_page *page;
+	struct vm *vm;
+	int error;
+
+	if ((task->t_flags & TASK_KERNEL) == 0)
+		vm = task->t_vm;
+	else
+		vm = &kernel_vm;
+	error = page_extract(vm, vaddr, &page);
+	if (error == ERROR_NOT_FOUND && vm != &kernel_vm) {
+		/* The page may not have been touched yet.  */
+		error = vm_fault(vm, vaddr);
+		if (error == 0)
+			error = page_extract(vm, vaddr, &page);
+	}
+	if (error != 0)
+		return (error);
+	if (vm == &kernel_vm) {
+		error = page_unmap_direct(vm, page, vaddr);
+		if (error != 0)
+			panic("%s: could not unmap direct page: %m", __func__, error);
+	} else {
+		error = page_unmap(vm, vaddr, page);
+		if (error != 0)
+			panic("%s: could not unmap source page: %m", __func__, error);
+	}
+	*pagep = page;
+	return (0);
+}
+
+/*
+ * Give a moved page back to the sender if it could not be sent.  Kernel pages
+ * are direct-mapped, and come back at the address they had.
+ */
+static void
+ipc_port_page_restore(struct task *task, vaddr_t vaddr, struct vm_page *page)
+{
+	vaddr_t dvaddr;
+	int error;
+
+	if ((task->t_flags & TASK_KERNEL) != 0) {
+		error = page_map_direct(&kernel_vm, page, &dvaddr);
+		if (error != 0)
+			panic("%s: page_map_direct failed: %m", __func__, error);
+		ASSERT(dvaddr == vaddr, "Direct map must be deterministic.");
+		return;
+	}
+
+	/*
+	 * If the page can't be mapped back, it is lost, and the address will
+	 * fault in a fresh page.
+	 */
+	error = page_map(task->t_vm, vaddr, page);
+	if (error != 0) {
+		printf("%s: page_map failed: %m\n", __func__, error);
+		page_release(page);
+	}
+}
+
+static void
+ipc_port_pages_release(struct vm_page **pages, unsigned npages)
+{
+	unsigned i;
+
+	for (i = 0; i < npages; i++)
+		page_release(pages[i]);
+}
+
+static bool
+ipc_port_pending(struct ipc_port *ipcp)
+{
+	IPC_PORT_ASSERT_LOCKED(ipcp);
+
+	return (ipcp->ipcp_ready != NULL ||
+		atomic_load64(&ipcp->ipcp_incoming) != 0);
+}
+
+/*
+ * Place the pages of a message in the receiver's buffer.  If they don't fit
+ * there, ERROR_FULL is returned and the pages are left in the message to be
+ * mapped elsewhere; on any other failure, the pages not yet placed are
+ * released.  The receiver's address space is locked from the check until the
+ * pages are in place, so that other threads can't change what is there.
+ */
+static int
+ipc_port_place_pages(struct task *task, struct ipc_message *ipcmsg, vaddr_t buf,
+		     size_t buflen)
+{
+	struct vm_page **pages, *page;
+	unsigned i, npages;
+	vaddr_t vaddr;
+	struct vm *vm;
+	int error;
+
+	pages = ipcmsg->ipcmsg_pages;
+	npages = ipcmsg->ipcmsg_npages;
+
+	if ((task->t_flags & TASK_KERNEL) != 0) {
+		if (!ipc_port_buffer_check(task, buf, buflen, npages))
+			return (ERROR_FULL);
+		for (i = 0; i < npages; i++) {
+			error = page_map_direct(&kernel_vm, pages[i], &vaddr);
+			if (error != 0)
+				panic("%s: page_map_direct failed: %m", __func__, error);
+			memcpy((void *)(buf + i * PAGE_SIZE), (void *)vaddr, PAGE_SIZE);
+			error = page_unmap_direct(&kernel_vm, pages[i], vaddr);
+			if (error != 0)
+				panic("%s: page_unmap_direct failed: %m", __func__, error);
+		}
+		ipc_port_pages_release(pages, npages);
+		return (0);
+	}
+
+	vm = task->t_vm;
+	VM_SLOCK(vm);
+	if (!ipc_port_buffer_check(task, buf, buflen, npages)) {
+		VM_SUNLOCK(vm);
+		return (ERROR_FULL);
+	}
+	for (i = 0; i < npages; i++) {
+		vaddr = buf + i * PAGE_SIZE;
+
+		error = page_extract(vm, vaddr, &page);
+		if (error == 0) {
+			error = page_unmap(vm, vaddr, page);
+			if (error != 0)
+				panic("%s: page_unmap failed: %m", __func__, error);
+			page_recycle(vm, page);
+		} else if (error != ERROR_NOT_FOUND) {
+			panic("%s: page_extract failed: %m", __func__, error);
+		}
+
+		if (page_shared(pages[i]))
+			error = page_map_cow(vm, vaddr, pages[i]);
+		else
+			error = page_map(vm, vaddr, pages[i]);
+		if (error != 0) {
+			VM_SUNLOCK(vm);
+			ipc_port_pages_release(pages + i, npages - i);
+			return (error);
+		}
+	}
+	VM_SUNLOCK(vm);
+
+	return (0);
+}
+
+/*
+ * XXX
+ * receive could take a task-local port number like a fd and speed lookup and
+ * minimize locking.
+ */
+static int
+ipc_port_receive_message(ipc_port_t port, struct ipc_header *ipch, void *data,
+			 size_t *datalenp, void *buf, size_t buflen,
+			 void **vpagep)
+{
+	struct ipc_message *ipcmsg;
+	struct ipc_port *ipcp;
+	struct vm_page *page;
+	struct task *task;
+	vaddr_t vaddr;
+	int error;
+
+	task = current_task();
+
+	ASSERT(task != NULL, "Must have a running task.");
+	ASSERT(ipch != NULL, "Must be able to copy out header.");
+
+	IPC_PORTS_RLOCK();
+	ipcp = ipc_port_lookup(port);
+	if (ipcp == NULL) {
+		IPC_PORTS_RUNLOCK();
+		return (ERROR_NOT_FOUND);
+	}
+	IPC_PORTS_RUNLOCK();
+
+	if (!ipc_port_right_check(ipcp, task, IPC_PORT_RIGHT_RECEIVE)) {
+		IPC_PORT_UNLOCK(ipcp);
+		return (ERROR_NO_RIGHT);
+	}
+
+	ipcmsg = ipc_port_dequeue(ipcp);
+	if (ipcmsg == NULL) {
+		IPC_PORT_UNLOCK(ipcp);
+		return (ERROR_AGAIN);
+	}
+	ASSERT(ipcmsg->ipcmsg_header.ipchdr_dst == ipcp->ipcp_port,
+	       "Destination must be this port.");
+	ASSERT(ipcmsg->ipcmsg_datalen == 0 || ipcmsg->ipcmsg_npages == 0,
+	       "Message cannot have both inline data and pages.");
+	ipc_trace_message(IPC_TRACE_RECEIVE, &ipcmsg->ipcmsg_header);
+
+	/*
+	 * Senders only wake a receiver when the queue goes from empty to
+	 * non-empty, so pass the wakeup on if there is more to do.
+	 */
+	if (ipc_port_pending(ipcp))
+		cv_signal(ipcp->ipcp_cv);
+	IPC_PORT_UNLOCK(ipcp);
+
+	/*
+	 * Insert any passed rights.
+	 */
+	if (ipcmsg->ipcmsg_header.ipchdr_right != IPC_PORT_RIGHT_NONE) {
+		/*
+		 * If the source port has died, or is dying, since the message
+		 * was sent, there is nothing to grant a right on.
+		 */
+		IPC_PORTS_RLOCK();
+		ipcp = ipc_port_lookup(ipcmsg->ipcmsg_header.ipchdr_src);
+		IPC_PORTS_RUNLOCK();
+		if (ipcp != NULL) {
+			error = ipc_port_right_insert(ipcp, task, ipcmsg->ipcmsg_header.ipchdr_right);
+			if (error != 0 && error != ERROR_NOT_FOUND)
+				panic("%s: grating rights failed: %m", __func__,
+				      error);
+			IPC_PORT_UNLOCK(ipcp);
+		}
+	}
+
+	if (datalenp != NULL)
+		*datalenp = ipcmsg->ipcmsg_datalen;
+
+	if (ipcmsg->ipcmsg_datalen != 0) {
+		if (data != NULL) {
+			memcpy(data, ipcmsg->ipcmsg_data, ipcmsg->ipcmsg_datalen);
+		} else if (vpagep != NULL) {
+			/*
+			 * The receiver wants a page, so give it one, just as
+			 * if the data had been sent that way.
+			 */
+			if ((task->t_flags & TASK_KERNEL) == 0)
+				error = page_alloc_vm(task->t_vm, PAGE_FLAG_ZERO, &page);
+			else
+				error = page_alloc(PAGE_FLAG_ZERO, &page);
+			if (error != 0) {
+				free(ipcmsg);
+				return (error);
+			}
+			error = page_map_direct(&kernel_vm, page, &vaddr);
+			if (error != 0)
+				panic("%s: page_map_direct failed: %m", __func__, error);
+			memcpy((void *)vaddr, ipcmsg->ipcmsg_data, ipcmsg->ipcmsg_datalen);
+			error = page_unmap_direct(&kernel_vm, page, vaddr);
+			if (error != 0)
+				panic("%s: page_unmap_direct failed: %m", __func__, error);
+			ipcmsg->ipcmsg_pages[0] = page;
+			ipcmsg->ipcmsg_npages = 1;
+		}
+	}
+
+	if (ipcmsg->ipcmsg_npages == 0) {
+		if (vpagep != NULL)
+			*vpagep = NULL;
+	} else {
+		if (vpagep == NULL) {
+			/*
+			 * A task may refuse a page flip for any number of reasons.
+			 */
+			ipc_port_pages_release(ipcmsg->ipcmsg_pages,
+					       ipcmsg->ipcmsg_npages);
+			ipcmsg->ipcmsg_npages = 0;
+		} else {
+			/*
+			 * Pages go in the receiver's buffer if they fit there,
+			 * or wherever there is room if not.
+			 */
+			error = ERROR_FULL;
+			if (buf != NULL)
+				error = ipc_port_place_pages(task, ipcmsg,
+							     (vaddr_t)buf, buflen);
+			if (error == 0) {
+				*vpagep = buf;
+			} else if (error == ERROR_FULL) {
+				error = ipc_port_map_pages(task, ipcmsg, &vaddr);
+				if (error != 0) {
+					free(ipcmsg);
+					return (error);
+				}
+				*vpagep = (void *)vaddr;
+			} else {
+				free(ipcmsg);
+				return (error);
+			}
+		}
+	}
+
+	ipcmsg->ipcmsg_header.ipchdr_npages = ipcmsg->ipcmsg_npages;
+	*ipch = ipcmsg->ipcmsg_header;
+
+	free(ipcmsg);
+
+	return (0);
+}
+
 static int
 ipc_port_register(struct ipc_port *ipcp, ipc_port_t port, ipc_port_flags_t flags)
 {
@@ -680,6 +1509,149 @@ ipc_port_register(struct ipc_port *ipcp, ipc_port_t port, ipc_port_flags_t flags
 	return (0);
 }
 
+static void
+ipc_port_release(struct ipc_port *ipcp)
+{
+	uint64_t refcnt;
+
+	for (;;) {
+		refcnt = atomic_load64(&ipcp->ipcp_refcnt);
+		ASSERT(refcnt != 0, "Cannot release a dead port.");
+		if (atomic_cmpset64(&ipcp->ipcp_refcnt, refcnt, refcnt - 1))
+			break;
+	}
+
+	/*
+	 * The last reference can't be the table's, since the port has to
+	 * be out of the table for it to go, so nobody can look it up again.
+	 */
+	if (refcnt == 1)
+		ipc_port_free(ipcp);
+}
+
+static int
+ipc_port_send_message(const struct ipc_header *ipch, struct vm_page **pages,
+		      unsigned npages, const void *data, size_t datalen)
+{
+	struct ipc_message *ipcmsg;
+	struct ipc_port *ipcp;
+	struct task *task;
+
+	task = current_task();
+
+	ASSERT(task != NULL, "Must have a running task.");
+	ASSERT(ipch != NULL, "Must have a header.");
+
+	/*
+	 * A message of IPC_MSG_NONE may always be sent to any port by any
+	 * port, may not contain any data, and may be used to grant rights.
+	 *
+	 * XXX There is probably a DoS in allowing rights to be inserted
+	 *     for arbitrary tasks, but it's limited to the number of ports,
+	 *     so clamping that value for untrusted tasks is probably a fine
+	 *     compromise for now.
+	 */
+	if (ipch->ipchdr_msg == IPC_MSG_NONE && (npages != 0 || datalen != 0))
+		return (ERROR_INVALID);
+
+	ASSERT(npages == 0 || datalen == 0,
+	       "Cannot send both inline data and pages.");
+	ASSERT(npages <= IPC_DATA_PAGES_MAX, "Too many pages.");
+	ASSERT(datalen <= IPC_DATA_INLINE_MAX, "Inline data too long.");
+
+	IPC_PORTS_RLOCK();
+
+	/*
+	 * Step 1:
+	 * Check that the sending task has a receive right on the source port.
+	 */
+	ipcp = ipc_port_lookup(ipch->ipchdr_src);
+	if (ipcp == NULL) {
+		IPC_PORTS_RUNLOCK();
+		return (ERROR_INVALID);
+	}
+
+	if (!ipc_port_right_check(ipcp, task, IPC_PORT_RIGHT_RECEIVE)) {
+		IPC_PORT_UNLOCK(ipcp);
+		IPC_PORTS_RUNLOCK();
+		return (ERROR_NO_RIGHT);
+	}
+	IPC_PORT_UNLOCK(ipcp);
+
+	/*
+	 * Step 2:
+	 * Check that the sending task has a send right on the destination port
+	 * unless the destination port is providing a public service or a knock
+	 * message is being sent.
+	 */
+	ipcp = ipc_port_find(ipch->ipchdr_dst);
+	if (ipcp == NULL) {
+		IPC_PORTS_RUNLOCK();
+		return (ERROR_NOT_FOUND);
+	}
+	ipc_port_hold(ipcp);
+	IPC_PORTS_RUNLOCK();
+
+	/*
+	 * Port flags do not change once a port is registered, so senders to a
+	 * public port need not take its lock at all.
+	 */
+	if ((ipcp->ipcp_flags & IPC_PORT_FLAG_PUBLIC) == 0 &&
+	    ipch->ipchdr_msg != IPC_MSG_NONE) {
+		IPC_PORT_LOCK(ipcp);
+		if (!ipc_port_right_check(ipcp, task, IPC_PORT_RIGHT_SEND)) {
+			IPC_PORT_UNLOCK(ipcp);
+			ipc_port_release(ipcp);
+			return (ERROR_NO_RIGHT);
+		}
+		IPC_PORT_UNLOCK(ipcp);
+	}
+
+	ipcmsg = malloc(sizeof *ipcmsg);
+	ipcmsg->ipcmsg_header = *ipch;
+	ipcmsg->ipcmsg_npages = npages;
+	if (npages != 0)
+		memcpy(ipcmsg->ipcmsg_pages, pages, npages * sizeof pages[0]);
+	ipcmsg->ipcmsg_datalen = datalen;
+	if (datalen != 0)
+		memcpy(ipcmsg->ipcmsg_data, data, datalen);
+
+	/*
+	 * Step 3:
+	 * Queue the message.  A receiver can only be asleep if the queue was
+	 * empty, and since receivers check for messages with the port lock
+	 * held, taking it here is enough to be sure the wakeup is not lost.
+	 */
+	ipc_trace_message(IPC_TRACE_SEND, ipch);
+	if (ipc_port_enqueue(ipcp, ipcmsg)) {
+		IPC_PORT_LOCK(ipcp);
+		cv_signal(ipcp->ipcp_cv);
+		IPC_PORT_UNLOCK(ipcp);
+	}
+	ipc_port_release(ipcp);
+
+	return (0);
+}
+
+/*
+ * Undo the first npages entries of a vector which could not be sent, giving
+ * moved pages back to the sender and dropping copies.
+ */
+static void
+ipc_port_vector_undo(struct task *task, const struct ipc_page_vector *ipcpv,
+		     struct vm_page **pages, unsigned npages)
+{
+	unsigned i;
+
+	for (i = 0; i < npages; i++) {
+		if (ipcpv[i].ipcpv_flags == IPC_PAGE_FLAG_MOVE)
+			ipc_port_page_restore(task, (vaddr_t)ipcpv[i].ipcpv_page,
+					      pages[i]);
+		else
+			page_release(pages[i]);
+	}
+}
+
 static bool
 ipc_port_right_check(struct ipc_port *ipcp, struct task *task, ipc_port_right_t right)
 {
@@ -710,31 +1682,50 @@ ipc_port_right_check(struct ipc_port *ipcp, struct task *task, ipc_port_right_t
 		return (false);
 
 	/*
-	 * If there is a send right, use it.
+	 * If there is a send-once right, consume it, even if there is a send
+	 * right too; the message is most likely the reply it was given for,
+	 * and a reply port which is used over and over must not pick up a
+	 * right that is never used.
 	 */
-	if ((ipcpr->ipcpr_right & IPC_PORT_RIGHT_SEND) != 0)
+	if ((ipcpr->ipcpr_right & IPC_PORT_RIGHT_SEND_ONCE) != 0) {
+		ipcpr->ipcpr_send_once_refs--;
+		if (ipcpr->ipcpr_send_once_refs == 0)
+			ipcpr->ipcpr_right &= ~IPC_PORT_RIGHT_SEND_ONCE;
+		/*
+		 * If that was the last right, free it.
+		 */
+		if (ipcpr->ipcpr_right == IPC_PORT_RIGHT_NONE)
+			ipc_port_right_free(ipcp, ipcpr);
 		return (true);
+	}
 
 	/*
-	 * If there is a send-once right, consume it.
+	 * If there is a send right, use it.
 	 */
-	if ((ipcpr->ipcpr_right & IPC_PORT_RIGHT_SEND_ONCE) != 0) {
-		if (ipcpr->ipcpr_right == IPC_PORT_RIGHT_SEND_ONCE) {
-			/*
-			 * If there is only a send-once right, remove
-			 * this right and free it.
-			 * XXX TODO XXX
-			 */
-			ipcpr->ipcpr_right &= ~IPC_PORT_RIGHT_SEND_ONCE;
-		} else {
-			ipcpr->ipcpr_right &= ~IPC_PORT_RIGHT_SEND_ONCE;
-		}
+	if ((ipcpr->ipcpr_right & IPC_PORT_RIGHT_SEND) != 0)
 		return (true);
-	}
 
 	return (false);
 }
 
+static void
+ipc_port_right_free(struct ipc_port *ipcp, struct ipc_port_right *ipcpr)
+{
+	struct ipc_task *ipct = &ipcpr->ipcpr_task->t_ipc;
+	struct ipc_port_right *iter;
+
+	IPC_PORT_ASSERT_LOCKED(ipcp);
+
+	BTREE_REMOVE(ipcpr, iter, &ipcp->ipcp_rights, ipcpr_node);
+
+	IPC_TASK_LOCK(ipct);
+	STAILQ_REMOVE(&ipct->ipct_rights, ipcpr, struct ipc_port_right,
+		      ipcpr_link);
+	IPC_TASK_UNLOCK(ipct);
+
+	pool_free(ipcpr);
+}
+
 static int
 ipc_port_right_insert(struct ipc_port *ipcp, struct task *task, ipc_port_right_t right)
 {
@@ -749,27 +1740,49 @@ ipc_port_right_insert(struct ipc_port *ipcp, struct task *task, ipc_port_right_t
 			return (0);
 	}
 
+	/*
+	 * A registered port with no receivers is about to be destroyed, and
+	 * must not be given a new one.
+	 */
+	if ((right & IPC_PORT_RIGHT_RECEIVE) != 0 &&
+	    (ipcp->ipcp_flags & IPC_PORT_FLAG_NEW) == 0 &&
+	    ipcp->ipcp_receivers == 0)
+		return (ERROR_NOT_FOUND);
+
 	ipcpr = ipc_port_right_lookup(ipcp, task);
-	if (ipcpr != NULL) {
+	if (ipcpr == NULL) {
 		/*
-		 * XXX
-		 * This logic is not quite right, I guess.
+		 * We've been asked to create an absent right.
 		 */
-		ipcpr->ipcpr_right |= right;
-		return (0);
+		ipcpr = pool_allocate(&ipc_port_right_pool);
+		ipcpr->ipcpr_port = ipcp;
+		ipcpr->ipcpr_task = task;
+		ipcpr->ipcpr_right = IPC_PORT_RIGHT_NONE;
+		ipcpr->ipcpr_send_refs = 0;
+		ipcpr->ipcpr_send_once_refs = 0;
+		ipcpr->ipcpr_notify = IPC_PORT_UNKNOWN;
+		BTREE_NODE_INIT(&ipcpr->ipcpr_node);
+
+		BTREE_INSERT(ipcpr, iter, &ipcp->ipcp_rights, ipcpr_node,
+			     (ipcpr->ipcpr_task < iter->ipcpr_task));
+		IPC_TASK_LOCK(&task->t_ipc);
+		STAILQ_INSERT_TAIL(&task->t_ipc.ipct_rights, ipcpr, ipcpr_link);
+		IPC_TASK_UNLOCK(&task->t_ipc);
 	}
 
 	/*
-	 * We've been asked to create an absent right.
+	 * Rights other than receive rights are counted: each send right given
+	 * must be dropped, and each send-once right is good for one reply, so
+	 * that a task holding several requests can reply to all of them.
 	 */
-	ipcpr = pool_allocate(&ipc_port_right_pool);
-	ipcpr->ipcpr_task = task;
-	ipcpr->ipcpr_right = right;
-	BTREE_NODE_INIT(&ipcpr->ipcpr_node);
-
-	BTREE_INSERT(ipcpr, iter, &ipcp->ipcp_rights, ipcpr_node,
-		     (ipcpr->ipcpr_task < iter->ipcpr_task));
-	STAILQ_INSERT_TAIL(&task->t_ipc.ipct_rights, ipcpr, ipcpr_link);
+	if ((right & IPC_PORT_RIGHT_SEND) != 0)
+		ipcpr->ipcpr_send_refs++;
+	if ((right & IPC_PORT_RIGHT_SEND_ONCE) != 0)
+		ipcpr->ipcpr_send_once_refs++;
+	if ((right & IPC_PORT_RIGHT_RECEIVE) != 0 &&
+	    (ipcpr->ipcpr_right & IPC_PORT_RIGHT_RECEIVE) == 0)
+		ipcp->ipcp_receivers++;
+	ipcpr->ipcpr_right |= right;
 
 	return (0);
 }
@@ -792,15 +1805,25 @@ ipc_port_right_remove(struct ipc_port *ipcp, struct task *task, ipc_port_right_t
 	ipcpr = ipc_port_right_lookup(ipcp, task);
 	if (ipcpr == NULL)
 		return (ERROR_NO_RIGHT);
+	if ((ipcpr->ipcpr_right & right) != right)
+		return (ERROR_NO_RIGHT);
 
-	/* XXX
-	 * The logic here is wrong.
-	 * XXX TODO XXX
-	 * Decrement receive right count?
-	 * Handle send-once dropping?
-	 * Free!
-	 */
+	if ((right & IPC_PORT_RIGHT_SEND) != 0) {
+		ipcpr->ipcpr_send_refs--;
+		if (ipcpr->ipcpr_send_refs != 0)
+			right &= ~IPC_PORT_RIGHT_SEND;
+	}
+	if ((right & IPC_PORT_RIGHT_SEND_ONCE) != 0) {
+		ipcpr->ipcpr_send_once_refs--;
+		if (ipcpr->ipcpr_send_once_refs != 0)
+			right &= ~IPC_PORT_RIGHT_SEND_ONCE;
+	}
+	if ((right & IPC_PORT_RIGHT_RECEIVE) != 0)
+		ipcp->ipcp_receivers--;
 	ipcpr->ipcpr_right &= ~right;
 
+	if (ipcpr->ipcpr_right == IPC_PORT_RIGHT_NONE)
+		ipc_port_right_free(ipcp, ipcpr);
+
 	return (0);
 }
@@ -2,6 +2,7 @@
 #include <core/cv.h>
 #include <core/error.h>
 #include <core/malloc.h>
+#include <core/mp.h>
 #include <core/mutex.h>
 #include <core/pool.h>
 #include <core/queue.h>
@@ -15,6 +16,7 @@
 #include <ipc/service.h>
 #include <ns/ns.h>
 #include <vm/vm.h>
+#include <vm/vm_alloc.h>
 #include <vm/vm_page.h>
 
 #if defined(VERBOSE) && 0
@@ -28,7 +30,9 @@
  * putting them in a pool.  If the balance shifts (e.g. to one service per
  * device), a pool may be appropriate.
  *
- * Support for multiple threads would be nice.
+ * All of a service's threads are in one task and receive from the same port.
+ * The first thread registers the service with the NS, if it is public, before
+ * any of the others are started, so that they can't take the NS's reply.
  */
 
 struct ipc_service_context {
@@ -38,22 +42,30 @@ struct ipc_service_context {
 	ipc_port_t ipcsc_port;
 	ipc_port_flags_t ipcsc_port_flags;
 	struct task *ipcsc_task;
-	struct thread *ipcsc_thread;
+	unsigned ipcsc_nthreads;
+	struct thread **ipcsc_threads;
+	uint64_t ipcsc_running;		/* Threads yet to exit.  */
 };
 
 #ifdef SERVICE_TRACING
 static void ipc_service_dump(const struct ipc_service_context *, const struct ipc_header *);
 #endif
+static void ipc_service_exit(struct ipc_service_context *, vaddr_t) __noreturn;
 static void ipc_service_main(struct thread *, void *);
 
 int
 ipc_service(const char *name, ipc_port_t port, ipc_port_flags_t flags,
-	    ipc_service_t *handler, void *arg)
+	    unsigned nthreads, ipc_service_t *handler, void *arg)
 {
 	struct ipc_service_context *ipcsc;
-	bool allocated;
+	bool allocated, percpu;
+	unsigned i;
 	int error;
 
+	percpu = nthreads == IPC_SERVICE_THREADS_PERCPU;
+	if (percpu)
+		nthreads = mp_ncpus();
+
 	ipcsc = malloc(sizeof *ipcsc);
 	ipcsc->ipcsc_name = name;
 	ipcsc->ipcsc_handler = handler;
@@ -61,16 +73,25 @@ ipc_service(const char *name, ipc_port_t port, ipc_port_flags_t flags,
 	ipcsc->ipcsc_port = port;
 	ipcsc->ipcsc_port_flags = flags;
 	ipcsc->ipcsc_task = NULL;
-	ipcsc->ipcsc_thread = NULL;
+	ipcsc->ipcsc_nthreads = nthreads;
+	ipcsc->ipcsc_threads = malloc(nthreads * sizeof ipcsc->ipcsc_threads[0]);
+	ipcsc->ipcsc_running = nthreads;
 
 	error = task_create(IPC_PORT_UNKNOWN, &ipcsc->ipcsc_task, ipcsc->ipcsc_name, TASK_KERNEL);
 	if (error != 0)
 		panic("%s: task_create failed: %m", __func__, error);
 
-	error = thread_create(&ipcsc->ipcsc_thread, ipcsc->ipcsc_task,
-			      "ipc service", THREAD_DEFAULT);
-	if (error != 0)
-		panic("%s: thread_create failed: %m", __func__, error);
+	for (i = 0; i < nthreads; i++) {
+		error = thread_create(&ipcsc->ipcsc_threads[i],
+				      ipcsc->ipcsc_task, "ipc service",
+				      THREAD_DEFAULT);
+		if (error != 0)
+			panic("%s: thread_create failed: %m", __func__, error);
+		if (percpu)
+			scheduler_cpu_bind(ipcsc->ipcsc_threads[i], i);
+		thread_set_upcall(ipcsc->ipcsc_threads[i], ipc_service_main,
+				  ipcsc);
+	}
 
 	if ((flags & IPC_PORT_FLAG_NEW) != 0) {
 		flags &= ~IPC_PORT_FLAG_NEW;
@@ -111,9 +132,7 @@ ipc_service(const char *name, ipc_port_t port, ipc_port_flags_t flags,
 			panic("%s: ipc_port_right_drop failed: %m", __func__, error);
 	}
 
-	thread_set_upcall(ipcsc->ipcsc_thread, ipc_service_main, ipcsc);
-
-	scheduler_thread_runnable(ipcsc->ipcsc_thread);
+	scheduler_thread_runnable(ipcsc->ipcsc_threads[0]);
 
 	return (0);
 }
@@ -131,18 +150,50 @@ ipc_service_dump(const struct ipc_service_context *ipcsc, const struct ipc_heade
 }
 #endif
 
+static void
+ipc_service_exit(struct ipc_service_context *ipcsc, vaddr_t buffer)
+{
+	uint64_t running;
+	int error;
+
+	if (buffer != 0) {
+		error = page_free_direct(&kernel_vm, buffer);
+		if (error != 0)
+			panic("%s: page_free_direct failed: %m", __func__,
+			      error);
+	}
+
+	/*
+	 * The last thread out frees the context.
+	 */
+	do {
+		running = atomic_load64(&ipcsc->ipcsc_running);
+	} while (!atomic_cmpset64(&ipcsc->ipcsc_running, running, running - 1));
+	if (running == 1) {
+		free(ipcsc->ipcsc_threads);
+		free(ipcsc);
+	}
+
+	/*
+	 * The task goes with its last thread, dropping any rights it has left.
+	 */
+	thread_exit();
+}
+
 static void
 ipc_service_main(struct thread *td, void *arg)
 {
 	struct ipc_service_context *ipcsc = arg;
 	struct ipc_header ipch;
+	size_t datalen;
+	vaddr_t buffer;
+	unsigned i;
 	int error;
 	void *p;
 
-	(void)td;
-
 	/* Register with the NS if requested.  */
-	if ((ipcsc->ipcsc_port_flags & IPC_PORT_FLAG_PUBLIC) != 0 &&
+	if (td == ipcsc->ipcsc_threads[0] &&
+	    (ipcsc->ipcsc_port_flags & IPC_PORT_FLAG_PUBLIC) != 0 &&
 	    ipcsc->ipcsc_port >= IPC_PORT_UNRESERVED_START) {
 		struct ns_register_request nsreq;
 
@@ -220,24 +271,59 @@ ipc_service_main(struct thread *td, void *arg)
 #endif
 	}
 
-	/* Receive real requests and responses.  */
+	/*
+	 * Now start the rest of the threads.
+	 */
+	if (td == ipcsc->ipcsc_threads[0]) {
+		for (i = 1; i < ipcsc->ipcsc_nthreads; i++)
+			scheduler_thread_runnable(ipcsc->ipcsc_threads[i]);
+	}
 
+	/*
+	 * Receive real requests and responses.
+	 *
+	 * Small messages are received into a page of our own, which handlers
+	 * see just as if it had been sent to us.  Only the bytes written by
+	 * each message need to be cleared afterwards, unless the handler takes
+	 * the page for itself, in which case we get a new one.
+	 */
+	buffer = 0;
 	for (;;) {
+		if (buffer == 0) {
+			error = page_alloc_direct(&kernel_vm, PAGE_FLAG_ZERO,
+						  &buffer);
+			if (error != 0)
+				panic("%s: page_alloc_direct failed: %m",
+				      __func__, error);
+		}
+
 #ifdef SERVICE_TRACING
 		printf("%s: waiting...\n", ipcsc->ipcsc_name);
 #endif
 
+		/*
+		 * The port goes away once a handler drops the last receive
+		 * right on it, and the service with it.
+		 */
 		error = ipc_port_wait(ipcsc->ipcsc_port);
-		if (error != 0)
+		if (error != 0) {
+			if (error == ERROR_NOT_FOUND)
+				ipc_service_exit(ipcsc, buffer);
 			panic("%s: ipc_port_wait failed: %m", __func__, error);
+		}
 
-		error = ipc_port_receive(ipcsc->ipcsc_port, &ipch, &p);
+		error = ipc_port_receive_data(ipcsc->ipcsc_port, &ipch,
+					      (void *)buffer, &datalen, &p);
 		if (error != 0) {
 			if (error == ERROR_AGAIN)
 				continue;
+			if (error == ERROR_NOT_FOUND)
+				ipc_service_exit(ipcsc, buffer);
 			panic("%s: ipc_port_receive failed: %m", __func__,
 			      error);
 		}
+		if (datalen != 0)
+			p = (void *)buffer;
 
 #ifdef SERVICE_TRACING
 		ipc_service_dump(ipcsc, &ipch);
@@ -250,10 +336,19 @@ ipc_service_main(struct thread *td, void *arg)
 		if (error != 0)
 			printf("%s: service handler failed: %m\n", __func__, error);
 
+		if (datalen != 0) {
+			if (p == NULL)
+				buffer = 0;
+			else
+				memset((void *)buffer, 0, datalen);
+			continue;
+		}
+
 		if (p != NULL) {
-			error = page_free_direct(&kernel_vm, (vaddr_t)p);
+			error = vm_free(&kernel_vm, ipch.ipchdr_npages * PAGE_SIZE,
+					(vaddr_t)p);
 			if (error != 0)
-				panic("%s: page_free_direct failed: %m", __func__, error);
+				panic("%s: vm_free failed: %m", __func__, error);
 		}
 	}
 }
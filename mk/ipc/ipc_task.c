@@ -11,9 +11,10 @@ void
 ipc_task_free(struct task *task)
 {
 	/*
-	 * XXX
-	 * Needs to be implemented.
+	 * Dropping its rights takes down any port the task was the last
+	 * receiver for, the task port among them.
 	 */
+	ipc_port_rights_drop(task);
 }
 
 int
@@ -22,6 +23,7 @@ ipc_task_setup(ipc_port_t parent, struct task *task)
 	struct ipc_task *ipct = &task->t_ipc;
 	int error;
 
+	spinlock_init(&ipct->ipct_lock, "IPC task", SPINLOCK_FLAG_DEFAULT);
 	STAILQ_INIT(&ipct->ipct_rights);
 
 	/*
@@ -0,0 +1,52 @@
+#include <core/types.h>
+#include <core/error.h>
+#include <core/task.h>
+#include <core/thread.h>
+#include <ipc/ipc.h>
+#include <ipc/port.h>
+#include <ipc/thread.h>
+
+void
+ipc_thread_free(struct thread *td)
+{
+	struct ipc_thread *ipctd = &td->td_ipc;
+	int error;
+
+	if (ipctd->ipctd_reply_port == IPC_PORT_UNKNOWN)
+		return;
+
+	/*
+	 * The task may have dropped the right already.
+	 */
+	error = ipc_port_right_revoke(td->td_task, ipctd->ipctd_reply_port,
+				      IPC_PORT_RIGHT_RECEIVE);
+	if (error != 0 && error != ERROR_NOT_FOUND && error != ERROR_NO_RIGHT)
+		panic("%s: ipc_port_right_revoke failed: %m", __func__, error);
+	ipctd->ipctd_reply_port = IPC_PORT_UNKNOWN;
+}
+
+int
+ipc_thread_reply_port(ipc_port_t *portp, ipc_cookie_t *cookiep)
+{
+	struct ipc_thread *ipctd = &current_thread()->td_ipc;
+	int error;
+
+	if (ipctd->ipctd_reply_port == IPC_PORT_UNKNOWN) {
+		error = ipc_port_allocate(&ipctd->ipctd_reply_port,
+					  IPC_PORT_FLAG_DEFAULT);
+		if (error != 0)
+			return (error);
+	}
+	*portp = ipctd->ipctd_reply_port;
+	*cookiep = ++ipctd->ipctd_sequence;
+	return (0);
+}
+
+void
+ipc_thread_setup(struct thread *td)
+{
+	struct ipc_thread *ipctd = &td->td_ipc;
+
+	ipctd->ipctd_reply_port = IPC_PORT_UNKNOWN;
+	ipctd->ipctd_sequence = 0;
+}
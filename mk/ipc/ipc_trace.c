@@ -0,0 +1,218 @@
+#include <core/types.h>
+#ifdef DB
+#include <db/db_command.h>
+#endif
+#include <core/console.h>
+#include <core/critical.h>
+#include <core/error.h>
+#include <core/mp.h>
+#include <core/startup.h>
+#include <core/string.h>
+#include <cpu/timestamp.h>
+#include <ipc/ipc.h>
+#include <ipc/port.h>
+#include <ipc/service.h>
+#include <ipc/trace.h>
+#include <vm/vm.h>
+#include <vm/vm_page.h>
+
+#ifdef DB
+DB_COMMAND_TREE(ipc, root, ipc);
+#endif
+
+/*
+ * Each ring is only written by its own CPU, in a critical section, so the
+ * only cost of recording an event is a few stores.  Readers on other CPUs
+ * find how many events have been recorded before and after copying a ring,
+ * and so which records may have been overwritten in the meantime.
+ */
+struct ipc_trace_ring {
+	uint64_t ipctrr_next;		/* Events recorded so far.  */
+	struct ipc_trace_record ipctrr_records[IPC_TRACE_RECORDS];
+};
+
+COMPILE_TIME_ASSERT(sizeof (struct ipc_trace_dump) <= PAGE_SIZE);
+
+static struct ipc_trace_ring ipc_trace_rings[MAXCPUS];
+
+static void ipc_trace_copy(cpu_id_t, struct ipc_trace_dump *);
+static void ipc_trace_event(unsigned, ipc_port_t, ipc_port_t, ipc_msg_t, ipc_cookie_t);
+static int ipc_trace_handler(void *, struct ipc_header *, void **);
+static void ipc_trace_startup(void *);
+
+void
+ipc_trace_message(unsigned event, const struct ipc_header *ipch)
+{
+	ipc_trace_event(event, ipch->ipchdr_src, ipch->ipchdr_dst,
+			ipch->ipchdr_msg, ipch->ipchdr_cookie);
+}
+
+void
+ipc_trace_wait(ipc_port_t port)
+{
+	ipc_trace_event(IPC_TRACE_WAIT, IPC_PORT_UNKNOWN, port, IPC_MSG_NONE, 0);
+}
+
+static void
+ipc_trace_copy(cpu_id_t cpu, struct ipc_trace_dump *dump)
+{
+	struct ipc_trace_ring *ring;
+	uint64_t after, before, first, i, lost;
+
+	ring = &ipc_trace_rings[cpu];
+
+	before = atomic_load64(&ring->ipctrr_next);
+	if (before > IPC_TRACE_RECORDS)
+		first = before - IPC_TRACE_RECORDS;
+	else
+		first = 0;
+	for (i = first; i < before; i++)
+		dump->ipctrd_records[i - first] =
+			ring->ipctrr_records[i % IPC_TRACE_RECORDS];
+	after = atomic_load64(&ring->ipctrr_next);
+
+	/*
+	 * The CPU may be part way through writing over the record
+	 * IPC_TRACE_RECORDS before the last it has finished.
+	 */
+	lost = 0;
+	if (after + 1 > first + IPC_TRACE_RECORDS)
+		lost = after + 1 - IPC_TRACE_RECORDS - first;
+	if (lost > before - first)
+		lost = before - first;
+	if (lost != 0)
+		memmove(&dump->ipctrd_records[0], &dump->ipctrd_records[lost],
+			(before - first - lost) * sizeof dump->ipctrd_records[0]);
+
+	dump->ipctrd_cpu = cpu;
+	dump->ipctrd_count = before - first - lost;
+	dump->ipctrd_total = after;
+}
+
+static void
+ipc_trace_event(unsigned event, ipc_port_t src, ipc_port_t dst, ipc_msg_t msg,
+		ipc_cookie_t cookie)
+{
+	struct ipc_trace_record *ipctr;
+	struct ipc_trace_ring *ring;
+	uint64_t next;
+
+	critical_enter();
+	ring = &ipc_trace_rings[mp_whoami()];
+	next = ring->ipctrr_next;
+	ipctr = &ring->ipctrr_records[next % IPC_TRACE_RECORDS];
+	ipctr->ipctr_timestamp = cpu_timestamp();
+	ipctr->ipctr_event = event;
+	ipctr->ipctr_msg = msg;
+	ipctr->ipctr_src = src;
+	ipctr->ipctr_dst = dst;
+	ipctr->ipctr_cookie = cookie;
+	atomic_store64(&ring->ipctrr_next, next + 1);
+	critical_exit();
+}
+
+/*
+ * XXX
+ * Any task may read the trace, which shows the ports and cookies of every
+ * other task's messages.
+ */
+static int
+ipc_trace_handler(void *arg, struct ipc_header *reqh, void **pagep)
+{
+	struct ipc_header ipch;
+	vaddr_t vaddr;
+	int error, error2;
+
+	if (reqh->ipchdr_msg != IPC_TRACE_MSG_DUMP) {
+		/* Don't respond to nonsense.  */
+		return (ERROR_INVALID);
+	}
+
+	if (pagep != NULL)
+		return (ERROR_INVALID);
+
+	/*
+	 * We must be given a reply right.
+	 */
+	if (reqh->ipchdr_right != IPC_PORT_RIGHT_SEND_ONCE)
+		return (ERROR_NO_RIGHT);
+
+	if (reqh->ipchdr_param >= MAXCPUS) {
+		error = ERROR_INVALID;
+	} else {
+		error = page_alloc_direct(&kernel_vm, PAGE_FLAG_ZERO, &vaddr);
+	}
+	if (error != 0) {
+		ipch = IPC_HEADER_ERROR(reqh, error);
+
+		error = ipc_port_send_data(&ipch, NULL, 0);
+		if (error != 0)
+			return (error);
+		return (0);
+	}
+
+	ipc_trace_copy(reqh->ipchdr_param, (struct ipc_trace_dump *)vaddr);
+
+	ipch = IPC_HEADER_REPLY(reqh);
+	ipch.ipchdr_param = sizeof (struct ipc_trace_dump);
+
+	error = ipc_port_send(&ipch, (void *)vaddr);
+	if (error != 0) {
+		error2 = page_free_direct(&kernel_vm, vaddr);
+		if (error2 != 0)
+			panic("%s: page_free_direct failed: %m", __func__,
+			      error2);
+		return (error);
+	}
+	return (0);
+}
+
+static void
+ipc_trace_startup(void *arg)
+{
+	int error;
+
+	error = ipc_service("ipc_trace", IPC_PORT_UNKNOWN,
+			    IPC_PORT_FLAG_PUBLIC | IPC_PORT_FLAG_NEW, 1,
+			    ipc_trace_handler, NULL);
+	if (error != 0)
+		panic("%s: ipc_service failed: %m", __func__, error);
+}
+STARTUP_ITEM(ipc_trace, STARTUP_SERVERS, STARTUP_FIRST, ipc_trace_startup, NULL);
+
+#ifdef DB
+static const char *ipc_trace_event_names[] = {
+	[IPC_TRACE_SEND] = "send",
+	[IPC_TRACE_RECEIVE] = "receive",
+	[IPC_TRACE_WAIT] = "wait",
+};
+
+static void
+db_ipc_trace_dump(void)
+{
+	static struct ipc_trace_dump dump;
+	const struct ipc_trace_record *ipctr;
+	cpu_id_t cpu;
+	unsigned i;
+
+	for (cpu = 0; cpu < MAXCPUS; cpu++) {
+		if (ipc_trace_rings[cpu].ipctrr_next == 0)
+			continue;
+		ipc_trace_copy(cpu, &dump);
+
+		printf("cpu%u: %lu events\n", dump.ipctrd_cpu,
+		       dump.ipctrd_total);
+		printf("%10s %-7s %8s %8s %4s %16s\n", "timestamp", "event",
+		       "src", "dst", "msg", "cookie");
+		for (i = 0; i < dump.ipctrd_count; i++) {
+			ipctr = &dump.ipctrd_records[i];
+			printf("%10u %-7s %8x %8x %4x %16lx\n",
+			       ipctr->ipctr_timestamp,
+			       ipc_trace_event_names[ipctr->ipctr_event],
+			       ipctr->ipctr_src, ipctr->ipctr_dst,
+			       ipctr->ipctr_msg, ipctr->ipctr_cookie);
+		}
+	}
+}
+DB_COMMAND(trace, ipc, db_ipc_trace_dump);
+#endif
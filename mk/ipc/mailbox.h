@@ -0,0 +1,57 @@
+#ifndef	_IPC_MAILBOX_H_
+#define	_IPC_MAILBOX_H_
+
+/*
+ * A mailbox is a page in which a thread queues messages to send and posts
+ * slots to receive messages into, all of which are handled by one system call.
+ *
+ * The send descriptors follow the mailbox header, and the receive slots begin
+ * at imb_receive_offset bytes into the page.  On return, imb_send_count is the
+ * number of messages which could not be sent, which are moved to the front
+ * with ims_error set, and imb_receive_count is the number of slots filled.
+ */
+
+#define	IPC_MAILBOX_FLAG_DEFAULT	(0x00000000)
+#define	IPC_MAILBOX_FLAG_WAIT		(0x00000001)	/* Wait if nothing is pending.  */
+#define	IPC_MAILBOX_FLAG_PAGES		(0x00000002)	/* Receive all data in pages.  */
+
+struct ipc_mailbox_send {
+	struct ipc_header ims_header;
+	void *ims_page;			/* Page to flip, or NULL.  */
+	uint32_t ims_datalen;		/* Inline data to send if no page.  */
+	int32_t ims_error;
+	uint8_t ims_data[IPC_DATA_INLINE_MAX];
+};
+
+struct ipc_mailbox_receive {
+	struct ipc_header imr_header;
+	void *imr_page;
+	uint32_t imr_datalen;		/* Inline data received, if any.  */
+	uint32_t imr_reserved;
+	uint8_t imr_data[IPC_DATA_INLINE_MAX];
+};
+
+struct ipc_mailbox {
+	uint32_t imb_send_count;
+	uint32_t imb_receive_offset;
+	uint32_t imb_receive_count;
+	ipc_port_t imb_receive_port;
+	uint32_t imb_flags;
+	uint32_t imb_reserved;
+};
+
+#define	IPC_MAILBOX_SEND(mb, i)						\
+	((struct ipc_mailbox_send *)((uintptr_t)(mb) +			\
+	 sizeof (struct ipc_mailbox)) + (i))
+
+#define	IPC_MAILBOX_RECEIVE(mb, i)					\
+	((struct ipc_mailbox_receive *)((uintptr_t)(mb) +		\
+	 (mb)->imb_receive_offset) + (i))
+
+#ifdef MK
+int ipc_mailbox_process(struct ipc_mailbox *) __non_null(1) __check_result;
+#else
+int ipc_mailbox(struct ipc_mailbox *) __non_null(1) __check_result;
+#endif
+
+#endif /* !_IPC_MAILBOX_H_ */
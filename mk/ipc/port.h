@@ -3,6 +3,7 @@
 
 struct ipc_data;
 struct ipc_header;
+struct ipc_page_vector;
 #ifdef MK
 struct task;
 struct vm_page;
@@ -23,6 +24,10 @@ int ipc_port_allocate(ipc_port_t *, ipc_port_flags_t) __non_null(1) __check_resu
 int ipc_port_allocate_reserved(ipc_port_t, ipc_port_flags_t) __check_result;
 #endif
 int ipc_port_receive(ipc_port_t, struct ipc_header *, void **) __non_null(2) __check_result;
+int ipc_port_receive_buffer(ipc_port_t, struct ipc_header *, void *, size_t, void **) __non_null(2, 3, 5) __check_result;
+#ifdef MK
+int ipc_port_receive_data(ipc_port_t, struct ipc_header *, void *, size_t *, void **) __non_null(2, 3, 4) __check_result;
+#endif
 int ipc_port_right_drop(ipc_port_t, ipc_port_right_t) __check_result;
 #ifdef MK
 /*
@@ -32,12 +37,22 @@ int ipc_port_right_drop(ipc_port_t, ipc_port_right_t) __check_result;
  */
 int ipc_port_right_grant(struct task *, ipc_port_t, ipc_port_right_t) __non_null(1) __check_result;
 #endif
+int ipc_port_right_notify(ipc_port_t, ipc_port_t) __check_result;
+#ifdef MK
+int ipc_port_right_revoke(struct task *, ipc_port_t, ipc_port_right_t) __check_result;
+#endif
 int ipc_port_right_send(ipc_port_t, ipc_port_t, ipc_port_right_t) __check_result;
+#ifdef MK
+void ipc_port_rights_drop(struct task *) __non_null(1);
+#endif
 int ipc_port_send(const struct ipc_header *, void *) __non_null(1) __check_result;
+int ipc_port_send_copy(const struct ipc_header *, void *) __non_null(1) __check_result;
 int ipc_port_send_data(const struct ipc_header *, const void *, size_t) __non_null(1) __check_result;
 #ifdef MK
 int ipc_port_send_page(const struct ipc_header *, struct vm_page *) __non_null(1) __check_result;
+int ipc_port_send_pages(const struct ipc_header *, struct vm_page **, unsigned) __non_null(1) __check_result;
 #endif
+int ipc_port_send_vector(const struct ipc_header *, const struct ipc_page_vector *, unsigned) __non_null(1, 2) __check_result;
 int ipc_port_wait(ipc_port_t) __check_result;
 
 #endif /* !_IPC_PORT_H_ */
@@ -4,8 +4,14 @@
 struct ipc_header;
 struct ipc_token;
 
+/*
+ * A service may run several threads, all receiving from its port, in which
+ * case the handler must be safe to call from all of them at once.
+ */
+#define	IPC_SERVICE_THREADS_PERCPU	(0)	/* One thread pinned to each CPU.  */
+
 typedef	int (ipc_service_t)(void *, struct ipc_header *, void **) __non_null(2) __check_result;
 
-int ipc_service(const char *, ipc_port_t, ipc_port_flags_t, ipc_service_t *, void *) __non_null(1, 4) __check_result;
+int ipc_service(const char *, ipc_port_t, ipc_port_flags_t, unsigned, ipc_service_t *, void *) __non_null(1, 5) __check_result;
 
 #endif /* !_IPC_SERVICE_H_ */
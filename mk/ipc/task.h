@@ -3,14 +3,23 @@
 
 #ifdef MK
 #include <core/queue.h>
+#include <core/spinlock.h>
 
 struct ipc_port_right;
 
+/*
+ * The rights list is changed with the lock of the port each right is on held,
+ * and so has a lock of its own, taken after any port lock.
+ */
 struct ipc_task {
+	struct spinlock ipct_lock;
 	STAILQ_HEAD(, struct ipc_port_right) ipct_rights;
 	ipc_port_t ipct_task_port;
 };
 
+#define	IPC_TASK_LOCK(ipct)	spinlock_lock(&(ipct)->ipct_lock)
+#define	IPC_TASK_UNLOCK(ipct)	spinlock_unlock(&(ipct)->ipct_lock)
+
 void ipc_task_free(struct task *) __non_null(1);
 int ipc_task_setup(ipc_port_t, struct task *) __non_null(2) __check_result;
 #else
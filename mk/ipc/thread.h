@@ -0,0 +1,30 @@
+#ifndef	_IPC_THREAD_H_
+#define	_IPC_THREAD_H_
+
+/*
+ * Each thread has a reply port of its own, allocated the first time it is
+ * asked for and kept until the thread exits, so that a thread making one
+ * request after another can give out send-once rights on the same port rather
+ * than allocating a new one for every request.  The receive right is the
+ * task's, like any other, but only the thread should receive on it.
+ *
+ * Because the port outlives any one request, a late reply to an abandoned
+ * request may still be queued on it when the next request is made.  Each
+ * call also gives the next number in a per-thread sequence to use as the
+ * request's cookie, so that a reply can be matched to the request it answers.
+ */
+
+#ifdef MK
+struct thread;
+
+struct ipc_thread {
+	ipc_port_t ipctd_reply_port;
+	ipc_cookie_t ipctd_sequence;
+};
+
+void ipc_thread_free(struct thread *) __non_null(1);
+void ipc_thread_setup(struct thread *) __non_null(1);
+#endif
+int ipc_thread_reply_port(ipc_port_t *, ipc_cookie_t *) __non_null(1, 2) __check_result;
+
+#endif /* !_IPC_THREAD_H_ */
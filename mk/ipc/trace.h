@@ -0,0 +1,48 @@
+#ifndef	_IPC_TRACE_H_
+#define	_IPC_TRACE_H_
+
+#include <ipc/ipc.h>
+
+/*
+ * Each CPU keeps a ring of the most recent IPC events it has seen, stamped
+ * with its own free-running counter, so timestamps may only be compared
+ * between records from the same CPU.  The rings may be dumped from the
+ * debugger, or read by any task from the public "ipc_trace" service, which
+ * replies to IPC_TRACE_MSG_DUMP for the CPU given as the parameter with a page
+ * holding a struct ipc_trace_dump.
+ */
+
+#define	IPC_TRACE_RECORDS	(128)
+
+#define	IPC_TRACE_SEND		(0x0001)	/* Message queued.  */
+#define	IPC_TRACE_RECEIVE	(0x0002)	/* Message dequeued.  */
+#define	IPC_TRACE_WAIT		(0x0003)	/* Receiver about to sleep on dst.  */
+
+struct ipc_trace_record {
+	uint32_t ipctr_timestamp;
+	uint16_t ipctr_event;
+	ipc_msg_t ipctr_msg;
+	ipc_port_t ipctr_src;
+	ipc_port_t ipctr_dst;
+	ipc_cookie_t ipctr_cookie;
+};
+
+#define	IPC_TRACE_MSG_DUMP	(0x00000001)
+
+/*
+ * Records are oldest first.  Records overwritten while the ring was being
+ * copied are left out, and ipctrd_total counts every event the CPU has seen.
+ */
+struct ipc_trace_dump {
+	uint32_t ipctrd_cpu;
+	uint32_t ipctrd_count;
+	uint64_t ipctrd_total;
+	struct ipc_trace_record ipctrd_records[IPC_TRACE_RECORDS];
+};
+
+#if defined(MK)
+void ipc_trace_message(unsigned, const struct ipc_header *) __non_null(2);
+void ipc_trace_wait(ipc_port_t);
+#endif
+
+#endif /* !_IPC_TRACE_H_ */
@@ -1,8 +1,8 @@
 #include <core/types.h>
 #include <core/btree.h>
 #include <core/error.h>
-#include <core/mutex.h>
 #include <core/pool.h>
+#include <core/rwlock.h>
 #include <core/string.h>
 #ifdef VERBOSE
 #include <core/console.h>
@@ -18,11 +18,13 @@ struct service_directory_entry {
 };
 
 static BTREE_ROOT(struct service_directory_entry) service_directory;
-static struct mutex service_directory_lock;
+static struct rwlock service_directory_lock;
 static struct pool service_directory_entry_pool;
 
-#define	SERVICE_DIRECTORY_LOCK()	mutex_lock(&service_directory_lock)
-#define	SERVICE_DIRECTORY_UNLOCK()	mutex_unlock(&service_directory_lock)
+#define	SERVICE_DIRECTORY_RLOCK()	rwlock_rlock(&service_directory_lock)
+#define	SERVICE_DIRECTORY_RUNLOCK()	rwlock_runlock(&service_directory_lock)
+#define	SERVICE_DIRECTORY_WLOCK()	rwlock_wlock(&service_directory_lock)
+#define	SERVICE_DIRECTORY_WUNLOCK()	rwlock_wunlock(&service_directory_lock)
 
 void
 service_directory_init(void)
@@ -35,7 +37,7 @@ service_directory_init(void)
 	if (error != 0)
 		panic("%s: pool_create failed: %m", __func__, error);
 
-	mutex_init(&service_directory_lock, "Service Directory", MUTEX_FLAG_DEFAULT);
+	rwlock_init(&service_directory_lock, "Service Directory");
 	BTREE_ROOT_INIT(&service_directory);
 }
 
@@ -52,14 +54,14 @@ service_directory_enter(const char *service_name, ipc_port_t port)
 	sde->sde_port = port;
 	BTREE_NODE_INIT(&sde->sde_tree);
 
-	SERVICE_DIRECTORY_LOCK();
+	SERVICE_DIRECTORY_WLOCK();
 
 	BTREE_FIND(&old, iter, &service_directory, sde_tree,
 		   strcmp(sde->sde_name, iter->sde_name) < 0,
 		   strcmp(sde->sde_name, iter->sde_name) == 0);
 
 	if (old != NULL) {
-		SERVICE_DIRECTORY_UNLOCK();
+		SERVICE_DIRECTORY_WUNLOCK();
 		pool_free(sde);
 		return (ERROR_NOT_FREE);
 	}
@@ -67,7 +69,7 @@ service_directory_enter(const char *service_name, ipc_port_t port)
 	BTREE_INSERT(sde, iter, &service_directory, sde_tree,
 		     strcmp(sde->sde_name, iter->sde_name) < 0);
 
-	SERVICE_DIRECTORY_UNLOCK();
+	SERVICE_DIRECTORY_WUNLOCK();
 
 #ifdef VERBOSE
 	printf("%s: registered service \"%s\" at port %lx\n", __func__, service_name, port);
@@ -81,20 +83,20 @@ service_directory_lookup(const char *service_name, ipc_port_t *portp)
 {
 	struct service_directory_entry *sde, *iter;
 
-	SERVICE_DIRECTORY_LOCK();
+	SERVICE_DIRECTORY_RLOCK();
 
 	BTREE_FIND(&sde, iter, &service_directory, sde_tree,
 		   strcmp(service_name, iter->sde_name) < 0,
 		   strcmp(service_name, iter->sde_name) == 0);
 
 	if (sde == NULL) {
-		SERVICE_DIRECTORY_UNLOCK();
+		SERVICE_DIRECTORY_RUNLOCK();
 		return (ERROR_NOT_FOUND);
 	}
 
 	*portp = sde->sde_port;
 
-	SERVICE_DIRECTORY_UNLOCK();
+	SERVICE_DIRECTORY_RUNLOCK();
 
 	return (0);
 }
@@ -7,6 +7,8 @@
 #endif
 #include <vm/vm.h>
 #include <vm/vm_index.h>
+#include <vm/vm_map.h>
+#include <vm/vm_object.h>
 #include <vm/vm_page.h>
 
 #ifdef DB
@@ -40,6 +42,18 @@ vm_init(void)
 	if (error != 0)
 		panic("%s: vm_init_index failed: %m", __func__, error);
 
+	/*
+	 * Initialize the vm_map and vm_object modules, which describe how to
+	 * fill in ranges of user address spaces on demand.
+	 */
+	error = vm_init_map();
+	if (error != 0)
+		panic("%s: vm_init_map failed: %m", __func__, error);
+
+	error = vm_init_object();
+	if (error != 0)
+		panic("%s: vm_init_object failed: %m", __func__, error);
+
 	/*
 	 * Bring up PMAP.
 	 */
@@ -59,8 +73,10 @@ vm_exit(struct vm *vm)
 {
 	/*
 	 * XXX
-	 * Needs to be implemented.
+	 * Needs to be implemented, beyond giving back recycled pages.
 	 */
+	while (vm->vm_nrecycle != 0)
+		page_release(vm->vm_recycle[--vm->vm_nrecycle]);
 }
 
 int
@@ -79,15 +95,16 @@ vm_setup(struct vm **vmp, vaddr_t base, vaddr_t end)
 		return (error);
 	}
 
-	VM_LOCK(vm);
+	/*
+	 * Nobody else can see the VM yet, so there is no need to lock it, and
+	 * pmap_init will itself lock it to insert the initial index.
+	 */
 	error = pmap_init(vm, base, end);
 	if (error != 0) {
-		VM_UNLOCK(vm);
 		pool_free(vm);
 		return (error);
 	}
 	*vmp = vm;
-	VM_UNLOCK(vm);
 
 	return (0);
 }
@@ -95,11 +112,15 @@ vm_setup(struct vm **vmp, vaddr_t base, vaddr_t end)
 static int
 vm_setup2(struct vm *vm, const char *name)
 {
-	spinlock_init(&vm->vm_lock, name,
-		      SPINLOCK_FLAG_DEFAULT | SPINLOCK_FLAG_RECURSE);
+	rwlock_init(&vm->vm_lock, name);
 	vm->vm_pmap = NULL;
 	BTREE_ROOT_INIT(&vm->vm_index);
 	BTREE_ROOT_INIT(&vm->vm_index_free);
+	SLIST_INIT(&vm->vm_index_pages);
+	vm->vm_index_npages = 0;
+	BTREE_ROOT_INIT(&vm->vm_maps);
+	spinlock_init(&vm->vm_recycle_lock, "VM recycle", SPINLOCK_FLAG_DEFAULT);
+	vm->vm_nrecycle = 0;
 
 	return (0);
 }
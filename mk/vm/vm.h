@@ -3,6 +3,7 @@
 
 #include <core/btree.h>
 #include <core/queue.h>
+#include <core/rwlock.h>
 #include <core/spinlock.h>
 #ifdef DB
 #include <db/db_command.h>
@@ -10,6 +11,7 @@
 
 struct pmap;
 struct vm_index;
+struct vm_map;
 struct vm_page;
 
 #ifdef DB
@@ -17,14 +19,37 @@ DB_COMMAND_TREE_DECLARE(vm);
 DB_COMMAND_TREE_DECLARE(vm_index);
 #endif
 
+/*
+ * The lock protects the address-space metadata (the index and map trees).
+ * Lookups take it shared and may run in parallel; anything which changes the
+ * trees takes it exclusive.  Holders may sleep, but kernel_vm is also locked
+ * by pool allocations made with spinlocks held, so must not be held across
+ * anything that blocks for long.  Page tables are not covered: pmap_find and
+ * pmap_extract can be used without it, since page-table pages are never freed
+ * from a live pmap.
+ *
+ * Pages a task gives back with vm_recycle are kept in a small pool of their
+ * own, under a spinlock, and are handed back out for that task's next page
+ * faults and allocations before any more are taken from the free queue.
+ */
+#define	VM_RECYCLE_PAGES	(16)
+
 struct vm {
-	struct spinlock vm_lock;
+	struct rwlock vm_lock;
 	struct pmap *vm_pmap;
 	BTREE_ROOT(struct vm_index) vm_index;
 	BTREE_ROOT(struct vm_index) vm_index_free;
+	SLIST_HEAD(, struct vm_index) vm_index_pages;
+	unsigned vm_index_npages;
+	BTREE_ROOT(struct vm_map) vm_maps;
+	struct spinlock vm_recycle_lock;
+	struct vm_page *vm_recycle[VM_RECYCLE_PAGES];
+	unsigned vm_nrecycle;
 };
-#define	VM_LOCK(vm)	spinlock_lock(&(vm)->vm_lock)
-#define	VM_UNLOCK(vm)	spinlock_unlock(&(vm)->vm_lock)
+#define	VM_SLOCK(vm)	rwlock_rlock(&(vm)->vm_lock)
+#define	VM_SUNLOCK(vm)	rwlock_runlock(&(vm)->vm_lock)
+#define	VM_XLOCK(vm)	rwlock_wlock(&(vm)->vm_lock)
+#define	VM_XUNLOCK(vm)	rwlock_wunlock(&(vm)->vm_lock)
 
 extern struct vm kernel_vm;
 
@@ -1,11 +1,40 @@
 #include <core/types.h>
+#include <core/critical.h>
 #include <core/error.h>
+#include <core/mp.h>
 #include <core/pool.h>
 #include <vm/vm.h>
 #include <vm/vm_alloc.h>
+#include <vm/vm_fault.h>
 #include <vm/vm_index.h>
+#include <vm/vm_map.h>
 #include <vm/vm_page.h>
 
+/*
+ * Wiring a few pages of user memory into the kernel is very common, and the
+ * kernel address space it needs is short-lived.  Rather than going to the
+ * kernel_vm allocator (and its lock) every time, each CPU keeps a few
+ * fixed-size windows of kernel address space to hand out for wirings small
+ * enough to fit in one.
+ *
+ * The windows are only cached per-CPU; once handed out they are ordinary
+ * kernel mappings which may be used from any CPU, since the wiring thread may
+ * sleep and migrate before unwiring.
+ */
+#define	VM_WIRE_WINDOW_PAGES	(8)
+#define	VM_WIRE_WINDOW_CACHE	(4)
+
+struct vm_wire_windows {
+	vaddr_t vww_windows[VM_WIRE_WINDOW_CACHE];
+	unsigned vww_count;
+};
+
+static struct vm_wire_windows vm_wire_windows[MAXCPUS];
+
+static int vm_wire_page(struct vm *, vaddr_t, bool, struct vm_page **);
+static int vm_wire_window_get(size_t, vaddr_t *);
+static void vm_wire_window_put(size_t, vaddr_t);
+
 int
 vm_alloc(struct vm *vm, size_t size, vaddr_t *vaddrp, unsigned flags)
 {
@@ -26,6 +55,22 @@ vm_alloc(struct vm *vm, size_t size, vaddr_t *vaddrp, unsigned flags)
 	error = vm_alloc_address(vm, &vaddr, pages, (flags & VM_ALLOC_HIGH) != 0);
 	if (error != 0)
 		return (error);
+
+	/*
+	 * User memory is only reserved here, and pages are allocated as they
+	 * are first touched.  The kernel can't take faults on its own memory.
+	 */
+	if (vm != &kernel_vm) {
+		error = vm_map_anonymous(vm, vaddr, vaddr + pages * PAGE_SIZE);
+		if (error != 0) {
+			if (vm_free_address(vm, vaddr) != 0)
+				panic("%s: failed to free address.", __func__);
+			return (error);
+		}
+		*vaddrp = vaddr;
+		return (0);
+	}
+
 	for (o = 0; o < pages; o++) {
 		error = page_alloc_map(vm, PAGE_FLAG_DEFAULT, vaddr + o * PAGE_SIZE);
 		if (error != 0)
@@ -93,9 +138,18 @@ vm_free(struct vm *vm, size_t size, vaddr_t vaddr)
 
 	for (o = 0; o < pages; o++) {
 		error = page_free_map(vm, vaddr + o * PAGE_SIZE);
-		if (error != 0)
+		if (error != 0) {
+			/* Lazily-allocated pages may never have been touched.  */
+			if (error == ERROR_NOT_FOUND && vm != &kernel_vm)
+				continue;
 			panic("%s: page_free_map failed: %m", __func__,
 			      error);
+		}
+	}
+	if (vm != &kernel_vm) {
+		error = vm_map_remove(vm, vaddr, vaddr + PAGE_TO_ADDR(pages));
+		if (error != 0 && error != ERROR_NOT_FOUND)
+			panic("%s: vm_map_remove failed: %m", __func__, error);
 	}
 	error = vm_free_address(vm, vaddr);
 	if (error != 0)
@@ -114,6 +168,44 @@ vm_free_page(struct vm *vm, vaddr_t vaddr)
 	return (0);
 }
 
+/*
+ * Like vm_free, but the pages are kept in the address space's recycle pool
+ * rather than going back to the free queue.
+ */
+int
+vm_recycle(struct vm *vm, size_t size, vaddr_t vaddr)
+{
+	struct vm_page *page;
+	size_t o, pages;
+	int error;
+
+	if (vm == &kernel_vm)
+		return (vm_free(vm, size, vaddr));
+
+	pages = PAGE_COUNT(size);
+
+	for (o = 0; o < pages; o++) {
+		error = page_extract(vm, vaddr + o * PAGE_SIZE, &page);
+		if (error != 0) {
+			/* Lazily-allocated pages may never have been touched.  */
+			if (error == ERROR_NOT_FOUND)
+				continue;
+			panic("%s: page_extract failed: %m", __func__, error);
+		}
+		error = page_unmap(vm, vaddr + o * PAGE_SIZE, page);
+		if (error != 0)
+			panic("%s: page_unmap failed: %m", __func__, error);
+		page_recycle(vm, page);
+	}
+	error = vm_map_remove(vm, vaddr, vaddr + PAGE_TO_ADDR(pages));
+	if (error != 0 && error != ERROR_NOT_FOUND)
+		panic("%s: vm_map_remove failed: %m", __func__, error);
+	error = vm_free_address(vm, vaddr);
+	if (error != 0)
+		panic("%s: failed to free address: %m", __func__, error);
+	return (0);
+}
+
 int
 vm_wire(struct vm *vm, vaddr_t uvaddr, size_t len, vaddr_t *kvaddrp, size_t *offp, bool fault)
 {
@@ -131,21 +223,9 @@ vm_wire(struct vm *vm, vaddr_t uvaddr, size_t len, vaddr_t *kvaddrp, size_t *off
 
 #if !defined(VM_ALLOC_NO_DIRECT)
 	if (pages == 1) {
-		error = page_extract(vm, vaddr, &page);
-		if (error != 0) {
-			if (fault && error == ERROR_NOT_FOUND) {
-				error = page_alloc(PAGE_FLAG_ZERO, &page);
-				if (error != 0)
-					panic("%s: page_alloc failed: %m", __func__, error);
-
-				error = page_map(vm, vaddr, page);
-				if (error != 0)
-					panic("%s: page_map failed: %m", __func__, error);
-			} else {
-				panic("%s: page_extract failed: %m", __func__, error);
-			}
-
-		}
+		error = vm_wire_page(vm, vaddr, fault, &page);
+		if (error != 0)
+			panic("%s: vm_wire_page failed: %m", __func__, error);
 
 		error = page_map_direct(&kernel_vm, page, kvaddrp);
 		if (error != 0)
@@ -156,26 +236,14 @@ vm_wire(struct vm *vm, vaddr_t uvaddr, size_t len, vaddr_t *kvaddrp, size_t *off
 	}
 #endif
 
-	error = vm_alloc_address(&kernel_vm, &kvaddr, pages, false);
+	error = vm_wire_window_get(pages, &kvaddr);
 	if (error != 0)
-		panic("%s: vm_alloc_address failed: %m", __func__, error);
+		panic("%s: vm_wire_window_get failed: %m", __func__, error);
 
 	for (o = 0; o < pages; o++) {
-		error = page_extract(vm, vaddr + o * PAGE_SIZE, &page);
-		if (error != 0) {
-			if (fault && error == ERROR_NOT_FOUND) {
-				error = page_alloc(PAGE_FLAG_ZERO, &page);
-				if (error != 0)
-					panic("%s: page_alloc failed: %m", __func__, error);
-
-				error = page_map(vm, vaddr + o * PAGE_SIZE, page);
-				if (error != 0)
-					panic("%s: page_map failed: %m", __func__, error);
-			} else {
-				panic("%s: page_extract failed: %m", __func__, error);
-			}
-
-		}
+		error = vm_wire_page(vm, vaddr + o * PAGE_SIZE, fault, &page);
+		if (error != 0)
+			panic("%s: vm_wire_page failed: %m", __func__, error);
 
 		error = page_map(&kernel_vm, kvaddr + o * PAGE_SIZE, page);
 		if (error != 0)
@@ -226,9 +294,90 @@ vm_unwire(struct vm *vm, vaddr_t uvaddr, size_t len, vaddr_t kvaddr)
 			panic("%s: page_unmap failed: %m", __func__, error);
 	}
 
-	error = vm_free_address(&kernel_vm, kvaddr);
+	vm_wire_window_put(pages, kvaddr);
+
+	return (0);
+}
+
+static int
+vm_wire_page(struct vm *vm, vaddr_t vaddr, bool fault, struct vm_page **pagep)
+{
+	int error;
+
+	/*
+	 * The kernel writes through its own mapping, so break any
+	 * copy-on-write sharing first.
+	 */
+	error = page_unshare(vm, vaddr);
+	if (error == ERROR_NOT_FOUND) {
+		/*
+		 * Nothing is mapped here yet.  Give any backing object the
+		 * first chance to supply the page, and only then fall back to
+		 * a zeroed page if the caller asked us to.  What the object
+		 * supplies may itself be shared.
+		 */
+		error = vm_fault(vm, vaddr);
+		if (error == ERROR_NOT_FOUND && fault)
+			error = vm_fault_zero(vm, vaddr);
+		if (error == 0)
+			error = page_unshare(vm, vaddr);
+	}
 	if (error != 0)
-		panic("%s: failed to free address: %m", __func__, error);
+		return (error);
+
+	return (page_extract(vm, vaddr, pagep));
+}
 
+/*
+ * Get kernel address space for wiring the given number of pages.
+ */
+static int
+vm_wire_window_get(size_t pages, vaddr_t *kvaddrp)
+{
+	struct vm_wire_windows *vww;
+	int error;
+
+	if (pages > VM_WIRE_WINDOW_PAGES)
+		return (vm_alloc_address(&kernel_vm, kvaddrp, pages, false));
+
+	critical_enter();
+	vww = &vm_wire_windows[mp_whoami()];
+	if (vww->vww_count != 0) {
+		*kvaddrp = vww->vww_windows[--vww->vww_count];
+		critical_exit();
+		return (0);
+	}
+	critical_exit();
+
+	/*
+	 * Always allocate a whole window, so that it can be cached when it is
+	 * given back.
+	 */
+	error = vm_alloc_address(&kernel_vm, kvaddrp, VM_WIRE_WINDOW_PAGES,
+				 false);
+	if (error != 0)
+		return (error);
 	return (0);
 }
+
+static void
+vm_wire_window_put(size_t pages, vaddr_t kvaddr)
+{
+	struct vm_wire_windows *vww;
+	int error;
+
+	if (pages <= VM_WIRE_WINDOW_PAGES) {
+		critical_enter();
+		vww = &vm_wire_windows[mp_whoami()];
+		if (vww->vww_count != VM_WIRE_WINDOW_CACHE) {
+			vww->vww_windows[vww->vww_count++] = kvaddr;
+			critical_exit();
+			return;
+		}
+		critical_exit();
+	}
+
+	error = vm_free_address(&kernel_vm, kvaddr);
+	if (error != 0)
+		panic("%s: failed to free address: %m", __func__, error);
+}
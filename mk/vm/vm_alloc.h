@@ -13,6 +13,7 @@ int vm_alloc_range_wire(struct vm *, vaddr_t, vaddr_t, vaddr_t *, size_t *)
 	__non_null(1, 4, 5) __check_result;
 int vm_free(struct vm *, size_t, vaddr_t) __non_null(1) __check_result;
 int vm_free_page(struct vm *, vaddr_t) __non_null(1) __check_result;
+int vm_recycle(struct vm *, size_t, vaddr_t) __non_null(1) __check_result;
 
 	/* Virtual memory wiring without allocation.  */
 int vm_wire(struct vm *, vaddr_t, size_t, vaddr_t *, size_t *, bool)
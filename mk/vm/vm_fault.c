@@ -5,8 +5,69 @@
 #include <vm/vm.h>
 #include <vm/vm_fault.h>
 #include <vm/vm_index.h>
+#include <vm/vm_map.h>
+#include <vm/vm_object.h>
 #include <vm/vm_page.h>
 
+static int vm_fault_map(struct vm *, vaddr_t, struct vm_page *, bool);
+
+/*
+ * A fault on a page with no mapping.  If the address is covered by a vm_map,
+ * fill it in from whatever backs that: a zeroed page for anonymous memory, or
+ * the contents of the backing object.
+ */
+int
+vm_fault(struct vm *vm, vaddr_t vaddr)
+{
+	struct vm_object *vmo;
+	struct vm_page *page;
+	size_t len;
+	off_t off;
+	int error;
+
+	vaddr = PAGE_FLOOR(vaddr);
+
+	error = vm_map_lookup(vm, vaddr, &vmo, &off, &len);
+	if (error != 0)
+		return (error);
+
+	if (vmo == NULL)
+		return (vm_fault_zero(vm, vaddr));
+
+	/*
+	 * A page wholly within the object may be shared with anyone else
+	 * using the same object, and is mapped copy-on-write.  A page which is
+	 * only partly backed has to be ours to zero the rest of.
+	 */
+	if (len == PAGE_SIZE)
+		error = vm_object_page_get(vmo, off, &page);
+	else
+		error = vm_object_page_in(vmo, off, len, &page);
+	vm_object_release(vmo);
+	if (error != 0)
+		return (error);
+
+	return (vm_fault_map(vm, vaddr, page, len == PAGE_SIZE));
+}
+
+/*
+ * A write to a copy-on-write page.  Either takes a private copy of the page or,
+ * if nobody else is sharing it any more, simply lets the write through.
+ */
+int
+vm_fault_cow(struct vm *vm, vaddr_t vaddr)
+{
+	int error;
+
+	vaddr = PAGE_FLOOR(vaddr);
+
+	error = page_unshare(vm, vaddr);
+	if (error != 0)
+		return (error);
+
+	return (0);
+}
+
 int
 vm_fault_stack(struct thread *td, vaddr_t vaddr)
 {
@@ -19,10 +80,56 @@ vm_fault_stack(struct thread *td, vaddr_t vaddr)
 
 	vaddr = PAGE_FLOOR(vaddr);
 
-	/* XXX Check for an existing mapping?  */
-	error = page_alloc_map(vm, PAGE_FLAG_ZERO, vaddr);
+	error = vm_fault_zero(vm, vaddr);
+	if (error != 0)
+		return (error);
+
+	return (0);
+}
+
+/*
+ * Fill in a page with no mapping with a zeroed page.
+ */
+int
+vm_fault_zero(struct vm *vm, vaddr_t vaddr)
+{
+	struct vm_page *page;
+	int error;
+
+	error = page_alloc_vm(vm, PAGE_FLAG_ZERO, &page);
 	if (error != 0)
 		return (error);
 
+	return (vm_fault_map(vm, vaddr, page, false));
+}
+
+/*
+ * Every thread in a task, and the kernel wiring its pages, may fault on the
+ * same page at once.  Only the first to get here maps its page, with the VM
+ * locked so that nobody can slip in between the check and the mapping; the
+ * others find the page already there and give theirs back.
+ */
+static int
+vm_fault_map(struct vm *vm, vaddr_t vaddr, struct vm_page *page, bool cow)
+{
+	struct vm_page *mapped;
+	int error;
+
+	VM_XLOCK(vm);
+	if (page_extract(vm, vaddr, &mapped) == 0) {
+		VM_XUNLOCK(vm);
+		page_release(page);
+		return (0);
+	}
+	if (cow)
+		error = page_map_cow(vm, vaddr, page);
+	else
+		error = page_map(vm, vaddr, page);
+	VM_XUNLOCK(vm);
+	if (error != 0) {
+		page_release(page);
+		return (error);
+	}
+
 	return (0);
 }
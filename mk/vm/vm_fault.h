@@ -2,7 +2,11 @@
 #define	_VM_VM_FAULT_H_
 
 struct thread;
+struct vm;
 
+int vm_fault(struct vm *, vaddr_t);
+int vm_fault_cow(struct vm *, vaddr_t);
 int vm_fault_stack(struct thread *, vaddr_t);
+int vm_fault_zero(struct vm *, vaddr_t);
 
 #endif /* !_VM_VM_FAULT_H_ */
@@ -13,15 +13,37 @@
 #include <vm/vm_index.h>
 #include <vm/vm_page.h>
 
+/*
+ * Each address space is carved up into a set of vm_index entries, every one
+ * of which is either in use or free.  All entries are kept in vm_index by
+ * address, and free entries are also kept in vm_index_free by size, so that
+ * the smallest free entry which can satisfy a request can be found by a
+ * single descent of that tree.  When an entry is freed it is merged with any
+ * free entries on either side of it, so that no two free entries are ever
+ * adjacent and a large enough free range is always a single entry.
+ *
+ * Freeing and reallocating single pages of kernel address space is very
+ * common (e.g. to wire a page of a message), so a few freed single-page
+ * entries are kept aside on vm_index_pages without being merged, and are
+ * handed back out without touching either tree.
+ */
 struct vm_index {
 	vaddr_t vmi_base;
 	size_t vmi_size;
 	unsigned vmi_flags;
 	BTREE_NODE(struct vm_index) vmi_tree;
 	BTREE_NODE(struct vm_index) vmi_free_tree;
+	SLIST_ENTRY(struct vm_index) vmi_page_link;
 };
 #define	VM_INDEX_FLAG_DEFAULT	(0x00000000)
 #define	VM_INDEX_FLAG_INUSE	(0x00000001)
+#define	VM_INDEX_FLAG_CACHED	(0x00000002)
+
+#define	VM_INDEX_PAGE_CACHE	(16)
+
+#define	VM_INDEX_FREE_CMP(a, b)						\
+	((a)->vmi_size < (b)->vmi_size ||				\
+	 ((a)->vmi_size == (b)->vmi_size && (a)->vmi_base < (b)->vmi_base))
 
 #ifdef DB
 DB_COMMAND_TREE(index, vm, vm_index);
@@ -29,10 +51,13 @@ DB_COMMAND_TREE(index, vm, vm_index);
 
 static struct pool vm_index_pool;
 
+static struct vm_index *vm_best_index(struct vm *, size_t);
 static int vm_claim_range(struct vm *, vaddr_t, vaddr_t, struct vm_index *);
 static struct vm_index *vm_find_index(struct vm *, vaddr_t);
 static void vm_free_index(struct vm *, struct vm_index *);
 static int vm_insert_index(struct vm *, struct vm_index **, vaddr_t, size_t);
+static void vm_link_index(struct vm *, struct vm_index *, vaddr_t, size_t);
+static void vm_uncache_index(struct vm *, struct vm_index *);
 static int vm_use_index(struct vm *, struct vm_index *, size_t);
 
 int
@@ -51,52 +76,60 @@ int
 vm_alloc_address(struct vm *vm, vaddr_t *vaddrp, size_t pages, bool high)
 {
 	struct vm_index *vmi;
+	vaddr_t start, end;
 	int error;
 
-	VM_LOCK(vm);
-	if (!high)
-		BTREE_MIN(vmi, &vm->vm_index_free, vmi_free_tree);
-	else
+	VM_XLOCK(vm);
+	if (pages == 1 && !high && !SLIST_EMPTY(&vm->vm_index_pages)) {
+		vmi = SLIST_FIRST(&vm->vm_index_pages);
+		SLIST_REMOVE_HEAD(&vm->vm_index_pages, vmi_page_link);
+		vm->vm_index_npages--;
+		vmi->vmi_flags &= ~VM_INDEX_FLAG_CACHED;
+		*vaddrp = vmi->vmi_base;
+		VM_XUNLOCK(vm);
+		return (0);
+	}
+
+	/*
+	 * High allocations (e.g. stacks) come from the top of the largest
+	 * free range, as they always have, and only the rest are best-fit.
+	 */
+	if (!high) {
+		vmi = vm_best_index(vm, pages);
+	} else {
 		BTREE_MAX(vmi, &vm->vm_index_free, vmi_free_tree);
-	while (vmi != NULL) {
-		if (vmi->vmi_size < pages) {
-			if (!high)
-				BTREE_NEXT(vmi, vmi_free_tree);
-			else
-				BTREE_PREV(vmi, vmi_free_tree);
-			continue;
-		}
+		if (vmi != NULL && vmi->vmi_size < pages)
+			vmi = NULL;
+	}
+	if (vmi == NULL) {
+		VM_XUNLOCK(vm);
+		return (ERROR_EXHAUSTED);
+	}
 
-		if (vmi->vmi_size == pages) {
-			error = vm_use_index(vm, vmi, pages);
-			if (error != 0) {
-				VM_UNLOCK(vm);
-				return (error);
-			}
-			*vaddrp = vmi->vmi_base;
-			VM_UNLOCK(vm);
-			return (0);
-		} else {
-			vaddr_t start, end;
-
-			start = vmi->vmi_base;
-			if (high)
-				start += PAGE_TO_ADDR(vmi->vmi_size - pages);
-			end = start + PAGE_TO_ADDR(pages);
-
-			error = vm_claim_range(vm, start, end, vmi);
-			if (error != 0) {
-				VM_UNLOCK(vm);
-				return (error);
-			}
-			*vaddrp = start;
-			VM_UNLOCK(vm);
-			return (0);
+	if (vmi->vmi_size == pages) {
+		error = vm_use_index(vm, vmi, pages);
+		if (error != 0) {
+			VM_XUNLOCK(vm);
+			return (error);
 		}
+		*vaddrp = vmi->vmi_base;
+		VM_XUNLOCK(vm);
+		return (0);
 	}
-	/* XXX Look for adjacent entries, collapse, etc..  */
-	VM_UNLOCK(vm);
-	return (ERROR_NOT_IMPLEMENTED);
+
+	start = vmi->vmi_base;
+	if (high)
+		start += PAGE_TO_ADDR(vmi->vmi_size - pages);
+	end = start + PAGE_TO_ADDR(pages);
+
+	error = vm_claim_range(vm, start, end, vmi);
+	if (error != 0) {
+		VM_XUNLOCK(vm);
+		return (error);
+	}
+	*vaddrp = start;
+	VM_XUNLOCK(vm);
+	return (0);
 }
 
 int
@@ -104,15 +137,15 @@ vm_alloc_range(struct vm *vm, vaddr_t begin, vaddr_t end)
 {
 	int error;
 
-	VM_LOCK(vm);
+	VM_XLOCK(vm);
 
 	error = vm_claim_range(vm, PAGE_FLOOR(begin), PAGE_ROUNDUP(end), NULL);
 	if (error != 0) {
-		VM_UNLOCK(vm);
+		VM_XUNLOCK(vm);
 		return (error);
 	}
 
-	VM_UNLOCK(vm);
+	VM_XUNLOCK(vm);
 
 	return (0);
 }
@@ -122,47 +155,121 @@ vm_free_address(struct vm *vm, vaddr_t vaddr)
 {
 	struct vm_index *vmi;
 
-	VM_LOCK(vm);
+	VM_XLOCK(vm);
 	vmi = vm_find_index(vm, vaddr);
 	if (vmi != NULL) {
-#if 0
-		ASSERT(TAILQ_EMPTY(&vmi->vmi_map),
-		       "Cannot free address with active mappings.");
-#endif
-
-		/*
-		 * XXX
-		 * If there is a range immediately before or after this one
-		 * and one or both are free, merge them.
-		 */
+		ASSERT((vmi->vmi_flags & VM_INDEX_FLAG_CACHED) == 0,
+		       "Cannot free an address twice.");
+
+		if (vm == &kernel_vm && vmi->vmi_size == 1 &&
+		    vm->vm_index_npages < VM_INDEX_PAGE_CACHE) {
+			vmi->vmi_flags |= VM_INDEX_FLAG_CACHED;
+			SLIST_INSERT_HEAD(&vm->vm_index_pages, vmi,
+					  vmi_page_link);
+			vm->vm_index_npages++;
+			VM_XUNLOCK(vm);
+			return (0);
+		}
 
 		vm_free_index(vm, vmi);
-		VM_UNLOCK(vm);
+		VM_XUNLOCK(vm);
 		return (0);
 	}
-	VM_UNLOCK(vm);
+	VM_XUNLOCK(vm);
 	return (ERROR_NOT_FOUND);
 }
 
+/*
+ * Free part of an in-use entry, leaving whatever is on either side of the
+ * range in use.
+ */
+int
+vm_free_range(struct vm *vm, vaddr_t begin, vaddr_t end)
+{
+	struct vm_index *nvmi, *tvmi, *vmi;
+	size_t leader, trailer;
+	int error;
+
+	ASSERT(PAGE_ALIGNED(begin) && PAGE_ALIGNED(end),
+	       "Range must be page-aligned.");
+
+	VM_XLOCK(vm);
+	vmi = vm_find_index(vm, begin);
+	if (vmi == NULL || (vmi->vmi_flags & VM_INDEX_FLAG_INUSE) == 0 ||
+	    (vmi->vmi_flags & VM_INDEX_FLAG_CACHED) != 0) {
+		VM_XUNLOCK(vm);
+		return (ERROR_NOT_FOUND);
+	}
+	if (vmi->vmi_base + PAGE_TO_ADDR(vmi->vmi_size) < end) {
+		VM_XUNLOCK(vm);
+		return (ERROR_INVALID);
+	}
+	leader = begin - vmi->vmi_base;
+	trailer = vmi->vmi_base + PAGE_TO_ADDR(vmi->vmi_size) - end;
+
+	nvmi = tvmi = NULL;
+	if (leader != 0) {
+		nvmi = pool_allocate(&vm_index_pool);
+		if (nvmi == NULL) {
+			VM_XUNLOCK(vm);
+			return (ERROR_EXHAUSTED);
+		}
+	}
+	if (trailer != 0) {
+		tvmi = pool_allocate(&vm_index_pool);
+		if (tvmi == NULL) {
+			VM_XUNLOCK(vm);
+			if (nvmi != NULL)
+				pool_free(nvmi);
+			return (ERROR_EXHAUSTED);
+		}
+	}
+
+	/*
+	 * An in-use entry is not in the free tree, so it can be resized in
+	 * place, and the new in-use pieces are linked as free and then used.
+	 */
+	if (leader != 0) {
+		vmi->vmi_size = ADDR_TO_PAGE(leader);
+		vm_link_index(vm, nvmi, begin, ADDR_TO_PAGE(end - begin));
+		error = vm_use_index(vm, nvmi, ADDR_TO_PAGE(end - begin));
+		if (error != 0)
+			panic("%s: vm_use_index failed: %m", __func__, error);
+	} else {
+		nvmi = vmi;
+		nvmi->vmi_size = ADDR_TO_PAGE(end - begin);
+	}
+	if (trailer != 0) {
+		vm_link_index(vm, tvmi, end, ADDR_TO_PAGE(trailer));
+		error = vm_use_index(vm, tvmi, ADDR_TO_PAGE(trailer));
+		if (error != 0)
+			panic("%s: vm_use_index failed: %m", __func__, error);
+	}
+	vm_free_index(vm, nvmi);
+	VM_XUNLOCK(vm);
+
+	return (0);
+}
+
 int
 vm_insert_range(struct vm *vm, vaddr_t begin, vaddr_t end)
 {
 	int error;
 
-	VM_LOCK(vm);
+	VM_XLOCK(vm);
 	error = vm_insert_index(vm, NULL, begin, PAGE_COUNT(end - begin));
 	if (error != 0) {
-		VM_UNLOCK(vm);
+		VM_XUNLOCK(vm);
 		return (error);
 	}
-	VM_UNLOCK(vm);
+	VM_XUNLOCK(vm);
 	return (0);
 }
 
 static int
 vm_claim_range(struct vm *vm, vaddr_t begin, vaddr_t end, struct vm_index *vmi)
 {
-	struct vm_index *nvmi;
+	struct vm_index *iter, *nvmi, *tvmi;
 	size_t leader, trailer;
 	size_t range;
 	size_t size;
@@ -174,55 +281,80 @@ vm_claim_range(struct vm *vm, vaddr_t begin, vaddr_t end, struct vm_index *vmi)
 		vmi = vm_find_index(vm, begin);
 		if (vmi == NULL)
 			return (ERROR_NOT_FOUND);
+		if ((vmi->vmi_flags & VM_INDEX_FLAG_CACHED) != 0) {
+			/*
+			 * Really free a cached page, which may merge it with
+			 * its neighbours, and look again.
+			 */
+			vm_uncache_index(vm, vmi);
+			vmi = vm_find_index(vm, begin);
+		}
 	}
 	if ((vmi->vmi_flags & VM_INDEX_FLAG_INUSE) != 0)
 		return (ERROR_NOT_FREE);
 	size = PAGE_TO_ADDR(vmi->vmi_size);
 	if (vmi->vmi_base + size < end) {
-		/* XXX Compact entries.  */
-		return (ERROR_NOT_IMPLEMENTED);
+		/*
+		 * Free neighbours are always merged, so the rest of the range
+		 * must be in use.
+		 */
+		return (ERROR_NOT_FREE);
 	}
 	leader = begin - vmi->vmi_base;
 	trailer = size - (leader + range);
 	ASSERT(range + leader + trailer == size,
 	       "Leader, trailer and range calculations incorrect.");
+
+	/*
+	 * Get everything we need up front so that we never have to back out
+	 * of a partial split.
+	 */
+	nvmi = tvmi = NULL;
 	if (leader != 0) {
-		vmi->vmi_size = ADDR_TO_PAGE(leader);
-		error = vm_insert_index(vm, &nvmi, begin, ADDR_TO_PAGE(range));
-		if (error != 0) {
-			vmi->vmi_size = ADDR_TO_PAGE(size);
-			return (error);
+		nvmi = pool_allocate(&vm_index_pool);
+		if (nvmi == NULL)
+			return (ERROR_EXHAUSTED);
+	}
+	if (trailer != 0) {
+		tvmi = pool_allocate(&vm_index_pool);
+		if (tvmi == NULL) {
+			if (nvmi != NULL)
+				pool_free(nvmi);
+			return (ERROR_EXHAUSTED);
 		}
+	}
+
+	/*
+	 * The free tree is ordered by size, so the entry has to come out of
+	 * it while it is being resized.
+	 */
+	BTREE_REMOVE(vmi, iter, &vm->vm_index_free, vmi_free_tree);
+	if (leader != 0) {
+		vmi->vmi_size = ADDR_TO_PAGE(leader);
+		BTREE_INSERT(vmi, iter, &vm->vm_index_free, vmi_free_tree,
+			     VM_INDEX_FREE_CMP(vmi, iter));
+		vm_link_index(vm, nvmi, begin, ADDR_TO_PAGE(range));
 	} else {
 		nvmi = vmi;
 		nvmi->vmi_size = ADDR_TO_PAGE(range);
+		BTREE_INSERT(nvmi, iter, &vm->vm_index_free, vmi_free_tree,
+			     VM_INDEX_FREE_CMP(nvmi, iter));
 	}
-	if (trailer != 0) {
-		error = vm_insert_index(vm, NULL, end, ADDR_TO_PAGE(trailer));
-		if (error != 0) {
-			/* XXX
-			 * We could just give the user more than they
-			 * wanted but that could turn out to be very bad.  For
-			 * now just fragment the map and error out.
-			 */
-			nvmi->vmi_size += ADDR_TO_PAGE(trailer);
-			return (error);
-		}
-	}
+	if (trailer != 0)
+		vm_link_index(vm, tvmi, end, ADDR_TO_PAGE(trailer));
 	error = vm_use_index(vm, nvmi, ADDR_TO_PAGE(range));
 	if (error != 0)
 		panic("%s: vm_use_index failed: %m", __func__, error);
 	return (0);
 }
 
-
 static struct vm_index *
 vm_find_index(struct vm *vm, vaddr_t vaddr)
 {
 	struct vm_index *iter;
 	struct vm_index *vmi;
 
-	SPINLOCK_ASSERT_HELD(&vm->vm_lock);
+	RWLOCK_ASSERT_XHELD(&vm->vm_lock);
 
 	BTREE_FIND(&vmi, iter, &vm->vm_index, vmi_tree,
 		   (vaddr < iter->vmi_base),
@@ -232,37 +364,114 @@ vm_find_index(struct vm *vm, vaddr_t vaddr)
 	return (vmi);
 }
 
+/*
+ * Find the smallest free index of at least the given number of pages.
+ */
+static struct vm_index *
+vm_best_index(struct vm *vm, size_t pages)
+{
+	struct vm_index *best, *iter;
+
+	RWLOCK_ASSERT_XHELD(&vm->vm_lock);
+
+	best = NULL;
+	iter = vm->vm_index_free.child;
+	while (iter != NULL) {
+		if (iter->vmi_size < pages) {
+			iter = iter->vmi_free_tree.right;
+			continue;
+		}
+		best = iter;
+		if (iter->vmi_size == pages)
+			break;
+		iter = iter->vmi_free_tree.left;
+	}
+	return (best);
+}
+
 static void
 vm_free_index(struct vm *vm, struct vm_index *vmi)
 {
-	struct vm_index *iter;
+	struct vm_index *iter, *next, *prev;
+
+	RWLOCK_ASSERT_XHELD(&vm->vm_lock);
 
 	ASSERT((vmi->vmi_flags & VM_INDEX_FLAG_INUSE) != 0,
 	       "VM Index must be in use.");
 	vmi->vmi_flags &= ~VM_INDEX_FLAG_INUSE;
 
 	/*
-	 * This would be a good place to consider merging adjacent indeces.
+	 * Merge with free neighbours.  The entries that go away are only
+	 * returned to the pool once the trees are consistent again, since
+	 * doing so may end up back in here for the kernel VM.
 	 */
+	prev = vmi;
+	BTREE_PREV(prev, vmi_tree);
+	if (prev != NULL && (prev->vmi_flags & VM_INDEX_FLAG_INUSE) == 0 &&
+	    prev->vmi_base + PAGE_TO_ADDR(prev->vmi_size) == vmi->vmi_base) {
+		BTREE_REMOVE(prev, iter, &vm->vm_index_free, vmi_free_tree);
+		BTREE_REMOVE(vmi, iter, &vm->vm_index, vmi_tree);
+		prev->vmi_size += vmi->vmi_size;
+
+		/* Swap so that vmi is the merged entry.  */
+		iter = prev;
+		prev = vmi;
+		vmi = iter;
+	} else {
+		prev = NULL;
+	}
+
+	next = vmi;
+	BTREE_NEXT(next, vmi_tree);
+	if (next != NULL && (next->vmi_flags & VM_INDEX_FLAG_INUSE) == 0 &&
+	    vmi->vmi_base + PAGE_TO_ADDR(vmi->vmi_size) == next->vmi_base) {
+		BTREE_REMOVE(next, iter, &vm->vm_index_free, vmi_free_tree);
+		BTREE_REMOVE(next, iter, &vm->vm_index, vmi_tree);
+		vmi->vmi_size += next->vmi_size;
+	} else {
+		next = NULL;
+	}
+
 	BTREE_INSERT(vmi, iter, &vm->vm_index_free, vmi_free_tree,
-		     (vmi->vmi_size < iter->vmi_size));
+		     VM_INDEX_FREE_CMP(vmi, iter));
+
+	if (prev != NULL)
+		pool_free(prev);
+	if (next != NULL)
+		pool_free(next);
 }
 
 static int
 vm_insert_index(struct vm *vm, struct vm_index **vmip, vaddr_t base,
 		size_t pages)
 {
-	struct vm_index *iter;
 	struct vm_index *vmi;
 
-	SPINLOCK_ASSERT_HELD(&vm->vm_lock);
-
-	ASSERT(vm_find_index(vm, base) == NULL,
-	       "Cannot insert an index twice!");
+	RWLOCK_ASSERT_XHELD(&vm->vm_lock);
 
 	vmi = pool_allocate(&vm_index_pool);
 	if (vmi == NULL)
 		return (ERROR_EXHAUSTED);
+	vm_link_index(vm, vmi, base, pages);
+
+	if (vmip != NULL)
+		*vmip = vmi;
+	return (0);
+}
+
+/*
+ * Enter a new, free index into both trees.
+ */
+static void
+vm_link_index(struct vm *vm, struct vm_index *vmi, vaddr_t base, size_t pages)
+{
+	struct vm_index *iter;
+
+	RWLOCK_ASSERT_XHELD(&vm->vm_lock);
+
+	ASSERT(vm_find_index(vm, base) == NULL,
+	       "Cannot insert an index twice!");
+
 	vmi->vmi_base = base;
 	vmi->vmi_size = pages;
 	vmi->vmi_flags = VM_INDEX_FLAG_DEFAULT;
@@ -270,13 +479,23 @@ vm_insert_index(struct vm *vm, struct vm_index **vmip, vaddr_t base,
 	BTREE_NODE_INIT(&vmi->vmi_free_tree);
 
 	BTREE_INSERT(vmi, iter, &vm->vm_index_free, vmi_free_tree,
-		     (vmi->vmi_size < iter->vmi_size));
+		     VM_INDEX_FREE_CMP(vmi, iter));
 	BTREE_INSERT(vmi, iter, &vm->vm_index, vmi_tree,
 		     (vmi->vmi_base < iter->vmi_base));
+}
 
-	if (vmip != NULL)
-		*vmip = vmi;
-	return (0);
+static void
+vm_uncache_index(struct vm *vm, struct vm_index *vmi)
+{
+	RWLOCK_ASSERT_XHELD(&vm->vm_lock);
+
+	ASSERT((vmi->vmi_flags & VM_INDEX_FLAG_CACHED) != 0,
+	       "VM Index must be cached.");
+	SLIST_REMOVE(&vm->vm_index_pages, vmi, struct vm_index, vmi_page_link);
+	vm->vm_index_npages--;
+	vmi->vmi_flags &= ~VM_INDEX_FLAG_CACHED;
+
+	vm_free_index(vm, vmi);
 }
 
 static int
@@ -313,6 +532,7 @@ db_vm_index_dump(struct vm_index *vmi)
 		 (void *)vmi->vmi_base,
 		 (void *)(vmi->vmi_base + vmi->vmi_size * PAGE_SIZE),
 		 vmi->vmi_size,
+		 (vmi->vmi_flags & VM_INDEX_FLAG_CACHED) != 0 ? "cached" :
 		 (vmi->vmi_flags & VM_INDEX_FLAG_INUSE) == 0 ? "free" : "in-use");
 	/* XXX Show mappinga via pmap.  */
 }
@@ -0,0 +1,327 @@
+#include <core/types.h>
+#include <core/btree.h>
+#include <core/error.h>
+#include <core/pool.h>
+#include <core/task.h>
+#include <core/thread.h>
+#ifdef DB
+#include <db/db_command.h>
+#include <core/console.h>
+#endif
+#include <vm/vm.h>
+#include <vm/vm_map.h>
+#include <vm/vm_object.h>
+#include <vm/vm_page.h>
+
+/*
+ * A vm_map describes how a range of an address space (which must already
+ * have been allocated from the vm_index) is to be filled in when it is
+ * faulted on.  The first vmm_length bytes of the range come from the backing
+ * object starting at vmm_offset, and everything after that is zero.  A map
+ * with no object is anonymous memory, and is entirely zero-fill.
+ */
+struct vm_map {
+	vaddr_t vmm_base;
+	size_t vmm_size;
+	struct vm_object *vmm_object;
+	off_t vmm_offset;
+	size_t vmm_length;
+	BTREE_NODE(struct vm_map) vmm_tree;
+};
+
+#ifdef DB
+DB_COMMAND_TREE(map, vm, vm_map);
+#endif
+
+static struct pool vm_map_pool;
+
+static struct vm_map *vm_find_map(struct vm *, vaddr_t);
+static int vm_map_insert(struct vm *, vaddr_t, vaddr_t, struct vm_object *, off_t, size_t);
+static struct vm_map *vm_next_map(struct vm *, vaddr_t);
+
+int
+vm_init_map(void)
+{
+	int error;
+
+	error = pool_create(&vm_map_pool, "VM Map",
+			    sizeof (struct vm_map), POOL_DEFAULT);
+	if (error != 0)
+		return (error);
+	return (0);
+}
+
+int
+vm_map_anonymous(struct vm *vm, vaddr_t begin, vaddr_t end)
+{
+	return (vm_map_insert(vm, begin, end, NULL, 0, 0));
+}
+
+/*
+ * Is all of [begin, end) mapped as anonymous memory?  The caller must hold the
+ * VM lock, so that the answer still holds for as long as it does.
+ */
+bool
+vm_map_is_anonymous(struct vm *vm, vaddr_t begin, vaddr_t end)
+{
+	struct vm_map *vmm;
+	vaddr_t vaddr;
+
+	RWLOCK_ASSERT_HELD(&vm->vm_lock);
+
+	for (vaddr = begin; vaddr < end;
+	     vaddr = vmm->vmm_base + PAGE_TO_ADDR(vmm->vmm_size)) {
+		vmm = vm_find_map(vm, vaddr);
+		if (vmm == NULL || vmm->vmm_object != NULL)
+			return (false);
+	}
+	return (true);
+}
+
+/*
+ * Find what should be at vaddr.  Returns the backing object with a reference
+ * held (or NULL for anonymous memory), the offset into it of the page
+ * containing vaddr, and how many bytes of that page come from the object.
+ */
+int
+vm_map_lookup(struct vm *vm, vaddr_t vaddr, struct vm_object **vmop, off_t *offp, size_t *lenp)
+{
+	struct vm_map *vmm;
+	size_t o;
+
+	vaddr = PAGE_FLOOR(vaddr);
+
+	VM_SLOCK(vm);
+	vmm = vm_find_map(vm, vaddr);
+	if (vmm == NULL) {
+		VM_SUNLOCK(vm);
+		return (ERROR_NOT_FOUND);
+	}
+
+	o = vaddr - vmm->vmm_base;
+	if (vmm->vmm_object != NULL)
+		vm_object_hold(vmm->vmm_object);
+	*vmop = vmm->vmm_object;
+	*offp = vmm->vmm_offset + o;
+	if (o >= vmm->vmm_length)
+		*lenp = 0;
+	else
+		*lenp = MIN(vmm->vmm_length - o, PAGE_SIZE);
+	VM_SUNLOCK(vm);
+
+	return (0);
+}
+
+int
+vm_map_object(struct vm *vm, vaddr_t begin, vaddr_t end, struct vm_object *vmo, off_t off, size_t len)
+{
+	return (vm_map_insert(vm, begin, end, vmo, off, len));
+}
+
+/*
+ * Remove the maps covering [begin, end), dropping their references to the
+ * backing objects.  A map which extends beyond the range is trimmed to what
+ * is left of it, or split in two if the range is in its middle.  Pages which
+ * have already been faulted in are left alone.
+ */
+int
+vm_map_remove(struct vm *vm, vaddr_t begin, vaddr_t end)
+{
+	struct vm_map *vmm, *iter, *split;
+	vaddr_t top;
+	size_t o;
+	bool found;
+
+	ASSERT(PAGE_ALIGNED(begin) && PAGE_ALIGNED(end),
+	       "Mapping must be page-aligned.");
+
+	found = false;
+	split = NULL;
+	for (;;) {
+		VM_XLOCK(vm);
+		vmm = vm_next_map(vm, begin);
+		if (vmm == NULL || vmm->vmm_base >= end) {
+			VM_XUNLOCK(vm);
+			break;
+		}
+		found = true;
+		top = vmm->vmm_base + PAGE_TO_ADDR(vmm->vmm_size);
+
+		if (vmm->vmm_base < begin && top > end) {
+			/*
+			 * The range is in the middle of the map, so the part
+			 * after it needs a map of its own.
+			 */
+			if (split == NULL) {
+				VM_XUNLOCK(vm);
+				split = pool_allocate(&vm_map_pool);
+				if (split == NULL)
+					return (ERROR_EXHAUSTED);
+				continue;
+			}
+			o = end - vmm->vmm_base;
+			split->vmm_base = end;
+			split->vmm_size = ADDR_TO_PAGE(top - end);
+			split->vmm_object = vmm->vmm_object;
+			split->vmm_offset = vmm->vmm_offset + o;
+			split->vmm_length = vmm->vmm_length > o ? vmm->vmm_length - o : 0;
+			BTREE_NODE_INIT(&split->vmm_tree);
+			if (split->vmm_object != NULL)
+				vm_object_hold(split->vmm_object);
+
+			vmm->vmm_size = ADDR_TO_PAGE(begin - vmm->vmm_base);
+			vmm->vmm_length = MIN(vmm->vmm_length, begin - vmm->vmm_base);
+			BTREE_INSERT(split, iter, &vm->vm_maps, vmm_tree,
+				     (split->vmm_base < iter->vmm_base));
+			VM_XUNLOCK(vm);
+			return (0);
+		}
+
+		if (vmm->vmm_base < begin) {
+			/* Keep the part before the range.  */
+			vmm->vmm_size = ADDR_TO_PAGE(begin - vmm->vmm_base);
+			vmm->vmm_length = MIN(vmm->vmm_length, begin - vmm->vmm_base);
+			VM_XUNLOCK(vm);
+			continue;
+		}
+
+		if (top > end) {
+			/* Keep the part after the range.  */
+			o = end - vmm->vmm_base;
+			vmm->vmm_base = end;
+			vmm->vmm_size = ADDR_TO_PAGE(top - end);
+			vmm->vmm_offset += o;
+			vmm->vmm_length = vmm->vmm_length > o ? vmm->vmm_length - o : 0;
+			VM_XUNLOCK(vm);
+			break;
+		}
+
+		BTREE_REMOVE(vmm, iter, &vm->vm_maps, vmm_tree);
+		VM_XUNLOCK(vm);
+
+		if (vmm->vmm_object != NULL)
+			vm_object_release(vmm->vmm_object);
+		pool_free(vmm);
+	}
+
+	if (split != NULL)
+		pool_free(split);
+	if (!found)
+		return (ERROR_NOT_FOUND);
+	return (0);
+}
+
+static struct vm_map *
+vm_find_map(struct vm *vm, vaddr_t vaddr)
+{
+	struct vm_map *iter;
+	struct vm_map *vmm;
+
+	RWLOCK_ASSERT_HELD(&vm->vm_lock);
+
+	BTREE_FIND(&vmm, iter, &vm->vm_maps, vmm_tree,
+		   (vaddr < iter->vmm_base),
+		   ((vaddr == iter->vmm_base) ||
+		    (vaddr > iter->vmm_base &&
+		     vaddr < (iter->vmm_base + PAGE_TO_ADDR(iter->vmm_size)))));
+	return (vmm);
+}
+
+static int
+vm_map_insert(struct vm *vm, vaddr_t begin, vaddr_t end, struct vm_object *vmo, off_t off, size_t len)
+{
+	struct vm_map *vmm, *iter;
+
+	ASSERT(PAGE_ALIGNED(begin) && PAGE_ALIGNED(end),
+	       "Mapping must be page-aligned.");
+	ASSERT(PAGE_ALIGNED(off), "Object offset must be page-aligned.");
+	ASSERT(len <= end - begin, "Cannot map more than the range.");
+	ASSERT(vmo != NULL || len == 0, "Anonymous memory has no contents.");
+
+	vmm = pool_allocate(&vm_map_pool);
+	if (vmm == NULL)
+		return (ERROR_EXHAUSTED);
+	vmm->vmm_base = begin;
+	vmm->vmm_size = ADDR_TO_PAGE(end - begin);
+	vmm->vmm_object = vmo;
+	vmm->vmm_offset = off;
+	vmm->vmm_length = len;
+	BTREE_NODE_INIT(&vmm->vmm_tree);
+
+	if (vmo != NULL)
+		vm_object_hold(vmo);
+
+	/*
+	 * Any map which overlaps the new one, whether it covers either end
+	 * or lies wholly inside it, is the first map ending after begin.
+	 */
+	VM_XLOCK(vm);
+	iter = vm_next_map(vm, begin);
+	if (iter != NULL && iter->vmm_base < end) {
+		VM_XUNLOCK(vm);
+		if (vmo != NULL)
+			vm_object_release(vmo);
+		pool_free(vmm);
+		return (ERROR_NOT_FREE);
+	}
+	BTREE_INSERT(vmm, iter, &vm->vm_maps, vmm_tree,
+		     (vmm->vmm_base < iter->vmm_base));
+	VM_XUNLOCK(vm);
+
+	return (0);
+}
+
+/*
+ * Find the first map which ends after vaddr.  Maps never overlap, so this is
+ * also the first map at or after vaddr.
+ */
+static struct vm_map *
+vm_next_map(struct vm *vm, vaddr_t vaddr)
+{
+	struct vm_map *iter, *next;
+
+	RWLOCK_ASSERT_HELD(&vm->vm_lock);
+
+	next = NULL;
+	iter = vm->vm_maps.child;
+	while (iter != NULL) {
+		if (iter->vmm_base + PAGE_TO_ADDR(iter->vmm_size) <= vaddr) {
+			iter = iter->vmm_tree.right;
+			continue;
+		}
+		next = iter;
+		iter = iter->vmm_tree.left;
+	}
+	return (next);
+}
+
+#ifdef DB
+static void
+db_vm_map_dump(struct vm_map *vmm)
+{
+	printf("VM Map %p [ %p ... %p (%zu pages) ] object %p offset %jx length %zu\n",
+		 vmm, (void *)vmm->vmm_base,
+		 (void *)(vmm->vmm_base + vmm->vmm_size * PAGE_SIZE),
+		 vmm->vmm_size, vmm->vmm_object, (uintmax_t)vmm->vmm_offset,
+		 vmm->vmm_length);
+}
+
+static void
+db_vm_map_dump_task(void)
+{
+	struct task *task = current_task();
+	struct vm_map *vmm;
+
+	if (task != NULL) {
+		if ((task->t_flags & TASK_KERNEL) == 0) {
+			BTREE_FOREACH(vmm, &task->t_vm->vm_maps, vmm_tree,
+				      (db_vm_map_dump(vmm)));
+		} else {
+			printf("Kernel tasks do not have their own VM spaces.\n");
+		}
+	} else {
+		printf("No running task.\n");
+	}
+}
+DB_COMMAND(task, vm_map, db_vm_map_dump_task);
+#endif
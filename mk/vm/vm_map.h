@@ -0,0 +1,15 @@
+#ifndef	_VM_VM_MAP_H_
+#define	_VM_VM_MAP_H_
+
+struct vm;
+struct vm_object;
+
+int vm_init_map(void);
+
+int vm_map_anonymous(struct vm *, vaddr_t, vaddr_t) __non_null(1) __check_result;
+bool vm_map_is_anonymous(struct vm *, vaddr_t, vaddr_t) __non_null(1);
+int vm_map_lookup(struct vm *, vaddr_t, struct vm_object **, off_t *, size_t *) __non_null(1, 3, 4, 5) __check_result;
+int vm_map_object(struct vm *, vaddr_t, vaddr_t, struct vm_object *, off_t, size_t) __non_null(1, 4) __check_result;
+int vm_map_remove(struct vm *, vaddr_t, vaddr_t) __non_null(1) __check_result;
+
+#endif /* !_VM_VM_MAP_H_ */
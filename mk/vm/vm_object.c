@@ -0,0 +1,408 @@
+#include <core/types.h>
+#include <core/btree.h>
+#include <core/error.h>
+#include <core/mutex.h>
+#include <core/pool.h>
+#include <cpu/atomic.h>
+#include <cpu/pmap.h>
+#ifdef DB
+#include <db/db_command.h>
+#include <core/console.h>
+#endif
+#include <fs/fs.h>
+#include <fs/fs_ops.h>
+#include <vm/vm.h>
+#include <vm/vm_object.h>
+#include <vm/vm_page.h>
+
+/*
+ * A VM object is something which can supply pages to a mapping on demand.
+ * For now that means a file, which is read through the filesystem's own
+ * operations as it is faulted on.
+ *
+ * The object holds its own open file context, so it outlives whoever asked
+ * for it to be created, such as exec.
+ *
+ * If the filesystem can tell us which file an open context refers to, the
+ * object is entered into a global table keyed on the filesystem and that
+ * file identifier, and everyone opening the same file gets the same object.
+ * Such objects keep a cache of whole pages read from the file, which are
+ * mapped copy-on-write into every address space that faults on them, so that
+ * e.g. the text of a program is only read and stored once no matter how many
+ * tasks are running it.
+ */
+struct vm_object_page {
+	off_t vmop_offset;
+	struct vm_page *vmop_page;
+	BTREE_NODE(struct vm_object_page) vmop_tree;
+};
+
+struct vm_object {
+	struct mutex vmo_mutex;
+	uint64_t vmo_refcnt;
+	unsigned vmo_flags;
+	struct fs *vmo_fs;
+	fs_file_context_t vmo_file;
+	uint64_t vmo_id;
+	BTREE_NODE(struct vm_object) vmo_tree;
+	BTREE_ROOT(struct vm_object_page) vmo_pages;
+};
+#define	VM_OBJECT_FLAG_DEFAULT	(0x00000000)
+#define	VM_OBJECT_FLAG_SHARED	(0x00000001)
+
+#define	VM_OBJECT_LOCK(vmo)	mutex_lock(&(vmo)->vmo_mutex)
+#define	VM_OBJECT_UNLOCK(vmo)	mutex_unlock(&(vmo)->vmo_mutex)
+
+#define	VM_OBJECT_CMP(fs, id, vmo)					\
+	((uintptr_t)(fs) < (uintptr_t)(vmo)->vmo_fs ||			\
+	 ((fs) == (vmo)->vmo_fs && (id) < (vmo)->vmo_id))
+
+#define	VM_OBJECT_MATCH(fs, id, vmo)					\
+	((fs) == (vmo)->vmo_fs && (id) == (vmo)->vmo_id)
+
+#ifdef DB
+DB_COMMAND_TREE(object, vm, vm_object);
+#endif
+
+static BTREE_ROOT(struct vm_object) vm_objects = BTREE_ROOT_INITIALIZER();
+static struct mutex vm_objects_lock;	/* Protects vm_objects.  */
+static struct pool vm_object_pool;
+static struct pool vm_object_page_pool;
+
+#define	VM_OBJECTS_LOCK()	mutex_lock(&vm_objects_lock)
+#define	VM_OBJECTS_UNLOCK()	mutex_unlock(&vm_objects_lock)
+
+static int vm_object_read_locked(struct vm_object *, void *, off_t, size_t);
+static int vm_object_read_page(struct vm_object *, struct vm_page *, off_t, size_t);
+
+int
+vm_init_object(void)
+{
+	int error;
+
+	mutex_init(&vm_objects_lock, "VM Objects", MUTEX_FLAG_DEFAULT);
+
+	error = pool_create(&vm_object_pool, "VM Object",
+			    sizeof (struct vm_object), POOL_DEFAULT);
+	if (error != 0)
+		return (error);
+
+	error = pool_create(&vm_object_page_pool, "VM Object Page",
+			    sizeof (struct vm_object_page), POOL_DEFAULT);
+	if (error != 0)
+		return (error);
+	return (0);
+}
+
+int
+vm_object_file(struct fs *fs, const char *path, struct vm_object **vmop)
+{
+	struct vm_object *vmo, *iter;
+	fs_file_context_t fsfc;
+	uint64_t id;
+	int error;
+
+	error = fs->fs_ops->fs_file_open(fs->fs_context, path, &fsfc);
+	if (error != 0)
+		return (error);
+
+	id = 0;
+	if (fs->fs_ops->fs_file_id != NULL) {
+		error = fs->fs_ops->fs_file_id(fs->fs_context, fsfc, &id);
+		if (error != 0) {
+			if (fs->fs_ops->fs_file_close(fs->fs_context, fsfc) != 0)
+				panic("%s: file close failed.", __func__);
+			return (error);
+		}
+
+		/*
+		 * If someone already has this file open, use their object
+		 * and its cached pages.
+		 */
+		VM_OBJECTS_LOCK();	/* Held until the new object is inserted.  */
+		BTREE_FIND(&vmo, iter, &vm_objects, vmo_tree,
+			   VM_OBJECT_CMP(fs, id, iter),
+			   VM_OBJECT_MATCH(fs, id, iter));
+		if (vmo != NULL) {
+			atomic_increment64(&vmo->vmo_refcnt);
+			VM_OBJECTS_UNLOCK();
+
+			error = fs->fs_ops->fs_file_close(fs->fs_context, fsfc);
+			if (error != 0)
+				panic("%s: file close failed: %m", __func__, error);
+
+			*vmop = vmo;
+			return (0);
+		}
+	}
+
+	vmo = pool_allocate(&vm_object_pool);
+	if (vmo == NULL) {
+		if (fs->fs_ops->fs_file_id != NULL)
+			VM_OBJECTS_UNLOCK();
+		error = fs->fs_ops->fs_file_close(fs->fs_context, fsfc);
+		if (error != 0)
+			panic("%s: file close failed: %m", __func__, error);
+		return (ERROR_EXHAUSTED);
+	}
+	mutex_init(&vmo->vmo_mutex, "VM Object", MUTEX_FLAG_DEFAULT);
+	vmo->vmo_refcnt = 1;
+	vmo->vmo_flags = VM_OBJECT_FLAG_DEFAULT;
+	vmo->vmo_fs = fs;
+	vmo->vmo_file = fsfc;
+	vmo->vmo_id = id;
+	BTREE_NODE_INIT(&vmo->vmo_tree);
+	BTREE_ROOT_INIT(&vmo->vmo_pages);
+
+	if (fs->fs_ops->fs_file_id != NULL) {
+		vmo->vmo_flags |= VM_OBJECT_FLAG_SHARED;
+		BTREE_INSERT(vmo, iter, &vm_objects, vmo_tree,
+			     VM_OBJECT_CMP(fs, id, iter));
+		VM_OBJECTS_UNLOCK();
+	}
+
+	*vmop = vmo;
+
+	return (0);
+}
+
+/*
+ * The caller must already have a reference, so the count cannot be dropping
+ * to zero underneath us and no lock is needed.  This is used with the VM's
+ * lock held, where we must not sleep.
+ */
+void
+vm_object_hold(struct vm_object *vmo)
+{
+	ASSERT(atomic_load64(&vmo->vmo_refcnt) != 0,
+	       "Cannot hold a dead object.");
+	atomic_increment64(&vmo->vmo_refcnt);
+}
+
+/*
+ * Get the page at offset off, which must lie entirely within the object.  For
+ * shared objects this comes from (or is added to) the object's page cache and
+ * must not be written to directly; the caller gets its own reference.
+ */
+int
+vm_object_page_get(struct vm_object *vmo, off_t off, struct vm_page **pagep)
+{
+	struct vm_object_page *vmop, *iter;
+	struct vm_page *page;
+	int error;
+
+	ASSERT(PAGE_ALIGNED(off), "Object offset must be page-aligned.");
+
+	if ((vmo->vmo_flags & VM_OBJECT_FLAG_SHARED) == 0)
+		return (vm_object_page_in(vmo, off, PAGE_SIZE, pagep));
+
+	VM_OBJECT_LOCK(vmo);
+	BTREE_FIND(&vmop, iter, &vmo->vmo_pages, vmop_tree,
+		   (off < iter->vmop_offset), (off == iter->vmop_offset));
+	if (vmop != NULL) {
+		page_hold(vmop->vmop_page);
+		VM_OBJECT_UNLOCK(vmo);
+		*pagep = vmop->vmop_page;
+		return (0);
+	}
+
+	error = page_alloc(PAGE_FLAG_DEFAULT, &page);
+	if (error != 0) {
+		VM_OBJECT_UNLOCK(vmo);
+		return (error);
+	}
+
+	error = vm_object_read_page(vmo, page, off, PAGE_SIZE);
+	if (error != 0) {
+		VM_OBJECT_UNLOCK(vmo);
+		page_release(page);
+		return (error);
+	}
+
+	/*
+	 * The cache keeps the reference from page_alloc.
+	 */
+	vmop = pool_allocate(&vm_object_page_pool);
+	if (vmop == NULL) {
+		VM_OBJECT_UNLOCK(vmo);
+		page_release(page);
+		return (ERROR_EXHAUSTED);
+	}
+	vmop->vmop_offset = off;
+	vmop->vmop_page = page;
+	BTREE_NODE_INIT(&vmop->vmop_tree);
+	BTREE_INSERT(vmop, iter, &vmo->vmo_pages, vmop_tree,
+		     (vmop->vmop_offset < iter->vmop_offset));
+
+	page_hold(page);
+	VM_OBJECT_UNLOCK(vmo);
+
+	*pagep = page;
+
+	return (0);
+}
+
+/*
+ * Allocate a private page and fill its first len bytes from offset off in the
+ * object.  The remainder of the page is zero.
+ */
+int
+vm_object_page_in(struct vm_object *vmo, off_t off, size_t len, struct vm_page **pagep)
+{
+	struct vm_page *page;
+	int error;
+
+	ASSERT(len <= PAGE_SIZE, "Cannot page in more than a page.");
+
+	error = page_alloc(PAGE_FLAG_ZERO, &page);
+	if (error != 0)
+		return (error);
+
+	if (len != 0) {
+		VM_OBJECT_LOCK(vmo);
+		error = vm_object_read_page(vmo, page, off, len);
+		VM_OBJECT_UNLOCK(vmo);
+		if (error != 0) {
+			page_release(page);
+			return (error);
+		}
+	}
+
+	*pagep = page;
+
+	return (0);
+}
+
+int
+vm_object_read(struct vm_object *vmo, void *buf, off_t off, size_t len)
+{
+	int error;
+
+	VM_OBJECT_LOCK(vmo);
+	error = vm_object_read_locked(vmo, buf, off, len);
+	VM_OBJECT_UNLOCK(vmo);
+
+	return (error);
+}
+
+void
+vm_object_release(struct vm_object *vmo)
+{
+	struct vm_object_page *vmop, *iter;
+	struct vm_object *oiter;
+	uint64_t refcnt;
+	int error;
+
+	for (;;) {
+		refcnt = atomic_load64(&vmo->vmo_refcnt);
+		ASSERT(refcnt != 0, "Cannot release a dead object.");
+		if (refcnt == 1)
+			break;
+		if (atomic_cmpset64(&vmo->vmo_refcnt, refcnt, refcnt - 1))
+			return;
+	}
+
+	/*
+	 * This may be the last reference.  New references to an object with
+	 * none left to lend can only come from looking it up in the table, so
+	 * hold the table's lock while taking the count to zero.
+	 */
+	VM_OBJECTS_LOCK();
+	if (!atomic_cmpset64(&vmo->vmo_refcnt, 1, 0)) {
+		atomic_decrement64(&vmo->vmo_refcnt);
+		VM_OBJECTS_UNLOCK();
+		return;
+	}
+	if ((vmo->vmo_flags & VM_OBJECT_FLAG_SHARED) != 0)
+		BTREE_REMOVE(vmo, oiter, &vm_objects, vmo_tree);
+	VM_OBJECTS_UNLOCK();
+
+	for (;;) {
+		BTREE_MIN(vmop, &vmo->vmo_pages, vmop_tree);
+		if (vmop == NULL)
+			break;
+		BTREE_REMOVE(vmop, iter, &vmo->vmo_pages, vmop_tree);
+		page_release(vmop->vmop_page);
+		pool_free(vmop);
+	}
+
+	error = vmo->vmo_fs->fs_ops->fs_file_close(vmo->vmo_fs->fs_context,
+						   vmo->vmo_file);
+	if (error != 0)
+		panic("%s: file close failed: %m", __func__, error);
+
+	pool_free(vmo);
+}
+
+static int
+vm_object_read_locked(struct vm_object *vmo, void *buf, off_t off, size_t len)
+{
+	fs_file_read_op_t *readf;
+	size_t resid;
+	int error;
+
+	readf = vmo->vmo_fs->fs_ops->fs_file_read;
+	resid = len;
+
+	while (resid != 0) {
+		len = resid;
+		error = readf(vmo->vmo_fs->fs_context, vmo->vmo_file, buf, off, &len);
+		if (error != 0)
+			return (error);
+		ASSERT(len <= resid, ("cannot have read too much data"));
+		if (len == 0) {
+			/* Ran off the end of the file.  */
+			return (ERROR_UNEXPECTED);
+		}
+		buf = (void *)((uintptr_t)buf + len);
+		off += len;
+		resid -= len;
+	}
+
+	return (0);
+}
+
+static int
+vm_object_read_page(struct vm_object *vmo, struct vm_page *page, off_t off, size_t len)
+{
+	vaddr_t vaddr;
+	int error, error2;
+
+	error = page_map_direct(&kernel_vm, page, &vaddr);
+	if (error != 0)
+		return (error);
+
+	error = vm_object_read_locked(vmo, (void *)vaddr, off, len);
+
+	error2 = page_unmap_direct(&kernel_vm, page, vaddr);
+	if (error2 != 0)
+		panic("%s: page_unmap_direct failed: %m", __func__, error2);
+
+	return (error);
+}
+
+#ifdef DB
+static void
+db_vm_object_dump(struct vm_object *vmo)
+{
+	struct vm_object_page *vmop;
+	size_t pages;
+
+	pages = 0;
+	BTREE_FOREACH(vmop, &vmo->vmo_pages, vmop_tree, (pages++));
+
+	printf("VM Object %p fs %p id %ju refcnt %ju cached pages %zu\n",
+	       vmo, vmo->vmo_fs, (uintmax_t)vmo->vmo_id,
+	       (uintmax_t)vmo->vmo_refcnt,
+	       pages);
+}
+
+static void
+db_vm_object_dump_shared(void)
+{
+	struct vm_object *vmo;
+
+	BTREE_FOREACH(vmo, &vm_objects, vmo_tree, (db_vm_object_dump(vmo)));
+}
+DB_COMMAND(shared, vm_object, db_vm_object_dump_shared);
+#endif
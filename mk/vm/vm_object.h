@@ -0,0 +1,17 @@
+#ifndef	_VM_VM_OBJECT_H_
+#define	_VM_VM_OBJECT_H_
+
+struct fs;
+struct vm_object;
+struct vm_page;
+
+int vm_init_object(void);
+
+int vm_object_file(struct fs *, const char *, struct vm_object **) __non_null(1, 2, 3) __check_result;
+void vm_object_hold(struct vm_object *) __non_null(1);
+int vm_object_page_get(struct vm_object *, off_t, struct vm_page **) __non_null(1, 3) __check_result;
+int vm_object_page_in(struct vm_object *, off_t, size_t, struct vm_page **) __non_null(1, 4) __check_result;
+int vm_object_read(struct vm_object *, void *, off_t, size_t) __non_null(1, 2) __check_result;
+void vm_object_release(struct vm_object *) __non_null(1);
+
+#endif /* !_VM_VM_OBJECT_H_ */
@@ -1,6 +1,7 @@
 #include <core/types.h>
 #include <core/btree.h>
 #include <core/error.h>
+#include <core/spinlock.h>
 #include <core/string.h>
 #include <cpu/pmap.h>
 #ifdef DB
@@ -40,7 +41,6 @@ static struct vm_page_queue page_free_queue, page_use_queue;
 static struct spinlock page_queue_lock;
 
 static void page_insert(struct vm_page *, paddr_t);
-static int page_lookup(paddr_t, struct vm_page **);
 static char page_lookup_cmp(paddr_t, struct vm_page_tree_page *,
 			    struct vm_page **);
 static void page_ref_drop(struct vm_page *);
@@ -52,7 +52,7 @@ static void page_ref_hold(struct vm_page *);
 void
 page_init(void)
 {
-	spinlock_init(&page_queue_lock, "Page queue", SPINLOCK_FLAG_DEFAULT);
+	spinlock_init(&page_queue_lock, "Page queue", SPINLOCK_FLAG_QUEUED);
 
 	BTREE_ROOT_INIT(&page_tree);
 
@@ -139,7 +139,7 @@ page_alloc_map(struct vm *vm, unsigned flags, vaddr_t vaddr)
 	struct vm_page *page;
 	int error;
 
-	error = page_alloc(flags, &page);
+	error = page_alloc_vm(vm, flags, &page);
 	if (error != 0)
 		return (error);
 
@@ -151,64 +151,85 @@ page_alloc_map(struct vm *vm, unsigned flags, vaddr_t vaddr)
 	return (0);
 }
 
+/*
+ * Allocate a page for use in the given address space, taking one it has
+ * recycled if there are any.
+ */
+int
+page_alloc_vm(struct vm *vm, unsigned flags, struct vm_page **pagep)
+{
+	struct vm_page *page;
+
+	if (vm->vm_nrecycle == 0)
+		return (page_alloc(flags, pagep));
+
+	spinlock_lock(&vm->vm_recycle_lock);
+	if (vm->vm_nrecycle == 0) {
+		spinlock_unlock(&vm->vm_recycle_lock);
+		return (page_alloc(flags, pagep));
+	}
+	page = vm->vm_recycle[--vm->vm_nrecycle];
+	spinlock_unlock(&vm->vm_recycle_lock);
+
+	if ((flags & PAGE_FLAG_ZERO) != 0)
+		pmap_zero(page);
+	*pagep = page;
+	return (0);
+}
+
 int
 page_clone(struct vm *vm, vaddr_t vaddr, struct vm_page **pagep)
 {
 	struct vm_page *page;
+	int error;
+
+	/*
+	 * XXX Locking?
+	 */
+	error = page_extract(vm, vaddr, &page);
+	if (error != 0)
+		return (error);
+
+	return (page_copy(page, pagep));
+}
+
+int
+page_copy(struct vm_page *page, struct vm_page **pagep)
+{
+	struct vm_page *copy;
 	vaddr_t src, dst;
-	paddr_t psrc, pdst;
 	int error, error2;
 
-	if (vm != &kernel_vm) {
-		/*
-		 * XXX Locking?
-		 */
-		error = pmap_extract(vm, vaddr, &psrc);
-		if (error != 0)
-			return (error);
-
-		error = pmap_map_direct(&kernel_vm, psrc, &src);
-		if (error != 0)
-			return (error);
-	} else {
-		src = vaddr;
-	}
+	error = page_alloc(PAGE_FLAG_DEFAULT, &copy);
+	if (error != 0)
+		return (error);
 
-	error = page_alloc(PAGE_FLAG_DEFAULT, &page);
+	error = pmap_map_direct(&kernel_vm, page_address(page), &src);
 	if (error != 0) {
-		if (vm != &kernel_vm) {
-			error2 = pmap_unmap_direct(&kernel_vm, src);
-			if (error2 != 0)
-				panic("%s: pmap_unmap_direct failed: %m", __func__, error);
-		}
+		page_release(copy);
 		return (error);
 	}
 
-	pdst = page_address(page);
-	error = pmap_map_direct(&kernel_vm, pdst, &dst);
+	error = pmap_map_direct(&kernel_vm, page_address(copy), &dst);
 	if (error != 0) {
-		if (vm != &kernel_vm) {
-			error2 = pmap_unmap_direct(&kernel_vm, src);
-			if (error2 != 0)
-				panic("%s: pmap_unmap_direct failed: %m", __func__, error);
-		}
-		page_release(page);
+		error2 = pmap_unmap_direct(&kernel_vm, src);
+		if (error2 != 0)
+			panic("%s: pmap_unmap_direct failed: %m", __func__, error2);
+		page_release(copy);
 		return (error);
 	}
 
 	memcpy((void *)dst, (void *)src, PAGE_SIZE);
 
-	if (vm != &kernel_vm) {
-		error = pmap_unmap_direct(&kernel_vm, src);
-		if (error != 0)
-			panic("%s: pmap_unmap_direct failed: %m", __func__, error);
-	}
+	error = pmap_unmap_direct(&kernel_vm, src);
+	if (error != 0)
+		panic("%s: pmap_unmap_direct failed: %m", __func__, error);
 
 	error = pmap_unmap_direct(&kernel_vm, dst);
 	if (error != 0)
 		panic("%s: pmap_unmap_direct failed: %m", __func__, error);
 
-	*pagep = page;
+	*pagep = copy;
 
 	return (0);
 }
@@ -351,6 +372,25 @@ page_map(struct vm *vm, vaddr_t vaddr, struct vm_page *page)
 	return (0);
 }
 
+int
+page_map_cow(struct vm *vm, vaddr_t vaddr, struct vm_page *page)
+{
+	int error;
+
+	ASSERT(PAGE_ALIGNED(vaddr), "must be a page address");
+	PAGEQ_LOCK();
+	page_ref_hold(page);
+	PAGEQ_UNLOCK();
+	error = pmap_map_cow(vm, vaddr, page);
+	if (error != 0) {
+		PAGEQ_LOCK();
+		page_ref_drop(page);
+		PAGEQ_UNLOCK();
+		return (error);
+	}
+	return (0);
+}
+
 int
 page_map_direct(struct vm *vm, struct vm_page *page, vaddr_t *vaddrp)
 {
@@ -371,15 +411,113 @@ page_map_direct(struct vm *vm, struct vm_page *page, vaddr_t *vaddrp)
 	return (error);
 }
 
+void
+page_hold(struct vm_page *page)
+{
+	PAGEQ_LOCK();
+	ASSERT(page->pg_refcnt != 0, "Cannot hold an unowned page.");
+	page_ref_hold(page);
+	PAGEQ_UNLOCK();
+}
+
+/*
+ * Give the caller's ownership reference to the address space's recycle pool.
+ * The page must no longer be mapped there.  Pages that someone else still
+ * holds, and any beyond what the pool has room for, are simply released.
+ */
+void
+page_recycle(struct vm *vm, struct vm_page *page)
+{
+	if (vm == &kernel_vm || page_shared(page)) {
+		page_release(page);
+		return;
+	}
+
+	spinlock_lock(&vm->vm_recycle_lock);
+	if (vm->vm_nrecycle == VM_RECYCLE_PAGES) {
+		spinlock_unlock(&vm->vm_recycle_lock);
+		page_release(page);
+		return;
+	}
+	vm->vm_recycle[vm->vm_nrecycle++] = page;
+	spinlock_unlock(&vm->vm_recycle_lock);
+}
+
+/*
+ * Drop the caller's ownership reference.  With copy-on-write sharing, other
+ * address spaces (or messages in flight) may still hold the page, so it is
+ * only freed when the last of those references goes away.
+ */
 void
 page_release(struct vm_page *page)
 {
 	PAGEQ_LOCK();
 	page_ref_drop(page);
-	ASSERT(page->pg_refcnt == 0, "Cannot release if refs held.");
 	PAGEQ_UNLOCK();
 }
 
+/*
+ * Remove every mapping of the page from every address space, along with the
+ * references those mappings held.  The caller must have its own reference.
+ */
+void
+page_revoke(struct vm_page *page)
+{
+	unsigned mappings;
+
+	mappings = pmap_page_remove(page);
+
+	PAGEQ_LOCK();
+	ASSERT(page->pg_refcnt > mappings, "Cannot revoke an unowned page.");
+	while (mappings-- != 0)
+		page_ref_drop(page);
+	PAGEQ_UNLOCK();
+}
+
+int
+page_share(struct vm *vm, vaddr_t vaddr, struct vm_page **pagep)
+{
+	struct vm_page *page;
+	int error;
+
+	ASSERT(PAGE_ALIGNED(vaddr), "must be a page address");
+
+	error = page_extract(vm, vaddr, &page);
+	if (error != 0)
+		return (error);
+
+	PAGEQ_LOCK();
+	page_ref_hold(page);
+	PAGEQ_UNLOCK();
+
+	/*
+	 * Check and protect the sender's mapping, then any other mapping the
+	 * page has, so that nobody is left able to write to it directly.
+	 */
+	error = pmap_protect_cow(vm, vaddr);
+	if (error != 0) {
+		page_release(page);
+		return (error);
+	}
+	pmap_page_protect_cow(page);
+
+	*pagep = page;
+
+	return (0);
+}
+
+bool
+page_shared(struct vm_page *page)
+{
+	bool shared;
+
+	PAGEQ_LOCK();
+	shared = page->pg_refcnt > 1;
+	PAGEQ_UNLOCK();
+
+	return (shared);
+}
+
 int
 page_unmap(struct vm *vm, vaddr_t vaddr, struct vm_page *page)
 {
@@ -397,6 +535,73 @@ page_unmap(struct vm *vm, vaddr_t vaddr, struct vm_page *page)
 	return (0);
 }
 
+int
+page_unshare(struct vm *vm, vaddr_t vaddr)
+{
+	struct vm_page *page, *copy;
+	bool shared;
+	int error;
+
+	ASSERT(PAGE_ALIGNED(vaddr), "must be a page address");
+
+	/*
+	 * Several threads, and the kernel wiring the page, may try to break
+	 * the same share at once.  Only the first to get the lock does so;
+	 * the others find the page no longer copy-on-write.
+	 */
+	VM_XLOCK(vm);
+	error = page_extract(vm, vaddr, &page);
+	if (error != 0) {
+		VM_XUNLOCK(vm);
+		return (error);
+	}
+
+	if (!pmap_is_cow(vm, vaddr)) {
+		VM_XUNLOCK(vm);
+		return (0);
+	}
+
+	/*
+	 * A mapped page holds one reference for its owner and one for the
+	 * mapping.  Anything beyond that is another address space or a
+	 * message in flight, and we have to take a private copy.
+	 */
+	PAGEQ_LOCK();
+	shared = page->pg_refcnt > 2;
+	PAGEQ_UNLOCK();
+
+	if (!shared) {
+		error = pmap_unprotect_cow(vm, vaddr);
+		VM_XUNLOCK(vm);
+		return (error);
+	}
+
+	error = page_copy(page, &copy);
+	if (error != 0) {
+		VM_XUNLOCK(vm);
+		return (error);
+	}
+
+	/*
+	 * Replace the mapping with the copy, which then holds both an
+	 * ownership and a mapping reference of its own.
+	 */
+	error = page_map(vm, vaddr, copy);
+	if (error != 0) {
+		VM_XUNLOCK(vm);
+		page_release(copy);
+		return (error);
+	}
+
+	PAGEQ_LOCK();
+	page_ref_drop(page);
+	page_ref_drop(page);
+	PAGEQ_UNLOCK();
+	VM_XUNLOCK(vm);
+
+	return (0);
+}
+
 int
 page_unmap_direct(struct vm *vm, struct vm_page *page, vaddr_t vaddr)
 {
@@ -417,10 +622,11 @@ page_insert(struct vm_page *page, paddr_t paddr)
 {
 	SPINLOCK_ASSERT_HELD(&page_queue_lock);
 	page->pg_refcnt = 0;
+	SLIST_INIT(&page->pg_mappings);
 	TAILQ_INSERT_TAIL(&page_free_queue.pq_queue, page, pg_link);
 }
 
-static int
+int
 page_lookup(paddr_t paddr, struct vm_page **pagep)
 {
 	struct vm_page_tree_page *ptp, *iter;
@@ -477,6 +683,8 @@ page_ref_drop(struct vm_page *page)
 	ASSERT(page->pg_refcnt != 0, "Cannot drop refcount on unheld page.");
 	page->pg_refcnt--;
 	if (page->pg_refcnt == 0) {
+		ASSERT(SLIST_EMPTY(&page->pg_mappings),
+		       "Cannot free a page which is still mapped.");
 		TAILQ_REMOVE(&page_use_queue.pq_queue, page, pg_link);
 		TAILQ_INSERT_TAIL(&page_free_queue.pq_queue, page, pg_link);
 	}
@@ -499,8 +707,8 @@ page_ref_hold(struct vm_page *page)
 static void
 db_vm_page_dump(struct vm_page *page)
 {
-	printf("vm_page %p addr %p refcnt %u\n", page, page_address(page),
-		 page->pg_refcnt);
+	printf("vm_page %p addr %p refcnt %u mappings %u\n", page,
+		 page_address(page), page->pg_refcnt, pmap_page_mappings(page));
 }
 
 static void
@@ -7,12 +7,14 @@
 #include <cpu/page.h>
 
 #ifdef MK
+struct pmap_pv;
 struct vm;
 struct vm_page;
 
 struct vm_page {
 	TAILQ_ENTRY(struct vm_page) pg_link;
 	unsigned pg_refcnt;
+	SLIST_HEAD(, struct pmap_pv) pg_mappings;	/* Owned by the pmap.  */
 };
 #endif
 
@@ -38,16 +40,26 @@ paddr_t page_address(struct vm_page *) __non_null(1) __check_result;
 int page_alloc(unsigned, struct vm_page **) __non_null(2) __check_result;
 int page_alloc_direct(struct vm *, unsigned, vaddr_t *) __non_null(1, 3) __check_result;
 int page_alloc_map(struct vm *, unsigned, vaddr_t) __non_null(1) __check_result;
+int page_alloc_vm(struct vm *, unsigned, struct vm_page **) __non_null(1, 3) __check_result;
 int page_clone(struct vm *, vaddr_t, struct vm_page **) __non_null(1, 3) __check_result;
+int page_copy(struct vm_page *, struct vm_page **) __non_null(1, 2) __check_result;
 int page_extract(struct vm *, vaddr_t, struct vm_page **) __non_null(1, 3) __check_result;
 int page_free_direct(struct vm *, vaddr_t) __non_null(1) __check_result;
 int page_free_map(struct vm *, vaddr_t) __non_null(1) __check_result;
+void page_hold(struct vm_page *) __non_null(1);
 int page_insert_pages(paddr_t, size_t) __check_result;
+int page_lookup(paddr_t, struct vm_page **) __non_null(2) __check_result;
 int page_map(struct vm *, vaddr_t, struct vm_page *) __non_null(1, 3) __check_result;
+int page_map_cow(struct vm *, vaddr_t, struct vm_page *) __non_null(1, 3) __check_result;
 int page_map_direct(struct vm *, struct vm_page *, vaddr_t *) __non_null(1, 2, 3) __check_result;
+void page_recycle(struct vm *, struct vm_page *) __non_null(1, 2);
 void page_release(struct vm_page *) __non_null(1);
+void page_revoke(struct vm_page *) __non_null(1);
+int page_share(struct vm *, vaddr_t, struct vm_page **) __non_null(1, 3) __check_result;
+bool page_shared(struct vm_page *) __non_null(1) __check_result;
 int page_unmap(struct vm *, vaddr_t, struct vm_page *) __non_null(1, 3) __check_result;
 int page_unmap_direct(struct vm *, struct vm_page *, vaddr_t) __non_null(1, 2) __check_result;
+int page_unshare(struct vm *, vaddr_t) __non_null(1) __check_result;
 #endif
 
 #endif /* !_VM_VM_PAGE_H_ */
@@ -14,6 +14,7 @@ main(int argc, char *argv[])
 {
 	bool is_hexdump;
 	ipc_port_t fs;
+	void *buf;
 	int error;
 
 	is_hexdump = strcmp(argv[0], "/bin/hexdump") == 0;
@@ -21,12 +22,18 @@ main(int argc, char *argv[])
 	while ((fs = ns_lookup("ufs0")) == IPC_PORT_UNKNOWN)
 		continue;
 
+	/*
+	 * Every read lands in the same buffer.
+	 */
+	error = vm_alloc(&buf, IPC_DATA_PAGES_MAX * PAGE_SIZE);
+	if (error != 0)
+		fatal("vm_alloc failed", error);
+
 	while (--argc) {
 		const char *path = *++argv;
 		ipc_port_t file;
 		off_t offset;
 		size_t len;
-		void *page;
 
 		error = open(fs, path, &file);
 		if (error != 0) {
@@ -36,8 +43,9 @@ main(int argc, char *argv[])
 
 		offset = 0;
 		for (;;) {
-			len = PAGE_SIZE;
-			error = read(file, &page, offset, &len);
+			len = IPC_DATA_PAGES_MAX * PAGE_SIZE;
+			error = read_buffer(file, buf, IPC_DATA_PAGES_MAX * PAGE_SIZE,
+					    offset, &len);
 			if (error != 0) {
 				printf("%s: read failed: %m\n", __func__, error);
 				break;
@@ -46,11 +54,10 @@ main(int argc, char *argv[])
 			if (len == 0)
 				break;
 			if (!is_hexdump)
-				putsn(page, len);
+				putsn(buf, len);
 			else
-				hexdump(page, len);
+				hexdump(buf, len);
 			offset += len;
-			vm_page_free(page);
 		}
 
 		error = close(file);
@@ -59,4 +66,8 @@ main(int argc, char *argv[])
 			continue;
 		}
 	}
+
+	error = vm_free(buf, IPC_DATA_PAGES_MAX * PAGE_SIZE);
+	if (error != 0)
+		fatal("vm_free failed", error);
 }
@@ -72,6 +72,13 @@ process_file(ipc_port_t fs, const char *path)
 		return;
 	}
 
+	/*
+	 * Every read lands in the same page.
+	 */
+	error = vm_alloc(&page, PAGE_SIZE);
+	if (error != 0)
+		fatal("vm_alloc failed", error);
+
 	offset = 0;
 	for (;;) {
 		unsigned i;
@@ -79,10 +86,10 @@ process_file(ipc_port_t fs, const char *path)
 		char *buf;
 
 		len = PAGE_SIZE;
-		error = read(file, &page, offset, &len);
+		error = read_buffer(file, page, PAGE_SIZE, offset, &len);
 		if (error != 0) {
 			printf("%s: read failed: %m\n", __func__, error);
-			return;
+			break;
 		}
 		if (len == 0)
 			break;
@@ -104,9 +111,12 @@ process_file(ipc_port_t fs, const char *path)
 			fatal("exec line failed", error);
 
 		offset += i + 1;
-		vm_page_free(page);
 	}
 
+	error = vm_free(page, PAGE_SIZE);
+	if (error != 0)
+		fatal("vm_free failed", error);
+
 	error = close(file);
 	if (error != 0)
 		fatal("close failed", error);
@@ -9,6 +9,7 @@ int vm_page_free(void *);
 int vm_alloc(void **, size_t);
 int vm_alloc_range(void *, void *);
 int vm_free(void *, size_t);
+int vm_recycle(void *, size_t);
 
 int getchar(void);
 void putchar(int);
@@ -36,6 +37,7 @@ void free(void *);
 
 int open(ipc_port_t, const char *, ipc_port_t *);
 int read(ipc_port_t, void **, off_t, size_t *);
+int read_buffer(ipc_port_t, void *, size_t, off_t, size_t *);
 int close(ipc_port_t);
 int exec(ipc_port_t, ipc_port_t *, bool, unsigned, const char **);
 
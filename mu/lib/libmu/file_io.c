@@ -9,6 +9,8 @@
 #include <libmu/ipc_request.h>
 #include <libmu/process.h>
 
+static int read_request(ipc_port_t, void *, size_t, void **, off_t, size_t *);
+
 int
 open(ipc_port_t fs, const char *path, ipc_port_t *filep)
 {
@@ -47,38 +49,21 @@ open(ipc_port_t fs, const char *path, ipc_port_t *filep)
 int
 read(ipc_port_t file, void **bufp, off_t off, size_t *lenp)
 {
-	struct ipc_request_message req;
-	struct ipc_response_message resp;
-	struct fs_file_read_request fsreq;
-	int error;
-
-	memset(&req, 0, sizeof req);
-	memset(&resp, 0, sizeof resp);
-	memset(&fsreq, 0, sizeof fsreq);
-
-	fsreq.offset = off;
-	fsreq.length = *lenp;
-
-	req.src = IPC_PORT_UNKNOWN;
-	req.dst = file;
-	req.msg = FS_FILE_MSG_READ;
-	req.param = 0;
-	req.data = &fsreq;
-	req.datalen = sizeof fsreq;
-
-	resp.data = true;
-
-	error = ipc_request(&req, &resp);
-	if (error != 0)
-		return (error);
-
-	if (resp.error != 0)
-		return (resp.error);
+	return (read_request(file, NULL, 0, bufp, off, lenp));
+}
 
-	*bufp = resp.page;
-	*lenp = resp.param;
+/*
+ * Read into a buffer of whole pages from vm_alloc, which can be used again for
+ * every read without anything being allocated or freed.
+ */
+int
+read_buffer(ipc_port_t file, void *buf, size_t buflen, off_t off, size_t *lenp)
+{
+	void *page;
 
-	return (0);
+	if (*lenp > buflen)
+		*lenp = buflen;
+	return (read_request(file, buf, buflen, &page, off, lenp));
 }
 
 int
@@ -182,3 +167,43 @@ exec(ipc_port_t file, ipc_port_t *taskp, bool wait, unsigned argc, const char **
 
 	return (0);
 }
+
+static int
+read_request(ipc_port_t file, void *buf, size_t buflen, void **bufp, off_t off,
+	     size_t *lenp)
+{
+	struct ipc_request_message req;
+	struct ipc_response_message resp;
+	struct fs_file_read_request fsreq;
+	int error;
+
+	memset(&req, 0, sizeof req);
+	memset(&resp, 0, sizeof resp);
+	memset(&fsreq, 0, sizeof fsreq);
+
+	fsreq.offset = off;
+	fsreq.length = *lenp;
+
+	req.src = IPC_PORT_UNKNOWN;
+	req.dst = file;
+	req.msg = FS_FILE_MSG_READ;
+	req.param = 0;
+	req.data = &fsreq;
+	req.datalen = sizeof fsreq;
+
+	resp.data = true;
+	resp.buf = buf;
+	resp.buflen = buflen;
+
+	error = ipc_request(&req, &resp);
+	if (error != 0)
+		return (error);
+
+	if (resp.error != 0)
+		return (resp.error);
+
+	*bufp = resp.page;
+	*lenp = resp.param;
+
+	return (0);
+}
@@ -2,18 +2,24 @@
 #include <core/error.h>
 #include <core/string.h>
 #include <ipc/ipc.h>
+#include <ipc/mailbox.h>
 #include <vm/vm_page.h>
 
 #include <libmu/common.h>
 #include <libmu/ipc_dispatch.h>
 
-static void ipc_dispatch_message(const struct ipc_dispatch *,
+static struct ipc_dispatch_handler **ipc_dispatch_find(struct ipc_dispatch_handler **,
+						       ipc_cookie_t);
+static void ipc_dispatch_message(struct ipc_dispatch *,
 				 const struct ipc_header *, void *);
+static void ipc_dispatch_receive(struct ipc_dispatch *);
 
 struct ipc_dispatch *
 ipc_dispatch_allocate(ipc_port_t port, ipc_port_flags_t flags)
 {
 	struct ipc_dispatch *id;
+	unsigned i;
+	void *page;
 	int error;
 
 	id = malloc(sizeof *id);
@@ -27,10 +33,20 @@ ipc_dispatch_allocate(ipc_port_t port, ipc_port_flags_t flags)
 			fatal("could not allocate port", error);
 	}
 
+	error = vm_page_get(&page);
+	if (error != 0)
+		fatal("could not allocate mailbox", error);
+
 	id->id_port = port;
+	id->id_mailbox = page;
 	id->id_cookie_next = 0;
-	id->id_handlers = NULL;
+	for (i = 0; i < IPC_DISPATCH_BUCKETS; i++) {
+		id->id_handlers[i] = NULL;
+		id->id_requests[i] = NULL;
+	}
+	id->id_nhandlers = 0;
 	id->id_default = NULL;
+	id->id_nrequests = 0;
 
 	return (id);
 }
@@ -39,51 +55,52 @@ void
 ipc_dispatch_free(struct ipc_dispatch *id)
 {
 	struct ipc_dispatch_handler *idh;
+	unsigned i;
+	int error;
 
-	while ((idh = id->id_handlers) != NULL) {
-		id->id_handlers = idh->idh_next;
-		free(idh);
+	for (i = 0; i < IPC_DISPATCH_BUCKETS; i++) {
+		while ((idh = id->id_handlers[i]) != NULL) {
+			id->id_handlers[i] = idh->idh_next;
+			free(idh);
+		}
+		while ((idh = id->id_requests[i]) != NULL) {
+			id->id_requests[i] = idh->idh_next;
+			free(idh);
+		}
 	}
 
 	if (id->id_default != NULL)
 		free(id->id_default);
 
+	error = vm_page_free(id->id_mailbox);
+	if (error != 0)
+		fatal("vm_page_free failed", error);
+
 	/* XXX free port.  */
 
 	free(id);
 }
 
 void
-ipc_dispatch(const struct ipc_dispatch *id)
+ipc_dispatch(struct ipc_dispatch *id)
 {
-	struct ipc_header ipch;
-	void *page;
-	int error;
-
-	if (id->id_handlers == NULL && id->id_default == NULL)
+	if (id->id_nhandlers == 0 && id->id_default == NULL &&
+	    id->id_nrequests == 0)
 		fatal("no handlers registered", ERROR_UNEXPECTED);
 
-	for (;;) {
-		error = ipc_port_wait(id->id_port);
-		if (error != 0)
-			fatal("ipc_port_wait failed", error);
-
-		error = ipc_port_receive(id->id_port, &ipch, &page);
-		if (error != 0)
-			fatal("ipc_port_receive failed", error);
-
-		ipc_dispatch_message(id, &ipch, page);
-	}
+	for (;;)
+		ipc_dispatch_receive(id);
 }
 
 bool
-ipc_dispatch_poll(const struct ipc_dispatch *id)
+ipc_dispatch_poll(struct ipc_dispatch *id)
 {
 	struct ipc_header ipch;
 	void *page;
 	int error;
 
-	if (id->id_handlers == NULL && id->id_default == NULL)
+	if (id->id_nhandlers == 0 && id->id_default == NULL &&
+	    id->id_nrequests == 0)
 		fatal("no handlers registered", ERROR_UNEXPECTED);
 
 	error = ipc_port_receive(id->id_port, &ipch, &page);
@@ -99,17 +116,21 @@ const struct ipc_dispatch_handler *
 ipc_dispatch_register(struct ipc_dispatch *id, ipc_dispatch_callback_t *cb,
 		      void *softc)
 {
-	struct ipc_dispatch_handler *idh;
+	struct ipc_dispatch_handler *idh, **bucket;
 
 	idh = malloc(sizeof *idh);
 	if (idh == NULL)
 		fatal("could not allocate memory for handler", ERROR_EXHAUSTED);
 
 	idh->idh_cookie = id->id_cookie_next++;
+	idh->idh_port = IPC_PORT_UNKNOWN;
 	idh->idh_softc = softc;
 	idh->idh_callback = cb;
-	idh->idh_next = id->id_handlers;
-	id->id_handlers = idh;
+
+	bucket = &id->id_handlers[idh->idh_cookie % IPC_DISPATCH_BUCKETS];
+	idh->idh_next = *bucket;
+	*bucket = idh;
+	id->id_nhandlers++;
 
 	return (idh);
 }
@@ -129,6 +150,7 @@ ipc_dispatch_register_default(struct ipc_dispatch *id,
 		fatal("could not allocate memory for handler", ERROR_EXHAUSTED);
 
 	idh->idh_cookie = 0;
+	idh->idh_port = IPC_PORT_UNKNOWN;
 	idh->idh_softc = softc;
 	idh->idh_callback = cb;
 	idh->idh_next = NULL;
@@ -137,6 +159,82 @@ ipc_dispatch_register_default(struct ipc_dispatch *id,
 	return (idh);
 }
 
+/*
+ * Send a request without waiting for the reply, which is passed to cb, with
+ * softc in the handler, when ipc_dispatch or ipc_dispatch_requests receives
+ * it.  The handler is freed once cb returns.  Any number of requests may be
+ * outstanding at once.
+ */
+int
+ipc_dispatch_request(struct ipc_dispatch *id, ipc_port_t dst, ipc_msg_t msg,
+		     ipc_parameter_t param, const void *data, size_t datalen,
+		     ipc_dispatch_callback_t *cb, void *softc)
+{
+	struct ipc_dispatch_handler *idh, **bucket;
+	struct ipc_header ipch;
+	void *page;
+	int error, error2;
+
+	if (datalen > PAGE_SIZE)
+		fatal("data too big for page", ERROR_NOT_IMPLEMENTED);
+
+	idh = malloc(sizeof *idh);
+	if (idh == NULL)
+		return (ERROR_EXHAUSTED);
+	idh->idh_cookie = id->id_cookie_next++;
+	idh->idh_port = dst;
+	idh->idh_softc = softc;
+	idh->idh_callback = cb;
+
+	ipch.ipchdr_src = id->id_port;
+	ipch.ipchdr_dst = dst;
+	ipch.ipchdr_right = IPC_PORT_RIGHT_SEND_ONCE;
+	ipch.ipchdr_msg = msg;
+	ipch.ipchdr_cookie = idh->idh_cookie;
+	ipch.ipchdr_param = param;
+
+	if (data == NULL || datalen == 0) {
+		error = ipc_port_send_data(&ipch, NULL, 0);
+	} else if (datalen <= IPC_DATA_INLINE_MAX) {
+		error = ipc_port_send_data(&ipch, data, datalen);
+	} else {
+		error = vm_page_get(&page);
+		if (error != 0) {
+			free(idh);
+			return (error);
+		}
+		memcpy(page, data, datalen);
+		error = ipc_port_send(&ipch, page);
+		if (error != 0) {
+			error2 = vm_page_free(page);
+			if (error2 != 0)
+				fatal("vm_page_free failed", error2);
+		}
+	}
+	if (error != 0) {
+		free(idh);
+		return (error);
+	}
+
+	bucket = &id->id_requests[idh->idh_cookie % IPC_DISPATCH_BUCKETS];
+	idh->idh_next = *bucket;
+	*bucket = idh;
+	id->id_nrequests++;
+
+	return (0);
+}
+
+/*
+ * Dispatch messages until every outstanding request has been answered.  This
+ * must not be called from a callback, since the mailbox is still in use.
+ */
+void
+ipc_dispatch_requests(struct ipc_dispatch *id)
+{
+	while (id->id_nrequests != 0)
+		ipc_dispatch_receive(id);
+}
+
 int
 ipc_dispatch_send(const struct ipc_dispatch *id,
 		  const struct ipc_dispatch_handler *idh,
@@ -145,7 +243,7 @@ ipc_dispatch_send(const struct ipc_dispatch *id,
 {
 	struct ipc_header ipch;
 	void *page;
-	int error;
+	int error, error2;
 
 	if (data == NULL || datalen == 0) {
 		page = NULL;
@@ -169,10 +267,11 @@ ipc_dispatch_send(const struct ipc_dispatch *id,
 
 	error = ipc_port_send(&ipch, page);
 	if (error != 0) {
-		/*
-		 * XXX
-		 * Do we need to free page?
-		 */
+		if (page != NULL) {
+			error2 = vm_page_free(page);
+			if (error2 != 0)
+				fatal("vm_page_free failed", error2);
+		}
 		return (error);
 	}
 
@@ -186,7 +285,7 @@ ipc_dispatch_send_reply(const struct ipc_dispatch *id,
 {
 	struct ipc_header ipch;
 	void *page;
-	int error;
+	int error, error2;
 
 	if (data == NULL || datalen == 0) {
 		page = NULL;
@@ -205,10 +304,11 @@ ipc_dispatch_send_reply(const struct ipc_dispatch *id,
 
 	error = ipc_port_send(&ipch, page);
 	if (error != 0) {
-		/*
-		 * XXX
-		 * Do we need to free page?
-		 */
+		if (page != NULL) {
+			error2 = vm_page_free(page);
+			if (error2 != 0)
+				fatal("vm_page_free failed", error2);
+		}
 		return (error);
 	}
 
@@ -216,6 +316,31 @@ ipc_dispatch_send_reply(const struct ipc_dispatch *id,
 
 }
 
+/*
+ * Remove and free a handler, which may be the default handler.  Messages
+ * which would have gone to it go to the default handler instead.
+ */
+void
+ipc_dispatch_unregister(struct ipc_dispatch *id,
+			const struct ipc_dispatch_handler *idh)
+{
+	struct ipc_dispatch_handler *victim, **idhp;
+
+	if (idh == id->id_default) {
+		free(id->id_default);
+		id->id_default = NULL;
+		return;
+	}
+
+	idhp = ipc_dispatch_find(id->id_handlers, idh->idh_cookie);
+	if (idhp == NULL || *idhp != idh)
+		fatal("attempt to unregister unknown handler", ERROR_NOT_FOUND);
+	victim = *idhp;
+	*idhp = victim->idh_next;
+	id->id_nhandlers--;
+	free(victim);
+}
+
 void
 ipc_dispatch_wait(const struct ipc_dispatch *id)
 {
@@ -226,15 +351,46 @@ ipc_dispatch_wait(const struct ipc_dispatch *id)
 		fatal("ipc_port_wait failed", error);
 }
 
+/*
+ * Returns the link to the entry in a table with this cookie, or NULL.
+ */
+static struct ipc_dispatch_handler **
+ipc_dispatch_find(struct ipc_dispatch_handler **table, ipc_cookie_t cookie)
+{
+	struct ipc_dispatch_handler **idhp;
+
+	for (idhp = &table[cookie % IPC_DISPATCH_BUCKETS]; *idhp != NULL;
+	     idhp = &(*idhp)->idh_next) {
+		if ((*idhp)->idh_cookie == cookie)
+			return (idhp);
+	}
+	return (NULL);
+}
+
 static void
-ipc_dispatch_message(const struct ipc_dispatch *id,
+ipc_dispatch_message(struct ipc_dispatch *id,
 		     const struct ipc_header *ipch, void *page)
 {
-	struct ipc_dispatch_handler *idh;
+	struct ipc_dispatch_handler *idh, **idhp;
+
+	/*
+	 * A reply from where a request went completes it.
+	 */
+	if ((ipch->ipchdr_msg & IPC_MSG_FLAG_MASK) != IPC_MSG_FLAG_REQUEST) {
+		idhp = ipc_dispatch_find(id->id_requests, ipch->ipchdr_cookie);
+		if (idhp != NULL && (*idhp)->idh_port == ipch->ipchdr_src) {
+			idh = *idhp;
+			*idhp = idh->idh_next;
+			id->id_nrequests--;
+			idh->idh_callback(id, idh, ipch, page);
+			free(idh);
+			return;
+		}
+	}
 
-	for (idh = id->id_handlers; idh != NULL; idh = idh->idh_next) {
-		if (idh->idh_cookie != ipch->ipchdr_cookie)
-			continue;
+	idhp = ipc_dispatch_find(id->id_handlers, ipch->ipchdr_cookie);
+	if (idhp != NULL) {
+		idh = *idhp;
 		idh->idh_callback(id, idh, ipch, page);
 		return;
 	}
@@ -246,3 +402,37 @@ ipc_dispatch_message(const struct ipc_dispatch *id,
 
 	ipc_message_drop(ipch, page);
 }
+
+/*
+ * Messages are received through the mailbox, waiting for the first and taking
+ * as many more as are queued in the same system call.
+ */
+static void
+ipc_dispatch_receive(struct ipc_dispatch *id)
+{
+	struct ipc_mailbox_receive *imr;
+	struct ipc_mailbox *mb;
+	unsigned i;
+	int error;
+
+	mb = id->id_mailbox;
+
+	mb->imb_send_count = 0;
+	mb->imb_receive_offset = sizeof *mb;
+	mb->imb_receive_count = (PAGE_SIZE - sizeof *mb) /
+		sizeof (struct ipc_mailbox_receive);
+	mb->imb_receive_port = id->id_port;
+	mb->imb_flags = IPC_MAILBOX_FLAG_WAIT | IPC_MAILBOX_FLAG_PAGES;
+
+	error = ipc_mailbox(mb);
+	if (error != 0) {
+		if (error == ERROR_AGAIN)
+			return;
+		fatal("ipc_mailbox failed", error);
+	}
+
+	for (i = 0; i < mb->imb_receive_count; i++) {
+		imr = IPC_MAILBOX_RECEIVE(mb, i);
+		ipc_dispatch_message(id, &imr->imr_header, imr->imr_page);
+	}
+}
@@ -2,20 +2,33 @@
 #define	IPC_DISPATCH_H
 
 struct ipc_dispatch_handler;
+struct ipc_mailbox;
+
+/*
+ * Handlers and outstanding requests are kept in hash tables by cookie, so that
+ * a message can be matched to its handler or request however many there are.
+ * Cookies are handed out in sequence, so they spread evenly over the buckets.
+ */
+#define	IPC_DISPATCH_BUCKETS	(64)
 
 struct ipc_dispatch {
 	ipc_port_t id_port;
+	struct ipc_mailbox *id_mailbox;
 	unsigned id_cookie_next;
-	struct ipc_dispatch_handler *id_handlers;
+	struct ipc_dispatch_handler *id_handlers[IPC_DISPATCH_BUCKETS];
+	unsigned id_nhandlers;
 	struct ipc_dispatch_handler *id_default;
+	struct ipc_dispatch_handler *id_requests[IPC_DISPATCH_BUCKETS];
+	unsigned id_nrequests;
 };
 
-typedef	void ipc_dispatch_callback_t(const struct ipc_dispatch *,
+typedef	void ipc_dispatch_callback_t(struct ipc_dispatch *,
 				     const struct ipc_dispatch_handler *,
 				     const struct ipc_header *, void *);
 
 struct ipc_dispatch_handler {
 	unsigned idh_cookie;
+	ipc_port_t idh_port;		/* Where a request's reply comes from.  */
 	void *idh_softc;
 	ipc_dispatch_callback_t *idh_callback;
 	struct ipc_dispatch_handler *idh_next;
@@ -23,14 +36,20 @@ struct ipc_dispatch_handler {
 
 struct ipc_dispatch *ipc_dispatch_allocate(ipc_port_t, ipc_port_flags_t);
 void ipc_dispatch_free(struct ipc_dispatch *);
-void ipc_dispatch(const struct ipc_dispatch *);
-bool ipc_dispatch_poll(const struct ipc_dispatch *);
+void ipc_dispatch(struct ipc_dispatch *);
+bool ipc_dispatch_poll(struct ipc_dispatch *);
 const struct ipc_dispatch_handler *
 	ipc_dispatch_register(struct ipc_dispatch *,
 			      ipc_dispatch_callback_t *, void *);
 const struct ipc_dispatch_handler *
 	ipc_dispatch_register_default(struct ipc_dispatch *,
 				      ipc_dispatch_callback_t *, void *);
+int ipc_dispatch_request(struct ipc_dispatch *, ipc_port_t, ipc_msg_t,
+			 ipc_parameter_t, const void *, size_t,
+			 ipc_dispatch_callback_t *, void *);
+void ipc_dispatch_requests(struct ipc_dispatch *);
+void ipc_dispatch_unregister(struct ipc_dispatch *,
+			     const struct ipc_dispatch_handler *);
 int ipc_dispatch_send(const struct ipc_dispatch *,
 		      const struct ipc_dispatch_handler *,
 		      ipc_port_t, ipc_msg_t, ipc_port_right_t,
@@ -2,11 +2,14 @@
 #include <core/error.h>
 #include <core/string.h>
 #include <ipc/ipc.h>
+#include <ipc/thread.h>
 #include <vm/vm_page.h>
 
 #include <libmu/common.h>
 #include <libmu/ipc_request.h>
 
+static int ipc_request_receive(const struct ipc_request_message *, struct ipc_response_message *, ipc_port_t, ipc_cookie_t);
+
 /*
  * An ideal synchronous IPC API would ask the user:
  * 	1) What port are you sending from? [optional]
@@ -14,6 +17,7 @@
  * 	3) Are you sending any data?
  * 		a) Is it a page to be flipped?
  * 		b) Is it data we should copy to a page?
+ * 		c) Is it small enough to go in the message itself?
  * 	4) What kind of message are you sending?
  * 	5) Do you anticipate any data in the reply case?
  *
@@ -33,34 +37,58 @@ ipc_request(const struct ipc_request_message *req,
 	    struct ipc_response_message *resp)
 {
 	struct ipc_header ipch;
+	ipc_cookie_t cookie;
 	ipc_port_t req_port;
 	int error, error2;
+	struct ipc_page_vector ipcpv[IPC_DATA_PAGES_MAX];
+	bool inline_data;
+	unsigned i, npages;
 	void *page;
 
+	inline_data = false;
+	npages = 1;
 	if (req->data != NULL && req->datalen != 0) {
-		if (req->datalen > PAGE_SIZE)
+		if (req->datalen > IPC_DATA_PAGES_MAX * PAGE_SIZE)
 			return (ERROR_INVALID);
-		error = vm_page_get(&page);
-		if (error != 0)
-			return (error);
-		memcpy(page, req->data, req->datalen);
+		if (req->datalen <= IPC_DATA_INLINE_MAX) {
+			/*
+			 * The kernel copies this straight into the message.
+			 */
+			inline_data = true;
+			page = NULL;
+		} else if (req->datalen <= PAGE_SIZE) {
+			error = vm_page_get(&page);
+			if (error != 0)
+				return (error);
+			memcpy(page, req->data, req->datalen);
+		} else {
+			npages = PAGE_COUNT(req->datalen);
+			error = vm_alloc(&page, npages * PAGE_SIZE);
+			if (error != 0)
+				return (error);
+			memcpy(page, req->data, req->datalen);
+		}
 	} else {
 		page = req->page;
 	}
 
-	if (req->src == IPC_PORT_UNKNOWN) {
-		error = ipc_port_allocate(&req_port, IPC_PORT_FLAG_DEFAULT);
-		if (error != 0) {
-			if (page != NULL) {
-				error2 = vm_page_free(page);
-				if (error2 != 0)
-					fatal("vm_page_free failed", error2);
-			}
-			return (error);
+	/*
+	 * Replies come to the thread's own reply port unless the caller
+	 * gives a port, so no port need be allocated for the request.
+	 * Either way the cookie is the next in the thread's sequence, so
+	 * a late reply to an earlier request can't be taken for this one's.
+	 */
+	error = ipc_thread_reply_port(&req_port, &cookie);
+	if (error != 0) {
+		if (page != NULL) {
+			error2 = vm_free(page, npages * PAGE_SIZE);
+			if (error2 != 0)
+				fatal("vm_free failed", error2);
 		}
-	} else {
-		req_port = req->src;
+		return (error);
 	}
+	if (req->src != IPC_PORT_UNKNOWN)
+		req_port = req->src;
 
 	ipch.ipchdr_src = req_port;
 	ipch.ipchdr_dst = req->dst;
@@ -69,57 +97,81 @@ ipc_request(const struct ipc_request_message *req,
 	else
 		ipch.ipchdr_right = IPC_PORT_RIGHT_NONE;
 	ipch.ipchdr_msg = req->msg;
-	ipch.ipchdr_cookie = (ipc_cookie_t)(uintptr_t)req;
+	ipch.ipchdr_cookie = cookie;
 	ipch.ipchdr_param = req->param;
 
-	error = ipc_port_send(&ipch, page);
-	if (error != 0) {
+	if (inline_data) {
+		error = ipc_port_send_data(&ipch, req->data, req->datalen);
+	} else if (npages != 1) {
 		/*
-		 * XXX
-		 * Free req_port.
+		 * Move the buffer's pages in one message, then give back the
+		 * addresses they were mapped at.
 		 */
-		return (error);
+		for (i = 0; i < npages; i++) {
+			ipcpv[i].ipcpv_page = (char *)page + i * PAGE_SIZE;
+			ipcpv[i].ipcpv_flags = IPC_PAGE_FLAG_MOVE;
+		}
+		error = ipc_port_send_vector(&ipch, ipcpv, npages);
+		error2 = vm_free(page, npages * PAGE_SIZE);
+		if (error2 != 0)
+			fatal("vm_free failed", error2);
+	} else {
+		error = ipc_port_send(&ipch, page);
+		if (error != 0 && page != req->page) {
+			error2 = vm_page_free(page);
+			if (error2 != 0)
+				fatal("vm_page_free failed", error2);
+		}
 	}
+	if (error != 0)
+		return (error);
 
 	if (resp == NULL)
 		return (0);
 
+	return (ipc_request_receive(req, resp, req_port, cookie));
+}
+
+static int
+ipc_request_receive(const struct ipc_request_message *req,
+		    struct ipc_response_message *resp, ipc_port_t req_port,
+		    ipc_cookie_t cookie)
+{
+	struct ipc_header ipch;
+	size_t len;
+	void *page;
+	int error;
+
 	for (;;) {
-		if (resp->data)
+		if (resp->data && resp->buf != NULL)
+			error = ipc_port_receive_buffer(req_port, &ipch, resp->buf,
+							resp->buflen, &page);
+		else if (resp->data)
 			error = ipc_port_receive(req_port, &ipch, &page);
 		else
 			error = ipc_port_receive(req_port, &ipch, NULL);
 		if (error != 0) {
-			if (error != ERROR_AGAIN) {
-				/*
-				 * XXX
-				 * Free req_port.
-				 */
+			if (error != ERROR_AGAIN)
 				return (error);
-			}
 
 			error = ipc_port_wait(req_port);
 			if (error != 0) {
-				if (error != ERROR_AGAIN) {
-					/*
-					 * XXX
-					 * Free req_port.
-					 */
+				if (error != ERROR_AGAIN)
 					return (error);
-				}
 			}
 			continue;
 		}
 
 		/*
-		 * Some other port sending to us, go to
-		 * the next message.
+		 * Some other port sending to us, or a reply
+		 * to an earlier request, go to the next message.
 		 */
-		if (ipch.ipchdr_src != req->dst) {
-			if (resp->data && page != NULL) {
-				error = vm_page_free(page);
+		if (ipch.ipchdr_src != req->dst ||
+		    ipch.ipchdr_cookie != cookie) {
+			if (resp->data && page != NULL && page != resp->buf) {
+				error = vm_free(page, ipch.ipchdr_npages * PAGE_SIZE);
 				if (error != 0)
-					fatal("vm_page_free failed", error);
+					fatal("vm_free failed", error);
 			}
 			continue;
 		}
@@ -129,31 +181,46 @@ ipc_request(const struct ipc_request_message *req,
 		 * That's an error.
 		 */
 		if ((ipch.ipchdr_msg & IPC_MSG_MASK) !=
-		    (req->msg & IPC_MSG_MASK) ||
-		    (ipch.ipchdr_cookie != (ipc_cookie_t)(uintptr_t)req)) {
-			if (resp->data && page != NULL) {
-				error = vm_page_free(page);
+		    (req->msg & IPC_MSG_MASK)) {
+			if (resp->data && page != NULL && page != resp->buf) {
+				error = vm_free(page, ipch.ipchdr_npages * PAGE_SIZE);
 				if (error != 0)
-					fatal("vm_page_free failed", error);
+					fatal("vm_free failed", error);
 			}
 			return (ERROR_UNEXPECTED);
 		}
 
 		switch (ipch.ipchdr_msg & IPC_MSG_FLAG_MASK) {
 		case IPC_MSG_FLAG_REPLY:
+			if (resp->data && page != NULL && resp->buf != NULL &&
+			    page != resp->buf) {
+				/*
+				 * The reply couldn't be placed in the buffer,
+				 * so copy it there instead.
+				 */
+				len = ipch.ipchdr_npages * PAGE_SIZE;
+				if (len <= resp->buflen)
+					memcpy(resp->buf, page, len);
+				error = vm_recycle(page, len);
+				if (error != 0)
+					fatal("vm_recycle failed", error);
+				if (len > resp->buflen)
+					return (ERROR_FULL);
+				page = resp->buf;
+			}
 			resp->param = ipch.ipchdr_param;
 			if (resp->data)
 				resp->page = page;
 			return (0);
 		case IPC_MSG_FLAG_ERROR:
-			if (resp->data && page != NULL) {
+			if (resp->data && page != NULL && page != resp->buf) {
 				/*
 				 * No data may be sent with
 				 * error messages right now.
 				 */
-				error = vm_page_free(page);
+				error = vm_free(page, ipch.ipchdr_npages * PAGE_SIZE);
 				if (error != 0)
-					fatal("vm_page_free failed", error);
+					fatal("vm_free failed", error);
 				return (ERROR_UNEXPECTED);
 			}
 			/*
@@ -168,10 +235,10 @@ ipc_request(const struct ipc_request_message *req,
 				resp->error = ipch.ipchdr_param;
 			return (0);
 		default:
-			if (resp->data && page != NULL) {
-				error = vm_page_free(page);
+			if (resp->data && page != NULL && page != resp->buf) {
+				error = vm_free(page, ipch.ipchdr_npages * PAGE_SIZE);
 				if (error != 0)
-					fatal("vm_page_free failed", error);
+					fatal("vm_free failed", error);
 			}
 			return (ERROR_UNEXPECTED);
 		}
@@ -31,6 +31,13 @@ struct ipc_response_message {
 	ipc_parameter_t param;
 	void *page;
 
+	/*
+	 * The caller may post a buffer of whole pages, from vm_alloc,
+	 * for data to be placed in, in which case page is set to it.
+	 */
+	void *buf;
+	size_t buflen;
+
 	/*
 	 * Error case.
 	 */
@@ -146,9 +146,9 @@ ipc_message_drop(const struct ipc_header *ipch, void *page)
 		ipc_message_print(ipch, page);
 	}
 	if (page != NULL) {
-		error = vm_page_free(page);
+		error = vm_free(page, ipch->ipchdr_npages * PAGE_SIZE);
 		if (error != 0)
-			fatal("vm_page_free failed", error);
+			fatal("vm_free failed", error);
 	}
 }
 
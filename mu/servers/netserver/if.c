@@ -46,7 +46,7 @@ static void arp_input(struct if_context *, const void *, size_t);
 static void arp_request(struct if_context *, uint32_t);
 static void if_get_info_callback(struct if_context *,
 				 ipc_parameter_t, void *);
-static void if_receive_callback(const struct ipc_dispatch *,
+static void if_receive_callback(struct ipc_dispatch *,
 				const struct ipc_dispatch_handler *,
 				const struct ipc_header *, void *);
 static void if_receive_thread(void *);
@@ -79,6 +79,8 @@ if_attach(struct if_context *ifc, const char *ifname)
 	req.page = NULL;
 
 	resp.data = true;
+	resp.buf = NULL;
+	resp.buflen = 0;
 
 	error = ipc_request(&req, &resp);
 	if (error != 0)
@@ -255,7 +257,7 @@ if_get_info_callback(struct if_context *ifc, ipc_parameter_t param, void *page)
 }
 
 static void
-if_receive_callback(const struct ipc_dispatch *id,
+if_receive_callback(struct ipc_dispatch *id,
 		    const struct ipc_dispatch_handler *idh,
 		    const struct ipc_header *ipch, void *page)
 {
@@ -59,7 +59,7 @@ main(int argc, char *argv[])
 }
 
 static void
-netserver_ipc_callback(const struct ipc_dispatch *id,
+netserver_ipc_callback(struct ipc_dispatch *id,
 		       const struct ipc_dispatch_handler *idh,
 		       const struct ipc_header *ipch, void *page)
 {